@@ -32,17 +32,29 @@
 #include "bsdiff_align_multi.h"
 #include "bsdiff_alignment.h"
 #include "bsdiff_writepatch.h"
+#include "codec_buf.h"
 #include "mapfile.h"
+#include "parallel_pool.h"
 #include "warnp.h"
 
 static void usage(void)
 {
 
 	(void)fprintf(stderr, "usage: bsdiff-big [-B blocksize] [-L diglen] "
-	    "[-P ncores] oldfile newfiles patchfile\n");
+	    "[-P ncores] [-a] [-c codec] [-i] [-v]\n"
+	    "    oldfile newfiles patchfile\n");
 	exit(1);
 }
 
+/* Add a block's alignment to the patch.  Callback from align_multi. */
+static int
+writeblock(void * cookie, BSDIFF_ALIGNMENT A)
+{
+	struct bsdiff_writepatch * patch = cookie;
+
+	return (bsdiff_writepatch_append(patch, A));
+}
+
 #define OPT_EPARSE(ch, optarg) do {				\
 	warnp("Error parsing argument: -%c %s", ch, optarg);	\
 	exit(1);						\
@@ -60,10 +72,17 @@ main(int argc, char * argv[])
 	intmax_t optparse;
 	size_t B, L, P;
 	int ch;
+	int poolflags;
+	int codec;
+	int patchflags;
+	int verbose;
 	uint8_t *old, *new;
 	size_t oldsize, newsize;
+	double tbusy, tidle;
+	size_t nsteals;
 	int oldfd, newfd;
-	BSDIFF_ALIGNMENT A;
+	struct parallel_pool * pool;
+	struct bsdiff_writepatch * patch;
 
 	WARNP_INIT;
 
@@ -71,9 +90,13 @@ main(int argc, char * argv[])
 	B = 1048576;
 	L = 8000;
 	P = 1;
+	poolflags = 0;
+	codec = CODEC_BZIP2;
+	patchflags = 0;
+	verbose = 0;
 
 	/* Process command line. */
-	while ((ch = getopt(argc, argv, "B:L:P:")) != -1) {
+	while ((ch = getopt(argc, argv, "B:L:P:ac:iv")) != -1) {
 		switch((char)ch) {
 		case 'B':
 			optparse = strtoimax(optarg, &eptr, 0);
@@ -99,6 +122,22 @@ main(int argc, char * argv[])
 				OPT_ERANGE(ch, optarg, "1", "64");
 			P = optparse;
 			break;
+		case 'a':
+			poolflags |= PARALLEL_POOL_PIN;
+			break;
+		case 'c':
+			if ((codec = codec_lookup(optarg)) == -1) {
+				warn0("Compression codec not supported: %s",
+				    optarg);
+				exit(1);
+			}
+			break;
+		case 'i':
+			patchflags |= BSDIFF_WRITEPATCH_INPLACE;
+			break;
+		case 'v':
+			verbose = 1;
+			break;
 		default:
 			usage();
 		}
@@ -120,19 +159,48 @@ main(int argc, char * argv[])
 		exit(1);
 	}
 
-	/* Align the files in parts. */
-	if ((A = bsdiff_align_multi(new, newsize, old, oldsize,
-	    B, L, P)) == NULL) {
-		warnp("bsdiff_align_multi");
+	/* Launch the computation threads. */
+	if ((pool = parallel_pool_create(P, poolflags)) == NULL) {
+		warnp("parallel_pool_create");
 		exit(1);
 	}
 
-	/* Create the patch file. */
-	printf("Writing out patch file...\n");
-	bsdiff_writepatch(argv[2], A, new, newsize, old);
+	/*
+	 * Start writing the patch file.  With a single thread there is
+	 * nothing to gain from compressing in the pool, and doing it in this
+	 * thread writes a patch which older versions of bspatch can read.
+	 */
+	if ((patch = bsdiff_writepatch_open(argv[2], new, newsize,
+	    old, codec, patchflags, (P > 1) ? pool : NULL)) == NULL)
+		exit(1);
+
+	/*
+	 * Align the files in parts, writing each part of the patch while the
+	 * computation threads align the parts which follow it.
+	 */
+	printf("Computing alignments...\n");
+	if (bsdiff_align_multi_stream(new, newsize, old, oldsize, B, L, pool,
+	    writeblock, patch)) {
+		warnp("bsdiff_align_multi_stream");
+		bsdiff_writepatch_abort(patch);
+		exit(1);
+	}
+
+	/* Finish the patch file. */
+	printf("Finishing patch file...\n");
+	if (bsdiff_writepatch_close(patch))
+		exit(1);
+
+	/* Report how well the work was spread across the threads. */
+	parallel_pool_stats(pool, &tbusy, &tidle, &nsteals);
+	if (verbose && (tbusy + tidle > 0))
+		printf("Threads were idle for %.1f%% of the time "
+		    "(%.1f of %.1f thread-seconds; %zu work steals)\n",
+		    100.0 * tidle / (tbusy + tidle), tidle, tbusy + tidle,
+		    nsteals);
 
-	/* Free the alignment we constructed. */
-	bsdiff_alignment_free(A);
+	/* Shut down the computation threads. */
+	parallel_pool_destroy(pool);
 
 	/* Release memory mappings. */
 	unmapfile(new, newfd, newsize);
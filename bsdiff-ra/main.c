@@ -32,14 +32,17 @@
 #include "bsdiff_align_multi.h"
 #include "bsdiff_alignment.h"
 #include "bsdiff_ra_writepatch.h"
+#include "codec_buf.h"
 #include "mapfile.h"
+#include "parallel_pool.h"
 #include "warnp.h"
 
 static void usage(void)
 {
 
 	(void)fprintf(stderr, "usage: bsdiff-big [-b seglen] [-B blocksize] "
-	    "[-L diglen] [-P ncores] oldfile newfile patchfile\n");
+	    "[-L diglen] [-P ncores] [-a] [-c codec] [-s sublen]\n"
+	    "    oldfile newfile patchfile\n");
 	exit(1);
 }
 
@@ -58,11 +61,14 @@ main(int argc, char * argv[])
 {
 	char * eptr;
 	intmax_t optparse;
-	size_t b, B, L, P;
+	size_t b, B, L, P, s;
 	int ch;
+	int poolflags;
+	int codec;
 	uint8_t *old, *new;
 	size_t oldsize, newsize;
 	int oldfd, newfd;
+	struct parallel_pool * pool;
 	BSDIFF_ALIGNMENT A;
 
 	WARNP_INIT;
@@ -72,9 +78,12 @@ main(int argc, char * argv[])
 	B = 1048576;
 	L = 8000;
 	P = 1;
+	s = 0;
+	poolflags = 0;
+	codec = CODEC_BZIP2;
 
 	/* Process command line. */
-	while ((ch = getopt(argc, argv, "b:B:L:P:")) != -1) {
+	while ((ch = getopt(argc, argv, "b:B:L:P:ac:s:")) != -1) {
 		switch((char)ch) {
 		case 'b':
 			optparse = strtoimax(optarg, &eptr, 0);
@@ -108,6 +117,25 @@ main(int argc, char * argv[])
 				OPT_ERANGE(ch, optarg, "1", "64");
 			P = optparse;
 			break;
+		case 'a':
+			poolflags |= PARALLEL_POOL_PIN;
+			break;
+		case 'c':
+			if ((codec = codec_lookup(optarg)) == -1) {
+				warn0("Compression codec not supported: %s",
+				    optarg);
+				exit(1);
+			}
+			break;
+		case 's':
+			optparse = strtoimax(optarg, &eptr, 0);
+			if (*eptr != '\0')
+				OPT_EPARSE(ch, optarg);
+			if ((optparse != 0) &&
+			    ((optparse < 0x200) || (optparse > 0x1000000)))
+				OPT_ERANGE(ch, optarg, "2^9", "2^24");
+			s = optparse;
+			break;
 		default:
 			usage();
 		}
@@ -136,21 +164,32 @@ main(int argc, char * argv[])
 		exit(1);
 	}
 
+	/* Launch the computation threads. */
+	if ((pool = parallel_pool_create(P, poolflags)) == NULL) {
+		warnp("parallel_pool_create");
+		exit(1);
+	}
+
 	/* Align the files in parts. */
+	printf("Computing alignments...\n");
 	if ((A = bsdiff_align_multi(new, newsize, old, oldsize,
-	    B, L, P)) == NULL) {
+	    B, L, pool)) == NULL) {
 		warnp("bsdiff_align_multi");
 		exit(1);
 	}
 
 	/* Create the patch file. */
 	printf("Writing out patch file...\n");
-	if (bsdiff_ra_writepatch(argv[2], b, A, new, newsize, old))
+	if (bsdiff_ra_writepatch(argv[2], b, s, A, new, newsize, old,
+	    codec, pool))
 		exit(1);
 
 	/* Free the alignment we constructed. */
 	bsdiff_alignment_free(A);
 
+	/* Shut down the computation threads. */
+	parallel_pool_destroy(pool);
+
 	/* Release memory mappings. */
 	unmapfile(new, newfd, newsize);
 	unmapfile(old, oldfd, oldsize);
@@ -25,42 +25,109 @@
  */
 
 #include <err.h>
+#include <errno.h>
+#include <inttypes.h>
 #include <stdint.h>
+#include <unistd.h>
 
 #include "mapfile.h"
+#include "warnp.h"
 
-#include "bsdiff_align.h"
-#include "bsdiff_alignment.h"
+#include "bsdiff_create.h"
 #include "bsdiff_writepatch.h"
 
+#define USAGE	"usage: %s [-i] [-M memlimit] oldfile newfile patchfile\n"
+
+/* Parse a number of bytes, optionally followed by k, M, G, or T. */
+static int
+parsesize(const char *s, uint64_t *size)
+{
+	uintmax_t x;
+	char *eptr;
+	int shift;
+
+	errno = 0;
+	x = strtoumax(s, &eptr, 0);
+	if ((errno != 0) || (eptr == s) || (s[0] == '-'))
+		return (-1);
+	switch (*eptr) {
+	case '\0':
+		shift = 0;
+		break;
+	case 'k': case 'K':
+		shift = 10;
+		break;
+	case 'm': case 'M':
+		shift = 20;
+		break;
+	case 'g': case 'G':
+		shift = 30;
+		break;
+	case 't': case 'T':
+		shift = 40;
+		break;
+	default:
+		return (-1);
+	}
+	if ((shift != 0) && (*++eptr != '\0'))
+		return (-1);
+	if (x > (UINT64_MAX >> shift))
+		return (-1);
+	*size = (uint64_t)x << shift;
+	return (0);
+}
+
 int
 main(int argc, char *argv[])
 {
 	int oldfd, newfd;
 	uint8_t *old, *new;
 	size_t oldsize, newsize;
-	BSDIFF_ALIGNMENT A;
+	struct bsdiff_options opts;
+	int ch, rc;
 
-	if (argc != 4)
-		errx(1, "usage: %s oldfile newfile patchfile\n", argv[0]);
+	WARNP_INIT;
+	bsdiff_options_init(&opts);
 
-	/* Map the old file into memory. */
-	if ((old = mapfile(argv[1], &oldfd, &oldsize)) == NULL)
-		err(1, "Cannot map file: %s", argv[1]);
+	while ((ch = getopt(argc, argv, "iM:")) != -1) {
+		switch (ch) {
+		case 'i':
+			/* Write a patch which can be applied in place. */
+			opts.flags |= BSDIFF_WRITEPATCH_INPLACE;
+			break;
+		case 'M':
+			/*
+			 * Suffix sort the whole old file if that fits in
+			 * the memory limit, or align blocks if it doesn't.
+			 */
+			if (parsesize(optarg, &opts.memlimit) ||
+			    (opts.memlimit == 0))
+				errx(1, "Invalid memory limit: %s", optarg);
+			opts.matcher = BSDIFF_MATCHER_AUTO;
+			break;
+		default:
+			errx(1, USAGE, argv[0]);
+		}
+	}
 
-	/* Map the new file into memory. */
-	if ((new = mapfile(argv[2], &newfd, &newsize)) == NULL)
-		err(1, "Cannot map file: %s", argv[2]);
+	/* We should have three arguments left (USAGE needs argv[0]). */
+	if (argc - optind != 3)
+		errx(1, USAGE, argv[0]);
+	argc -= optind;
+	argv += optind;
 
-	/* Compute an alignment of the two files. */
-	if ((A = bsdiff_align(new, newsize, old, oldsize)) == NULL)
-		err(1, "Error aligning files");
+	/* Map the old file into memory. */
+	if ((old = mapfile(argv[0], &oldfd, &oldsize)) == NULL)
+		err(1, "Cannot map file: %s", argv[0]);
 
-	/* Create the patch file. */
-	bsdiff_writepatch(argv[3], A, new, newsize, old);
+	/* Map the new file into memory. */
+	if ((new = mapfile(argv[1], &newfd, &newsize)) == NULL)
+		err(1, "Cannot map file: %s", argv[1]);
 
-	/* Free the alignment we constructed. */
-	bsdiff_alignment_free(A);
+	/* Align the two files and create the patch file. */
+	if ((rc = bsdiff_create(argv[2], new, newsize, old, oldsize,
+	    &opts)) != BSDIFF_OK)
+		errx(1, "%s", bsdiff_strerror(rc));
 
 	/* Release memory mappings. */
 	unmapfile(new, newfd, newsize);
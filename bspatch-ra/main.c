@@ -27,64 +27,233 @@
 #include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
 
 #include "bsdiff_ra_read.h"
+#include "parallel_pool.h"
 #include "warnp.h"
 
 static void usage(void)
 {
 
 	(void)fprintf(stderr,
-	    "usage: bspatch-ra oldfile patchfile START LEN\n");
+	    "usage: bspatch-ra [-A depth] [-C cachesize] [-m] [-P ncores] "
+	    "[-R nsegs] [-r readlen] [-v]\n"
+	    "                  oldfile patchfile START LEN\n");
 	exit(1);
 }
 
+/* Read len bytes at start in readlen-byte pieces, one at a time. */
+static size_t
+readsync(struct bsdiff_ra_read_file * f, uint8_t * buf, size_t start,
+    size_t len, size_t readlen)
+{
+	size_t pos, rlen;
+	ssize_t lenread;
+
+	for (pos = 0; pos < len; pos += lenread) {
+		rlen = (len - pos > readlen) ? readlen : len - pos;
+		if ((lenread = bsdiff_ra_read_pread(f, &buf[pos], rlen,
+		    start + pos)) == -1) {
+			warnp("Patching failed");
+			exit(1);
+		}
+		if ((size_t)(lenread) < rlen) {
+			pos += lenread;
+			break;
+		}
+	}
+
+	/* Return the number of bytes read. */
+	return (pos);
+}
+
+/*
+ * Read len bytes at start in readlen-byte pieces, keeping up to depth pieces
+ * in flight at once.
+ */
+static size_t
+readasync(struct bsdiff_ra_read_file * f, uint8_t * buf, size_t start,
+    size_t len, size_t readlen, size_t depth)
+{
+	size_t pos, rlen, rpos;
+	size_t npend, end;
+	ssize_t lenread;
+	void * cookie;
+
+	for (pos = npend = 0, end = len; (pos < len) || (npend > 0); ) {
+		/* Submit another piece if we have room. */
+		if ((pos < len) && (npend < depth)) {
+			rlen = (len - pos > readlen) ? readlen : len - pos;
+			if (bsdiff_ra_read_submit(f, &buf[pos], rlen,
+			    start + pos, (void *)(uintptr_t)pos)) {
+				warnp("Patching failed");
+				exit(1);
+			}
+			pos += rlen;
+			npend++;
+			continue;
+		}
+
+		/* Wait for a piece to complete. */
+		if (bsdiff_ra_read_reap(f, &cookie, &lenread) ||
+		    (lenread == -1)) {
+			warnp("Patching failed");
+			exit(1);
+		}
+		npend--;
+
+		/* If the piece is short, we reached EOF. */
+		rpos = (uintptr_t)cookie;
+		rlen = (len - rpos > readlen) ? readlen : len - rpos;
+		if (((size_t)(lenread) < rlen) && (rpos + lenread < end))
+			end = rpos + lenread;
+	}
+
+	/* Return the number of bytes read. */
+	return (end);
+}
+
+#define OPT_EPARSE(ch, optarg) do {				\
+	warnp("Error parsing argument: -%c %s", ch, optarg);	\
+	exit(1);						\
+} while (0)
+
 int
 main(int argc, char * argv[])
 {
+	char * eptr;
+	uintmax_t optparse;
+	size_t adepth, cachesize, nra, readlen, P;
+	int ch;
+	int verbose;
+	int flags;
 	size_t start, len;
-	ssize_t lenread;
+	size_t pos;
 	struct bsdiff_ra_read_file * f;
+	struct parallel_pool * pool;
 	uint8_t * buf;
+	uint64_t hits, misses;
+	size_t cached;
 
 	WARNP_INIT;
 
+	/* Set default values. */
+	adepth = 0;
+	flags = 0;
+	cachesize = BSDIFF_RA_READ_CACHE_DEFAULT;
+	readlen = 0;
+	P = 1;
+	nra = BSDIFF_RA_READ_READAHEAD_DEFAULT;
+	verbose = 0;
+
+	/* Process command line. */
+	while ((ch = getopt(argc, argv, "A:C:mP:R:r:v")) != -1) {
+		switch((char)ch) {
+		case 'A':
+			optparse = strtoumax(optarg, &eptr, 0);
+			if (*eptr != '\0')
+				OPT_EPARSE(ch, optarg);
+			adepth = optparse;
+			break;
+		case 'C':
+			optparse = strtoumax(optarg, &eptr, 0);
+			if (*eptr != '\0')
+				OPT_EPARSE(ch, optarg);
+			cachesize = optparse;
+			break;
+		case 'm':
+			flags |= BSDIFF_RA_READ_MMAP;
+			break;
+		case 'P':
+			optparse = strtoumax(optarg, &eptr, 0);
+			if ((*eptr != '\0') || (optparse == 0))
+				OPT_EPARSE(ch, optarg);
+			P = optparse;
+			break;
+		case 'R':
+			optparse = strtoumax(optarg, &eptr, 0);
+			if (*eptr != '\0')
+				OPT_EPARSE(ch, optarg);
+			nra = optparse;
+			break;
+		case 'r':
+			optparse = strtoumax(optarg, &eptr, 0);
+			if ((*eptr != '\0') || (optparse == 0))
+				OPT_EPARSE(ch, optarg);
+			readlen = optparse;
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
 	/* We should have four arguments. */
-	if (argc != 5)
+	if (argc != 4)
 		usage();
 
 	/* Open the patch file and the old file. */
-	if ((f = bsdiff_ra_read_open(argv[2], argv[1])) == NULL) {
+	if ((f = bsdiff_ra_read_open(argv[1], argv[0], flags)) == NULL) {
 		warnp("Cannot open patching context");
 		exit(1);
 	}
+	bsdiff_ra_read_setcache(f, cachesize);
+	bsdiff_ra_read_setreadahead(f, nra);
+
+	/* Launch threads for patching segments in parallel if requested. */
+	pool = NULL;
+	if (P > 1) {
+		if ((pool = parallel_pool_create(P, 0)) == NULL) {
+			warnp("parallel_pool_create");
+			exit(1);
+		}
+		bsdiff_ra_read_setpool(f, pool);
+	}
 
 	/* Parse start and length, and allocate a buffer. */
-	start = strtoumax(argv[3], NULL, 0);
-	len = strtoumax(argv[4], NULL, 0);
+	start = strtoumax(argv[2], NULL, 0);
+	len = strtoumax(argv[3], NULL, 0);
 	if ((buf = malloc(len)) == NULL) {
 		warnp("Cannot allocate %zu-byte buffer", len);
 		exit(1);
 	}
 
-	/* Perform patching. */
-	if ((lenread = bsdiff_ra_read_pread(f, buf, len, start)) == -1) {
-		warnp("Patching failed");
-		exit(1);
-	}
-	if ((size_t)(lenread) < len)
-		warn0("Reached EOF, read %zu / %zu bytes",
-		    (size_t)lenread, len);
+	/* Perform patching, in readlen-byte pieces if requested. */
+	if ((readlen == 0) || (readlen > len))
+		readlen = len;
+	if (adepth > 0)
+		pos = readasync(f, buf, start, len, readlen, adepth);
+	else
+		pos = readsync(f, buf, start, len, readlen);
+	if (pos < len)
+		warn0("Reached EOF, read %zu / %zu bytes", pos, len);
 
 	/* Write new file data out. */
-	if (fwrite(buf, lenread, 1, stdout) != 1) {
+	if ((pos > 0) && (fwrite(buf, pos, 1, stdout) != 1)) {
 		warnp("fwrite");
 		exit(1);
 	}
 
+	/* Report how well the cache worked. */
+	if (verbose) {
+		bsdiff_ra_read_stats(f, &hits, &misses, &cached);
+		fprintf(stderr, "Segment cache: %ju hits, %ju misses, "
+		    "%zu bytes cached\n", (uintmax_t)hits, (uintmax_t)misses,
+		    cached);
+	}
+
 	/* Free allocated buffer. */
 	free(buf);
 
 	/* Close the patching context. */
 	bsdiff_ra_read_close(f);
+
+	/* Shut down the patching threads. */
+	if (pool != NULL)
+		parallel_pool_destroy(pool);
 }
@@ -27,181 +27,199 @@
 #include <sys/cdefs.h>
 __FBSDID("$FreeBSD$");
 
-#include <bzlib.h>
+#include <sys/stat.h>
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <err.h>
+#include <errno.h>
 #include <unistd.h>
 #include <fcntl.h>
 
+#include "bspatch_apply.h"
+#include "mapfile.h"
+
 #ifndef O_BINARY
 #define O_BINARY 0
 #endif
 
-static off_t offtin(u_char *buf)
+/* The files involved in applying a patch. */
+struct files {
+	const char * newname;
+	const char * patchname;
+	const u_char * old;	/* Old data, or NULL if it's in the new file. */
+	int newfd;
+	int patchfd;
+};
+
+/* Read old data.  Callback from bspatch_apply. */
+static int read_old(void * cookie, uint64_t pos, uint8_t * buf, size_t len)
+{
+	struct files * F = cookie;
+	ssize_t n;
+
+	/* If we have the old data, copy it */
+	if (F->old != NULL) {
+		memcpy(buf, F->old + pos, len);
+		return 0;
+	}
+
+	/* Otherwise we're patching in place, so read the new file */
+	while (len > 0) {
+		if ((n = pread(F->newfd, buf, len, pos)) == -1) {
+			warn("%s", F->newname);
+			return -1;
+		}
+		if (n == 0) {
+			warnx("%s: Unexpected end of file", F->newname);
+			return -1;
+		}
+		buf += n;
+		len -= n;
+		pos += n;
+	}
+
+	return 0;
+}
+
+/* Read part of the patch.  Callback from bspatch_apply. */
+static ssize_t read_patch(void * cookie, uint64_t pos, uint8_t * buf,
+    size_t len)
+{
+	struct files * F = cookie;
+	ssize_t n;
+
+	if ((n = pread(F->patchfd, buf, len, pos)) == -1)
+		warn("%s", F->patchname);
+	return n;
+}
+
+/* Write out new data.  Callback from bspatch_apply. */
+static int write_new(void * cookie, uint64_t pos, const uint8_t * buf,
+    size_t len)
 {
-	off_t y;
+	struct files * F = cookie;
+	ssize_t n;
+
+	while (len > 0) {
+		if ((n = pwrite(F->newfd, buf, len, pos)) == -1) {
+			warn("%s", F->newname);
+			return -1;
+		}
+		buf += n;
+		len -= n;
+		pos += n;
+	}
 
-	y=buf[7]&0x7F;
-	y=y*256;y+=buf[6];
-	y=y*256;y+=buf[5];
-	y=y*256;y+=buf[4];
-	y=y*256;y+=buf[3];
-	y=y*256;y+=buf[2];
-	y=y*256;y+=buf[1];
-	y=y*256;y+=buf[0];
+	return 0;
+}
 
-	if(buf[7]&0x80) y=-y;
+/* Remove a temporary new file, then exit with an error. */
+static void discard(const char * tmpname, const char * name)
+{
 
-	return y;
+	warn("%s", name);
+	unlink(tmpname);
+	exit(1);
 }
 
 int main(int argc,char * argv[])
 {
-	FILE * f, * cpf, * dpf, * epf;
-	BZFILE * cpfbz2, * dpfbz2, * epfbz2;
-	int cbz2err, dbz2err, ebz2err;
-	int fd;
-	ssize_t oldsize,newsize;
-	ssize_t bzctrllen,bzdatalen;
-	u_char header[32],buf[8];
-	u_char *old, *new;
-	off_t oldpos,newpos;
-	off_t ctrl[3];
-	off_t lenread;
-	off_t i;
+	struct files F;
+	struct stat oldsb, newsb;
+	int oldfd;
+	int newexists;
+	size_t oldsize;
+	uint64_t newsize;
+	u_char *oldmap;
+	char *tmpname;
+	mode_t mask;
+	int rc;
 
 	if(argc!=4) errx(1,"usage: %s oldfile newfile patchfile\n",argv[0]);
+	F.newname=argv[2];
+	F.patchname=argv[3];
 
 	/* Open patch file */
-	if ((f = fopen(argv[3], "rb")) == NULL)
-		err(1, "fopen(%s)", argv[3]);
+	if((F.patchfd=open(argv[3],O_RDONLY|O_BINARY))<0)
+		err(1,"%s",argv[3]);
+
+	/* Map the old file rather than reading it into memory */
+	if((oldmap=mapfile(argv[1],&oldfd,&oldsize))==NULL)
+		err(1,"%s",argv[1]);
+	if(fstat(oldfd,&oldsb))
+		err(1,"%s",argv[1]);
+
+	/* Does the new file exist already? */
+	newexists=1;
+	if(stat(argv[2],&newsb)) {
+		if(errno!=ENOENT)
+			err(1,"%s",argv[2]);
+		newexists=0;
+	}
+
+	/*
+	 * If we're patching a file in place, overwrite the old data as we go
+	 * if the patch allows it.
+	 */
+	rc=BSPATCH_ENOTINPLACE;
+	if(newexists && (oldsb.st_dev==newsb.st_dev) &&
+	    (oldsb.st_ino==newsb.st_ino)) {
+		if((F.newfd=open(argv[2],O_RDWR|O_BINARY))<0)
+			err(1,"%s",argv[2]);
+		F.old=NULL;
+		rc=bspatch_apply(oldsize,read_old,read_patch,write_new,&F,
+		    BSPATCH_INPLACE|BSPATCH_READAHEAD,&newsize);
+		if(rc==BSPATCH_OK) {
+			/* Drop anything left past the end of the new data */
+			if(ftruncate(F.newfd,newsize))
+				err(1,"%s",argv[2]);
+		} else if(rc!=BSPATCH_ENOTINPLACE)
+			errx(1,"%s",bspatch_strerror(rc));
+		if(close(F.newfd)==-1)
+			err(1,"%s",argv[2]);
+	}
 
 	/*
-	File format:
-		0	8	"BSDIFF40"
-		8	8	X
-		16	8	Y
-		24	8	sizeof(newfile)
-		32	X	bzip2(control block)
-		32+X	Y	bzip2(diff block)
-		32+X+Y	???	bzip2(extra block)
-	with control block a set of triples (x,y,z) meaning "add x bytes
-	from oldfile to x bytes from the diff block; copy y bytes from the
-	extra block; seek forwards in oldfile by z bytes".
-	*/
-
-	/* Read header */
-	if (fread(header, 1, 32, f) < 32) {
-		if (feof(f))
-			errx(1, "Corrupt patch\n");
-		err(1, "fread(%s)", argv[3]);
+	 * Otherwise, write the new file under a temporary name in the same
+	 * directory and rename it into place once the whole patch has been
+	 * applied, so that a bad patch leaves any existing file (which may be
+	 * the old file) untouched.  The old file stays mapped throughout.
+	 */
+	if(rc==BSPATCH_ENOTINPLACE) {
+		if((tmpname=malloc(strlen(argv[2])+8))==NULL) err(1,NULL);
+		sprintf(tmpname,"%s.XXXXXX",argv[2]);
+		if((F.newfd=mkstemp(tmpname))<0)
+			err(1,"%s",tmpname);
+		F.old=oldmap;
+		rc=bspatch_apply(oldsize,read_old,read_patch,write_new,&F,
+		    BSPATCH_READAHEAD,&newsize);
+		if(rc!=BSPATCH_OK) {
+			unlink(tmpname);
+			errx(1,"%s",bspatch_strerror(rc));
+		}
+
+		/* Keep the mode of a file we replace, or honour the umask */
+		if(newexists)
+			newsb.st_mode&=07777;
+		else {
+			mask=umask(0);
+			umask(mask);
+			newsb.st_mode=0666&~mask;
+		}
+		if(fchmod(F.newfd,newsb.st_mode) || close(F.newfd))
+			discard(tmpname,tmpname);
+		if(rename(tmpname,argv[2]))
+			discard(tmpname,argv[2]);
+		free(tmpname);
 	}
 
-	/* Check for appropriate magic */
-	if (memcmp(header, "BSDIFF40", 8) != 0)
-		errx(1, "Corrupt patch\n");
-
-	/* Read lengths from header */
-	bzctrllen=offtin(header+8);
-	bzdatalen=offtin(header+16);
-	newsize=offtin(header+24);
-	if((bzctrllen<0) || (bzdatalen<0) || (newsize<0))
-		errx(1,"Corrupt patch\n");
-
-	/* Close patch file and re-open it via libbzip2 at the right places */
-	if (fclose(f))
-		err(1, "fclose(%s)", argv[3]);
-	if ((cpf = fopen(argv[3], "rb")) == NULL)
-		err(1, "fopen(%s)", argv[3]);
-	if (fseeko(cpf, 32, SEEK_SET))
-		err(1, "fseeko(%s, %lld)", argv[3],
-		    (long long)32);
-	if ((cpfbz2 = BZ2_bzReadOpen(&cbz2err, cpf, 0, 0, NULL, 0)) == NULL)
-		errx(1, "BZ2_bzReadOpen, bz2err = %d", cbz2err);
-	if ((dpf = fopen(argv[3], "rb")) == NULL)
-		err(1, "fopen(%s)", argv[3]);
-	if (fseeko(dpf, 32 + bzctrllen, SEEK_SET))
-		err(1, "fseeko(%s, %lld)", argv[3],
-		    (long long)(32 + bzctrllen));
-	if ((dpfbz2 = BZ2_bzReadOpen(&dbz2err, dpf, 0, 0, NULL, 0)) == NULL)
-		errx(1, "BZ2_bzReadOpen, bz2err = %d", dbz2err);
-	if ((epf = fopen(argv[3], "rb")) == NULL)
-		err(1, "fopen(%s)", argv[3]);
-	if (fseeko(epf, 32 + bzctrllen + bzdatalen, SEEK_SET))
-		err(1, "fseeko(%s, %lld)", argv[3],
-		    (long long)(32 + bzctrllen + bzdatalen));
-	if ((epfbz2 = BZ2_bzReadOpen(&ebz2err, epf, 0, 0, NULL, 0)) == NULL)
-		errx(1, "BZ2_bzReadOpen, bz2err = %d", ebz2err);
-
-	if(((fd=open(argv[1],O_RDONLY|O_BINARY,0))<0) ||
-		((oldsize=lseek(fd,0,SEEK_END))==-1) ||
-		((old=malloc(oldsize+1))==NULL) ||
-		(lseek(fd,0,SEEK_SET)!=0) ||
-		(read(fd,old,oldsize)!=oldsize) ||
-		(close(fd)==-1)) err(1,"%s",argv[1]);
-	if((new=malloc(newsize+1))==NULL) err(1,NULL);
-
-	oldpos=0;newpos=0;
-	while(newpos<newsize) {
-		/* Read control data */
-		for(i=0;i<=2;i++) {
-			lenread = BZ2_bzRead(&cbz2err, cpfbz2, buf, 8);
-			if ((lenread < 8) || ((cbz2err != BZ_OK) &&
-			    (cbz2err != BZ_STREAM_END)))
-				errx(1, "Corrupt patch\n");
-			ctrl[i]=offtin(buf);
-		};
-
-		/* Sanity-check */
-		if(newpos+ctrl[0]>newsize)
-			errx(1,"Corrupt patch\n");
-
-		/* Read diff string */
-		lenread = BZ2_bzRead(&dbz2err, dpfbz2, new + newpos, ctrl[0]);
-		if ((lenread < ctrl[0]) ||
-		    ((dbz2err != BZ_OK) && (dbz2err != BZ_STREAM_END)))
-			errx(1, "Corrupt patch\n");
-
-		/* Add old data to diff string */
-		for(i=0;i<ctrl[0];i++)
-			if((oldpos+i>=0) && (oldpos+i<oldsize))
-				new[newpos+i]+=old[oldpos+i];
-
-		/* Adjust pointers */
-		newpos+=ctrl[0];
-		oldpos+=ctrl[0];
-
-		/* Sanity-check */
-		if(newpos+ctrl[1]>newsize)
-			errx(1,"Corrupt patch\n");
-
-		/* Read extra string */
-		lenread = BZ2_bzRead(&ebz2err, epfbz2, new + newpos, ctrl[1]);
-		if ((lenread < ctrl[1]) ||
-		    ((ebz2err != BZ_OK) && (ebz2err != BZ_STREAM_END)))
-			errx(1, "Corrupt patch\n");
-
-		/* Adjust pointers */
-		newpos+=ctrl[1];
-		oldpos+=ctrl[2];
-	};
-
-	/* Clean up the bzip2 reads */
-	BZ2_bzReadClose(&cbz2err, cpfbz2);
-	BZ2_bzReadClose(&dbz2err, dpfbz2);
-	BZ2_bzReadClose(&ebz2err, epfbz2);
-	if (fclose(cpf) || fclose(dpf) || fclose(epf))
-		err(1, "fclose(%s)", argv[3]);
-
-	/* Write the new file */
-	if(((fd=open(argv[2],O_CREAT|O_TRUNC|O_WRONLY|O_BINARY,0666))<0) ||
-		(write(fd,new,newsize)!=newsize) || (close(fd)==-1))
-		err(1,"%s",argv[2]);
-
-	free(new);
-	free(old);
+	if(close(F.patchfd)==-1)
+		err(1,"%s",argv[3]);
+
+	if(unmapfile(oldmap,oldfd,oldsize))
+		err(1,"%s",argv[1]);
 
 	return 0;
 }
@@ -25,17 +25,27 @@
  */
 
 #include <assert.h>
+#include <errno.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
-#include "parallel_iter.h"
+#include "parallel_pool.h"
+#include "warnp.h"
 
 #include "blockmatch_psimm.h"
 
 #include "blockmatch_index.h"
 
+/* A copy of the digests, allocated by a thread on a particular NUMA node. */
+struct replica {
+	pthread_mutex_t mtx;
+	double * digests;	/* nblocks * diglen, or NULL if not made yet. */
+};
+
 /* Index structure. */
 struct blockmatch_index {
 	struct blockmatch_psimm_ctx * psimm_ctx;
@@ -45,9 +55,94 @@ struct blockmatch_index {
 	size_t diglen;
 	size_t nblocks;
 	double ** digests;
+	struct parallel_pool * pool;
+	size_t nreplicas;	/* One per NUMA node, or zero. */
+	struct replica * replicas;
 };
 
-/* Compute one part of the index.  Callback from parallel_iter. */
+/* Initialize per-NUMA-node replicas of the index, if we need them. */
+static int
+replicas_init(struct blockmatch_index * index)
+{
+	size_t i;
+
+	/* If the pool threads are all on the same node, do nothing. */
+	index->nreplicas = parallel_pool_nnodes(index->pool);
+	if (index->nreplicas <= 1) {
+		index->nreplicas = 0;
+		index->replicas = NULL;
+		return (0);
+	}
+
+	/* Allocate replica structures; the digests are copied later. */
+	if ((index->replicas =
+	    malloc(index->nreplicas * sizeof(struct replica))) == NULL)
+		goto err0;
+	for (i = 0; i < index->nreplicas; i++) {
+		if ((errno = pthread_mutex_init(&index->replicas[i].mtx,
+		    NULL)) != 0) {
+			warnp("pthread_mutex_init");
+			goto err1;
+		}
+		index->replicas[i].digests = NULL;
+	}
+
+	/* Success! */
+	return (0);
+
+err1:
+	while (i-- > 0)
+		pthread_mutex_destroy(&index->replicas[i].mtx);
+	free(index->replicas);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/*
+ * Return the replica of the digests for the NUMA node the calling thread is
+ * running on, making it if necessary.  Since memory is placed on the node of
+ * the thread which first touches it, the copy is made by the first thread on
+ * each node to perform a search.
+ */
+static double *
+replica_get(const struct blockmatch_index * index)
+{
+	struct replica * R;
+	size_t i;
+
+	/* Find the replica for this node. */
+	R = &index->replicas[parallel_pool_node(index->pool)];
+
+	/* Lock it and fill it in if nobody has yet. */
+	if ((errno = pthread_mutex_lock(&R->mtx)) != 0) {
+		warnp("pthread_mutex_lock");
+		goto err0;
+	}
+	if (R->digests == NULL) {
+		if ((R->digests = malloc(index->nblocks * index->diglen *
+		    sizeof(double))) == NULL)
+			goto err1;
+		for (i = 0; i < index->nblocks; i++)
+			memcpy(&R->digests[i * index->diglen],
+			    index->digests[i], index->diglen * sizeof(double));
+	}
+	if ((errno = pthread_mutex_unlock(&R->mtx)) != 0) {
+		warnp("pthread_mutex_unlock");
+		goto err0;
+	}
+
+	/* Return the copy. */
+	return (R->digests);
+
+err1:
+	pthread_mutex_unlock(&R->mtx);
+err0:
+	/* Failure! */
+	return (NULL);
+}
+
+/* Compute one part of the index.  Callback from parallel_pool. */
 static int
 dodigest(void * cookie, size_t i)
 {
@@ -81,18 +176,22 @@ err0:
 }
 
 /**
- * blockmatch_index_index(buf, len, blocklen, diglen, P):
+ * blockmatch_index_index(buf, len, blocklen, diglen, pool):
  * Split buf[0 .. len - 1] into blocklen-byte blocks, and compute length-diglen
  * digests.  Return an index which can be passed to blockmatch_index_search.
  * If len is not an exact multiple of blocklen, the final block will be in the
  * range [MIN(blocklen / 2, len), 3 * blocklen / 2) bytes.  Compute the index
- * using P threads.
+ * using the threads in the provided pool.  If the pool's threads are spread
+ * across several NUMA nodes, searches from each node will use a local copy of
+ * the index; the pool must not be destroyed until the index is freed.
  */
 struct blockmatch_index *
 blockmatch_index_index(const uint8_t * buf, size_t len, size_t blocklen,
-    size_t diglen, size_t P)
+    size_t diglen, struct parallel_pool * pool)
 {
 	struct blockmatch_index * index;
+	struct parallel_pool_job * job;
+	size_t i;
 
 	/* Sanity-check. */
 	assert(blocklen > 0);
@@ -105,6 +204,7 @@ blockmatch_index_index(const uint8_t * buf, size_t len, size_t blocklen,
 	index->len = len;
 	index->blocklen = blocklen;
 	index->diglen = diglen;
+	index->pool = pool;
 
 	/* Create context for producing length-diglen digests. */
 	if ((index->psimm_ctx = blockmatch_psimm_init(diglen)) == NULL)
@@ -126,18 +226,30 @@ blockmatch_index_index(const uint8_t * buf, size_t len, size_t blocklen,
 	if ((index->digests =
 	    malloc(index->nblocks * sizeof(double *))) == NULL)
 		goto err2;
+	for (i = 0; i < index->nblocks; i++)
+		index->digests[i] = NULL;
 
 	/*
-	 * Compute digests; last one separately due to different length.  The
-	 * incomplete error-handling path is because parallel_iter can fail
-	 * with function calls still in progress.
+	 * Compute digests; last one separately due to different length.  If
+	 * a digest computation fails, the remaining digests are skipped.
 	 */
-	if (parallel_iter(P, index->nblocks, dodigest, index))
-		goto err0;
+	if ((job = parallel_pool_submit(pool, index->nblocks,
+	    dodigest, index)) == NULL)
+		goto err3;
+	if (parallel_pool_wait(job))
+		goto err3;
+
+	/* Prepare for making per-node copies of the digests. */
+	if (replicas_init(index))
+		goto err3;
 
 	/* Success! */
 	return (index);
 
+err3:
+	for (i = 0; i < index->nblocks; i++)
+		free(index->digests[i]);
+	free(index->digests);
 err2:
 	blockmatch_psimm_free(index->psimm_ctx);
 err1:
@@ -156,10 +268,15 @@ ssize_t
 blockmatch_index_search(const struct blockmatch_index * index,
     const uint8_t * buf, size_t len)
 {
+	double * replica = NULL;
 	double * DIG;
 	double score, bestscore;
 	size_t i, besti;
 
+	/* Find our local copy of the digests, if we have them. */
+	if ((index->nreplicas > 0) && ((replica = replica_get(index)) == NULL))
+		goto err0;
+
 	/* Compute the digest of the provided data. */
 	if ((DIG =
 	    blockmatch_psimm_digest(buf, len, index->psimm_ctx)) == NULL)
@@ -169,7 +286,8 @@ blockmatch_index_search(const struct blockmatch_index * index,
 	bestscore = -1;
 	besti = 0;
 	for (i = 0; i < index->nblocks; i++) {
-		score = blockmatch_psimm_score(DIG, index->digests[i],
+		score = blockmatch_psimm_score(DIG, (replica != NULL) ?
+		    &replica[i * index->diglen] : index->digests[i],
 		    index->diglen);
 		if (score > bestscore) {
 			bestscore = score;
@@ -197,6 +315,13 @@ blockmatch_index_free(struct blockmatch_index * index)
 {
 	size_t i;
 
+	/* Free the per-node copies of the digests. */
+	for (i = 0; i < index->nreplicas; i++) {
+		free(index->replicas[i].digests);
+		pthread_mutex_destroy(&index->replicas[i].mtx);
+	}
+	free(index->replicas);
+
 	/* Free the digests. */
 	for (i = 0; i < index->nblocks; i++)
 		free(index->digests[i]);
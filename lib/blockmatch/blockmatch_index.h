@@ -30,19 +30,22 @@
 #include <stdint.h>
 #include <unistd.h>
 
-/* Opaque type. */
+/* Opaque types. */
 struct blockmatch_index;
+struct parallel_pool;
 
 /**
- * blockmatch_index_index(buf, len, blocklen, diglen, P):
+ * blockmatch_index_index(buf, len, blocklen, diglen, pool):
  * Split buf[0 .. len - 1] into blocklen-byte blocks, and compute length-diglen
  * digests.  Return an index which can be passed to blockmatch_index_search.
  * If len is not an exact multiple of blocklen, the final block will be in the
  * range [MIN(blocklen / 2, len), 3 * blocklen / 2) bytes.  Compute the index
- * using P threads.
+ * using the threads in the provided pool.  If the pool's threads are spread
+ * across several NUMA nodes, searches from each node will use a local copy of
+ * the index; the pool must not be destroyed until the index is freed.
  */
 struct blockmatch_index * blockmatch_index_index(const uint8_t *, size_t,
-    size_t, size_t, size_t);
+    size_t, size_t, struct parallel_pool *);
 
 /**
  * blockmatch_index_search(index, buf, len):
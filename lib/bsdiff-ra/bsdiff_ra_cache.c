@@ -0,0 +1,401 @@
+/*-
+ * Copyright 2012 Colin Percival
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions 
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "warnp.h"
+
+#include "bsdiff_ra_cache.h"
+
+/*
+ * Number of independently locked parts of the cache.  Segment i lives in
+ * shard i % NSHARDS, so threads reading neighbouring segments rarely contend
+ * for the same lock.
+ */
+#define NSHARDS	16
+
+/* A cached segment. */
+struct bsdiff_ra_cache_entry {
+	size_t seg;
+	uint8_t * buf;
+	size_t len;
+	atomic_size_t refs;	/* One for the cache, plus one per get. */
+	struct bsdiff_ra_cache_entry * prev;	/* More recently used. */
+	struct bsdiff_ra_cache_entry * next;	/* Less recently used. */
+};
+
+/* Part of the cache, with its own LRU list. */
+struct shard {
+	pthread_mutex_t mtx;
+	struct bsdiff_ra_cache_entry * head;	/* Most recently used. */
+	struct bsdiff_ra_cache_entry * tail;	/* Least recently used. */
+};
+
+/* Segment cache. */
+struct bsdiff_ra_cache {
+	struct bsdiff_ra_cache_entry ** E;	/* Per segment, or NULL. */
+	size_t nsegs;
+	struct shard shards[NSHARDS];
+	atomic_size_t maxbytes;
+	atomic_size_t bytes;		/* Segment data currently cached. */
+	atomic_uint_least64_t hits;
+	atomic_uint_least64_t misses;
+};
+
+/* Drop a reference to an entry, and free it if that was the last one. */
+static void
+unref(struct bsdiff_ra_cache_entry * e)
+{
+
+	if (atomic_fetch_sub(&e->refs, 1) == 1) {
+		free(e->buf);
+		free(e);
+	}
+}
+
+/* Remove an entry from its shard's LRU list. */
+static void
+unlink_entry(struct shard * S, struct bsdiff_ra_cache_entry * e)
+{
+
+	if (e->prev != NULL)
+		e->prev->next = e->next;
+	else
+		S->head = e->next;
+	if (e->next != NULL)
+		e->next->prev = e->prev;
+	else
+		S->tail = e->prev;
+}
+
+/* Add an entry to the front of its shard's LRU list. */
+static void
+link_entry(struct shard * S, struct bsdiff_ra_cache_entry * e)
+{
+
+	e->prev = NULL;
+	e->next = S->head;
+	if (S->head != NULL)
+		S->head->prev = e;
+	else
+		S->tail = e;
+	S->head = e;
+}
+
+/*
+ * Evict least recently used segments from the locked shard S, other than
+ * keep, until the cache is within budget or the shard is empty.
+ */
+static void
+evictshard(struct bsdiff_ra_cache * C, struct shard * S,
+    struct bsdiff_ra_cache_entry * keep)
+{
+	struct bsdiff_ra_cache_entry * e;
+
+	while ((atomic_load(&C->bytes) > atomic_load(&C->maxbytes)) &&
+	    ((e = S->tail) != NULL) && (e != keep)) {
+		unlink_entry(S, e);
+		C->E[e->seg] = NULL;
+		atomic_fetch_sub(&C->bytes, e->len);
+		unref(e);
+	}
+}
+
+/*
+ * Evict segments from the shards in turn, starting with shard first, until
+ * the cache is within budget.
+ */
+static void
+evict(struct bsdiff_ra_cache * C, size_t first)
+{
+	struct shard * S;
+	size_t k;
+
+	for (k = 0; k < NSHARDS; k++) {
+		if (atomic_load(&C->bytes) <= atomic_load(&C->maxbytes))
+			break;
+		S = &C->shards[(first + k) % NSHARDS];
+		if ((errno = pthread_mutex_lock(&S->mtx)) != 0) {
+			warnp("pthread_mutex_lock");
+			continue;
+		}
+		evictshard(C, S, NULL);
+		pthread_mutex_unlock(&S->mtx);
+	}
+}
+
+/**
+ * bsdiff_ra_cache_init(nsegs, maxbytes):
+ * Create a cache for the decoded contents of segments [0, nsegs), which
+ * holds up to maxbytes bytes of segment data, evicting the least recently
+ * used segments as necessary.  The cache may be used by several threads at
+ * once.
+ */
+struct bsdiff_ra_cache *
+bsdiff_ra_cache_init(size_t nsegs, size_t maxbytes)
+{
+	struct bsdiff_ra_cache * C;
+	size_t i;
+
+	/* Allocate a structure. */
+	if ((C = malloc(sizeof(struct bsdiff_ra_cache))) == NULL)
+		goto err0;
+	C->nsegs = nsegs;
+	atomic_init(&C->maxbytes, maxbytes);
+	atomic_init(&C->bytes, 0);
+	atomic_init(&C->hits, 0);
+	atomic_init(&C->misses, 0);
+
+	/* Nothing is cached yet. */
+	if (((C->E = malloc(nsegs * sizeof(struct bsdiff_ra_cache_entry *)))
+	    == NULL) && (nsegs > 0))
+		goto err1;
+	for (i = 0; i < nsegs; i++)
+		C->E[i] = NULL;
+
+	/* Initialize the shards. */
+	for (i = 0; i < NSHARDS; i++) {
+		if ((errno = pthread_mutex_init(&C->shards[i].mtx,
+		    NULL)) != 0) {
+			warnp("pthread_mutex_init");
+			goto err2;
+		}
+		C->shards[i].head = C->shards[i].tail = NULL;
+	}
+
+	/* Success! */
+	return (C);
+
+err2:
+	while (i-- > 0)
+		pthread_mutex_destroy(&C->shards[i].mtx);
+	free(C->E);
+err1:
+	free(C);
+err0:
+	/* Failure! */
+	return (NULL);
+}
+
+/**
+ * bsdiff_ra_cache_get(C, seg):
+ * Look up segment seg in the cache, and return a reference to its entry, or
+ * NULL if it is not in the cache.  The reference must be passed to
+ * bsdiff_ra_cache_release.
+ */
+struct bsdiff_ra_cache_entry *
+bsdiff_ra_cache_get(struct bsdiff_ra_cache * C, size_t seg)
+{
+	struct shard * S = &C->shards[seg % NSHARDS];
+	struct bsdiff_ra_cache_entry * e;
+
+	/* If we can't lock the shard, treat this as a miss. */
+	if ((errno = pthread_mutex_lock(&S->mtx)) != 0) {
+		warnp("pthread_mutex_lock");
+		e = NULL;
+		goto done;
+	}
+
+	/* If the segment is cached, take a reference and mark it as used. */
+	if ((e = C->E[seg]) != NULL) {
+		atomic_fetch_add(&e->refs, 1);
+		unlink_entry(S, e);
+		link_entry(S, e);
+	}
+	pthread_mutex_unlock(&S->mtx);
+
+done:
+	/* Record the lookup. */
+	if (e != NULL)
+		atomic_fetch_add(&C->hits, 1);
+	else
+		atomic_fetch_add(&C->misses, 1);
+
+	/* Return the entry, if any. */
+	return (e);
+}
+
+/**
+ * bsdiff_ra_cache_data(E):
+ * Return the contents of the segment in the cache entry E.
+ */
+const uint8_t *
+bsdiff_ra_cache_data(const struct bsdiff_ra_cache_entry * E)
+{
+
+	return (E->buf);
+}
+
+/**
+ * bsdiff_ra_cache_release(E):
+ * Drop a reference returned by bsdiff_ra_cache_get.  If the entry has been
+ * evicted from the cache and this was the last reference, free it.
+ */
+void
+bsdiff_ra_cache_release(struct bsdiff_ra_cache_entry * E)
+{
+
+	unref(E);
+}
+
+/**
+ * bsdiff_ra_cache_contains(C, seg):
+ * Return non-zero if segment seg is in the cache.  Unlike
+ * bsdiff_ra_cache_get, this does not count as a lookup or mark the segment
+ * as used.
+ */
+int
+bsdiff_ra_cache_contains(struct bsdiff_ra_cache * C, size_t seg)
+{
+	struct shard * S = &C->shards[seg % NSHARDS];
+	int present;
+
+	/* If we can't lock the shard, say that the segment isn't there. */
+	if ((errno = pthread_mutex_lock(&S->mtx)) != 0) {
+		warnp("pthread_mutex_lock");
+		return (0);
+	}
+	present = (C->E[seg] != NULL);
+	pthread_mutex_unlock(&S->mtx);
+
+	/* Return whether we found it. */
+	return (present);
+}
+
+/**
+ * bsdiff_ra_cache_put(C, seg, buf, len):
+ * Add the len-byte malloced buffer buf to the cache as the contents of
+ * segment seg.  The cache takes ownership of the buffer, and may free it
+ * immediately if it does not fit or the segment is already cached.
+ */
+void
+bsdiff_ra_cache_put(struct bsdiff_ra_cache * C, size_t seg, uint8_t * buf,
+    size_t len)
+{
+	struct shard * S = &C->shards[seg % NSHARDS];
+	struct bsdiff_ra_cache_entry * e;
+
+	/*
+	 * If the segment won't fit or we can't allocate an entry, just throw
+	 * the data away; caching is only an optimization.
+	 */
+	if ((len > atomic_load(&C->maxbytes)) ||
+	    ((e = malloc(sizeof(struct bsdiff_ra_cache_entry))) == NULL))
+		goto drop0;
+	e->seg = seg;
+	e->buf = buf;
+	e->len = len;
+	atomic_init(&e->refs, 1);
+
+	/* Lock the shard. */
+	if ((errno = pthread_mutex_lock(&S->mtx)) != 0) {
+		warnp("pthread_mutex_lock");
+		goto drop1;
+	}
+
+	/* Another thread may have cached this segment while we decoded it. */
+	if (C->E[seg] != NULL) {
+		pthread_mutex_unlock(&S->mtx);
+		goto drop1;
+	}
+
+	/* Record the segment and make it the most recently used. */
+	link_entry(S, e);
+	C->E[seg] = e;
+	atomic_fetch_add(&C->bytes, len);
+
+	/* Make room for it, starting with this shard. */
+	evictshard(C, S, e);
+	pthread_mutex_unlock(&S->mtx);
+	evict(C, seg + 1);
+
+	/* Done. */
+	return;
+
+drop1:
+	free(e);
+drop0:
+	free(buf);
+}
+
+/**
+ * bsdiff_ra_cache_setsize(C, maxbytes):
+ * Change the amount of segment data the cache may hold to maxbytes, evicting
+ * segments if necessary.  Evicted segments which are still referenced are
+ * freed when they are released.
+ */
+void
+bsdiff_ra_cache_setsize(struct bsdiff_ra_cache * C, size_t maxbytes)
+{
+
+	/* Record the new limit and evict anything which no longer fits. */
+	atomic_store(&C->maxbytes, maxbytes);
+	evict(C, 0);
+}
+
+/**
+ * bsdiff_ra_cache_stats(C, hits, misses, bytes):
+ * Return the number of lookups which have found and have not found a segment
+ * in the cache, and the number of bytes of segment data currently cached.
+ */
+void
+bsdiff_ra_cache_stats(struct bsdiff_ra_cache * C, uint64_t * hits,
+    uint64_t * misses, size_t * bytes)
+{
+
+	*hits = atomic_load(&C->hits);
+	*misses = atomic_load(&C->misses);
+	*bytes = atomic_load(&C->bytes);
+}
+
+/**
+ * bsdiff_ra_cache_free(C):
+ * Free the cache and all the segment data in it.  No references may be
+ * outstanding.
+ */
+void
+bsdiff_ra_cache_free(struct bsdiff_ra_cache * C)
+{
+	struct bsdiff_ra_cache_entry * e;
+	size_t i;
+
+	/* Free all the cached segments and the shard locks. */
+	for (i = 0; i < NSHARDS; i++) {
+		while ((e = C->shards[i].head) != NULL) {
+			C->shards[i].head = e->next;
+			unref(e);
+		}
+		pthread_mutex_destroy(&C->shards[i].mtx);
+	}
+
+	/* Free the segment array and the cache structure. */
+	free(C->E);
+	free(C);
+}
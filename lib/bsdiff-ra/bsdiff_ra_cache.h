@@ -0,0 +1,107 @@
+/*-
+ * Copyright 2012 Colin Percival
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions 
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _BSDIFF_RA_CACHE_H_
+#define _BSDIFF_RA_CACHE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Opaque types. */
+struct bsdiff_ra_cache;
+struct bsdiff_ra_cache_entry;
+
+/**
+ * bsdiff_ra_cache_init(nsegs, maxbytes):
+ * Create a cache for the decoded contents of segments [0, nsegs), which
+ * holds up to maxbytes bytes of segment data, evicting the least recently
+ * used segments as necessary.  The cache may be used by several threads at
+ * once.
+ */
+struct bsdiff_ra_cache * bsdiff_ra_cache_init(size_t, size_t);
+
+/**
+ * bsdiff_ra_cache_get(C, seg):
+ * Look up segment seg in the cache, and return a reference to its entry, or
+ * NULL if it is not in the cache.  The reference must be passed to
+ * bsdiff_ra_cache_release.
+ */
+struct bsdiff_ra_cache_entry * bsdiff_ra_cache_get(struct bsdiff_ra_cache *,
+    size_t);
+
+/**
+ * bsdiff_ra_cache_data(E):
+ * Return the contents of the segment in the cache entry E.
+ */
+const uint8_t * bsdiff_ra_cache_data(const struct bsdiff_ra_cache_entry *);
+
+/**
+ * bsdiff_ra_cache_release(E):
+ * Drop a reference returned by bsdiff_ra_cache_get.  If the entry has been
+ * evicted from the cache and this was the last reference, free it.
+ */
+void bsdiff_ra_cache_release(struct bsdiff_ra_cache_entry *);
+
+/**
+ * bsdiff_ra_cache_contains(C, seg):
+ * Return non-zero if segment seg is in the cache.  Unlike
+ * bsdiff_ra_cache_get, this does not count as a lookup or mark the segment
+ * as used.
+ */
+int bsdiff_ra_cache_contains(struct bsdiff_ra_cache *, size_t);
+
+/**
+ * bsdiff_ra_cache_put(C, seg, buf, len):
+ * Add the len-byte malloced buffer buf to the cache as the contents of
+ * segment seg.  The cache takes ownership of the buffer, and may free it
+ * immediately if it does not fit or the segment is already cached.
+ */
+void bsdiff_ra_cache_put(struct bsdiff_ra_cache *, size_t, uint8_t *, size_t);
+
+/**
+ * bsdiff_ra_cache_setsize(C, maxbytes):
+ * Change the amount of segment data the cache may hold to maxbytes, evicting
+ * segments if necessary.  Evicted segments which are still referenced are
+ * freed when they are released.
+ */
+void bsdiff_ra_cache_setsize(struct bsdiff_ra_cache *, size_t);
+
+/**
+ * bsdiff_ra_cache_stats(C, hits, misses, bytes):
+ * Return the number of lookups which have found and have not found a segment
+ * in the cache, and the number of bytes of segment data currently cached.
+ */
+void bsdiff_ra_cache_stats(struct bsdiff_ra_cache *, uint64_t *, uint64_t *,
+    size_t *);
+
+/**
+ * bsdiff_ra_cache_free(C):
+ * Free the cache and all the segment data in it.  No references may be
+ * outstanding.
+ */
+void bsdiff_ra_cache_free(struct bsdiff_ra_cache *);
+
+#endif /* !_BSDIFF_RA_CACHE_H_ */
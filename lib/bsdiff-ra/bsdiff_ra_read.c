@@ -28,25 +28,129 @@
 #include <sys/stat.h>
 
 #include <assert.h>
-#include <bzlib.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+#include "addbytes.h"
+#include "asyncpread.h"
+#include "codec_buf.h"
+#include "mapfile.h"
+#include "parallel_pool.h"
 #include "sysendian.h"
 #include "warnp.h"
 
+#include "bsdiff_ra_cache.h"
+
 #include "bsdiff_ra_read.h"
 
-/* Patch reader structure. */
+/* Number of preads to keep in flight for asynchronous reads. */
+#define ASYNC_DEPTH	64
+
+/*
+ * Buffers for decoding a segment.  Each buffer is grown as needed and kept
+ * for the next segment, so once a context has decoded a few segments it
+ * doesn't need to allocate any more memory to decode the rest.
+ */
+struct decbufs {
+	uint8_t * pbuf;		/* Patch data. */
+	size_t psize;
+	uint8_t * obuf;		/* Old file data. */
+	size_t osize;
+	uint8_t * ctrl;		/* Decompressed ctrl block. */
+	size_t ctrlsize;
+	uint8_t * diff;		/* Decompressed diff block. */
+	size_t diffsize;
+	uint8_t * extra;	/* Decompressed extra block. */
+	size_t extrasize;
+	struct decbufs * next;
+};
+
+/* A batch of segments being decoded ahead of a sequential reader. */
+struct prefetch {
+	struct bsdiff_ra_read_file * ctx;
+	off_t first;
+	struct parallel_pool_job * job;
+	atomic_size_t nleft;		/* Calls which haven't finished. */
+	struct prefetch * next;
+};
+
+/*
+ * Patch reader structure.  Apart from the cache, the readahead state (which
+ * is protected by ramtx), the unused decode buffers (which are protected by
+ * bufmtx), and the asynchronous read state (which belongs to the thread
+ * submitting asynchronous reads), nothing is modified after
+ * bsdiff_ra_read_open returns, so reads can proceed concurrently.
+ */
 struct bsdiff_ra_read_file {
 	int fdp;		/* Patch file. */
 	int fdo;		/* Old file. */
+	uint8_t * pmap;		/* Mapped patch file, or NULL. */
+	size_t psize;
+	uint8_t * omap;		/* Mapped old file, or NULL. */
+	size_t osize;
 	off_t newsize;		/* Size of new file. */
 	uint32_t b;		/* Segment length. */
+	int codec;		/* Compression codec. */
+	size_t sublen;		/* Diff and extra sub-block length, or 0. */
+	size_t nsegs;		/* Number of segments. */
 	struct seghdr * SH;	/* Header block. */
+	size_t maxplen;		/* Largest patch data segment. */
+	size_t maxolen;		/* Largest old data segment. */
+	pthread_mutex_t bufmtx;		/* Lock for unused decode buffers. */
+	struct decbufs * bufs;		/* Unused decode buffers. */
+	size_t nbufs;
+	size_t nbufskeep;		/* Most unused sets to keep. */
+	atomic_size_t cachesize;	/* Maximum bytes of segments cached. */
+	struct bsdiff_ra_cache * cache;	/* Decoded segments. */
+	struct parallel_pool * pool;	/* Threads for reads and readahead. */
+	pthread_mutex_t ramtx;		/* Lock for readahead state. */
+	size_t ranseg;			/* Segments to read ahead. */
+	off_t ranext;			/* Where a sequential read starts. */
+	off_t raend;			/* End of segments read ahead. */
+	struct prefetch * ra;		/* Readahead batches in progress. */
+	atomic_size_t nreading;		/* Reads waiting for the pool. */
+	struct asyncpread * aio;	/* Preads for asynchronous reads. */
+	size_t nasync;			/* Asynchronous reads not yet reaped. */
+	struct aread * adone;		/* Completed asynchronous reads. */
+	struct aread * adonetail;
+};
+
+/* A read spanning several segments; passed to doreadseg. */
+struct readjob {
+	struct bsdiff_ra_read_file * ctx;
+	uint8_t * buf;
+	off_t offset;
+	off_t epos;
+	off_t first;
+};
+
+/* One segment of an asynchronous read. */
+struct aseg {
+	struct aread * R;
+	size_t i;		/* Segment number. */
+	size_t segoff;		/* Part of the segment to read. */
+	size_t seglen;
+	struct decbufs * D;	/* Patch and old file data, or NULL. */
+	int nio;		/* Preads outstanding. */
+	size_t nread;		/* Bytes read so far. */
+};
+
+/* An asynchronous read; see bsdiff_ra_read_submit. */
+struct aread {
+	void * cookie;
+	uint8_t * buf;
+	off_t offset;
+	off_t epos;
+	struct aseg * S;	/* One per segment touched. */
+	size_t nleft;		/* Segments waiting for their data. */
+	int failed;
+	struct aread * next;
 };
 
 /* Segment header. */
@@ -75,44 +179,36 @@ decval(uint8_t buf[4])
 	}
 }
 
-/* Decompress a buffer into a buffer of the correct size. */
-static int
-decompress(const uint8_t * in, size_t inlen, uint8_t * out, size_t outlen)
+/* Close a file, which may be mapped. */
+static void
+closefile(uint8_t * map, int fd, size_t len)
 {
-	int bz2err;
-	unsigned int _outlen;
-
-	/* Perform the decompression. */
-	_outlen = outlen;
-	if ((bz2err = BZ2_bzBuffToBuffDecompress(out, &_outlen,
-	    (uint8_t *)(uintptr_t)(in), inlen, 0, 0)) != BZ_OK) {
-		warn0("error in BZ2_bzBuffToBuffDecompress: %d", bz2err);
-		goto err0;
-	}
-	if (_outlen != outlen) {
-		warn0("decompressed data is wrong size (%u, expected %zu)",
-		    _outlen, outlen);
-		goto err0;
-	}
 
-	/* Success! */
-	return (0);
-
-err0:
-	/* Failure! */
-	return (-1);
+	if (map != NULL)
+		unmapfile(map, fd, len);
+	else
+		close(fd);
 }
 
 /**
- * bsdiff_ra_read_open(patchname, oldname):
- * Open the patch file and the "old" file and return a context.
+ * bsdiff_ra_read_open(patchname, oldname, flags):
+ * Open the patch file and the "old" file and return a context.  If flags
+ * includes BSDIFF_RA_READ_MMAP, map both files into memory and patch
+ * directly from the mappings instead of reading segments into buffers; this
+ * avoids copying data and lets processes share the page cache.  The context
+ * may be shared by several threads: bsdiff_ra_read_pread,
+ * bsdiff_ra_read_setcache, bsdiff_ra_read_setreadahead, and
+ * bsdiff_ra_read_stats may be called concurrently, but bsdiff_ra_read_close
+ * must not be called until all other calls have returned.
  */
 struct bsdiff_ra_read_file *
-bsdiff_ra_read_open(const char * patchname, const char * oldname)
+bsdiff_ra_read_open(const char * patchname, const char * oldname,
+    int flags)
 {
 	struct bsdiff_ra_read_file * ctx;
 	struct stat sb;
-	uint8_t hbuf[32];
+	uint8_t hbuf[40];
+	size_t hlen;
 	size_t hblenc;
 	uint64_t pdlen;
 	size_t nsegs;
@@ -125,8 +221,15 @@ bsdiff_ra_read_open(const char * patchname, const char * oldname)
 	if ((ctx = malloc(sizeof(struct bsdiff_ra_read_file))) == NULL)
 		goto err0;
 
-	/* Open the patch file. */
-	if ((ctx->fdp = open(patchname, O_RDONLY)) == -1) {
+	/* Open, and if requested map, the patch file. */
+	ctx->pmap = NULL;
+	if (flags & BSDIFF_RA_READ_MMAP) {
+		if ((ctx->pmap = mapfile(patchname, &ctx->fdp,
+		    &ctx->psize)) == NULL) {
+			warnp("cannot map patch file: %s", patchname);
+			goto err1;
+		}
+	} else if ((ctx->fdp = open(patchname, O_RDONLY)) == -1) {
 		warnp("cannot open patch file: %s", patchname);
 		goto err1;
 	}
@@ -137,13 +240,20 @@ bsdiff_ra_read_open(const char * patchname, const char * oldname)
 		goto err2;
 	}
 
-	/* Open the old file. */
-	if ((ctx->fdo = open(oldname, O_RDONLY)) == -1) {
+	/* Open, and if requested map, the old file. */
+	ctx->omap = NULL;
+	if (flags & BSDIFF_RA_READ_MMAP) {
+		if ((ctx->omap = mapfile(oldname, &ctx->fdo,
+		    &ctx->osize)) == NULL) {
+			warnp("cannot map old file: %s", oldname);
+			goto err2;
+		}
+	} else if ((ctx->fdo = open(oldname, O_RDONLY)) == -1) {
 		warnp("cannot open old file: %s", oldname);
 		goto err2;
 	}
 
-	/* Read the patch header. */
+	/* Read the start of the patch header. */
 	if (sb.st_size < 32) {
 		warn0("patch file is truncated: %s", patchname);
 		goto err3;
@@ -153,21 +263,48 @@ bsdiff_ra_read_open(const char * patchname, const char * oldname)
 		goto err3;
 	}
 
-	/* Parse the patch header. */
-	if (memcmp(&hbuf[0], "BSDIFFSX", 8)) {
+	/*
+	 * Check the magic.  Unversioned "BSDIFFSX" patches have a 32-byte
+	 * header and are always compressed with bzip2; version 1 patches have
+	 * a 40-byte header which specifies the compression codec.
+	 */
+	if (memcmp(&hbuf[0], "BSDIFFSX", 8) == 0) {
+		hlen = 32;
+		ctx->codec = CODEC_BZIP2;
+		ctx->sublen = 0;
+	} else if (memcmp(&hbuf[0], "BSDIFFS1", 8) == 0) {
+		hlen = 40;
+		if (sb.st_size < 40) {
+			warn0("patch file is truncated: %s", patchname);
+			goto err3;
+		}
+		if (pread(ctx->fdp, &hbuf[32], 8, 32) != 8) {
+			warnp("cannot read patch header: %s", patchname);
+			goto err3;
+		}
+		ctx->codec = be32dec(&hbuf[32]);
+		ctx->sublen = be32dec(&hbuf[36]);
+		if (!codec_supported(ctx->codec)) {
+			warn0("patch file uses unsupported compression"
+			    " codec (%d): %s", ctx->codec, patchname);
+			goto err3;
+		}
+	} else {
 		warn0("patch file has bad magic: %s", patchname);
 		goto err3;
 	}
+
+	/* Parse the rest of the patch header. */
 	ctx->newsize = be64dec(&hbuf[8]);
 	ctx->b = be32dec(&hbuf[16]);
 	hblenc = be32dec(&hbuf[20]);
 	pdlen = be64dec(&hbuf[24]);
 
 	/* Sanity-check the patch file size. */
-	if ((uint64_t)(sb.st_size) != 32 + hblenc + pdlen) {
+	if ((uint64_t)(sb.st_size) != hlen + hblenc + pdlen) {
 		warn0("patch file has wrong size (%" PRIu64
 		    ", should be %" PRIu64 "): %s",
-		    (uint64_t)(sb.st_size), 32 + hblenc + pdlen, patchname);
+		    (uint64_t)(sb.st_size), hlen + hblenc + pdlen, patchname);
 		goto err3;
 	}
 
@@ -180,22 +317,23 @@ bsdiff_ra_read_open(const char * patchname, const char * oldname)
 	/* Allocate memory for and read the compressed header block. */
 	if ((hbc = malloc(hblenc)) == NULL)
 		goto err3;
-	if (pread(ctx->fdp, hbc, hblenc, 32) != (ssize_t)hblenc) {
+	if (pread(ctx->fdp, hbc, hblenc, hlen) != (ssize_t)hblenc) {
 		warnp("cannot read patch header block: %s", patchname);
 		goto err4;
 	}
 
 	/* Decompress the header block. */
-	nsegs = (ctx->newsize + ctx->b - 1) / ctx->b;
+	ctx->nsegs = nsegs = (ctx->newsize + ctx->b - 1) / ctx->b;
 	if ((hb = malloc(nsegs * 16)) == NULL)
 		goto err4;
-	if (decompress(hbc, hblenc, hb, nsegs * 16))
+	if (codec_decompress(ctx->codec, hbc, hblenc, hb, nsegs * 16))
 		goto err5;
 
 	/* Parse the header block. */
 	if ((ctx->SH = malloc(nsegs * sizeof(struct seghdr))) == NULL)
 		goto err5;
-	ppos = 32 + hblenc;
+	ppos = hlen + hblenc;
+	ctx->maxplen = ctx->maxolen = 0;
 	for (i = 0; i < nsegs; i++) {
 		/* Parse and record values. */
 		ctx->SH[i].opos = be64dec(&hb[i * 16]);
@@ -203,17 +341,72 @@ bsdiff_ra_read_open(const char * patchname, const char * oldname)
 		ctx->SH[i].olen = be32dec(&hb[i * 16 + 8]);
 		ppos += ctx->SH[i].plen = be32dec(&hb[i * 16 + 12]);
 
+		/* Keep track of how large the decode buffers need to be. */
+		if (ctx->SH[i].plen > ctx->maxplen)
+			ctx->maxplen = ctx->SH[i].plen;
+		if (ctx->SH[i].olen > ctx->maxolen)
+			ctx->maxolen = ctx->SH[i].olen;
+
 		/* Sanity-check. */
 		if (ctx->SH[i].plen < 16) {
 			warn0("patch file is corrupt: %s", patchname);
 			goto err6;
 		}
+
+		/*
+		 * If the old file is mapped, we can't rely on a short read to
+		 * tell us that the old data isn't there.
+		 */
+		if ((ctx->omap != NULL) &&
+		    (((uint64_t)ctx->SH[i].opos > ctx->osize) ||
+		    (ctx->SH[i].olen > ctx->osize - ctx->SH[i].opos))) {
+			warn0("patch file does not match old file: %s",
+			    patchname);
+			goto err6;
+		}
 	}
 	if (ppos != sb.st_size) {
 		warn0("patch file is corrupt: %s", patchname);
 		goto err6;
 	}
 
+	/* Create a cache for decoded segments. */
+	atomic_init(&ctx->cachesize, BSDIFF_RA_READ_CACHE_DEFAULT);
+	if ((ctx->cache = bsdiff_ra_cache_init(nsegs,
+	    BSDIFF_RA_READ_CACHE_DEFAULT)) == NULL)
+		goto err6;
+
+	/* Segments are decoded by the calling thread unless told otherwise. */
+	ctx->pool = NULL;
+
+	/*
+	 * Set up readahead.  Nothing has been read yet, so a read from the
+	 * start of the file counts as sequential.
+	 */
+	if ((errno = pthread_mutex_init(&ctx->ramtx, NULL)) != 0) {
+		warnp("pthread_mutex_init");
+		goto err7;
+	}
+	ctx->ranseg = BSDIFF_RA_READ_READAHEAD_DEFAULT;
+	ctx->ranext = 0;
+	ctx->raend = 0;
+	ctx->ra = NULL;
+	atomic_init(&ctx->nreading, 0);
+
+	/* We allocate decode buffers as segments are decoded. */
+	if ((errno = pthread_mutex_init(&ctx->bufmtx, NULL)) != 0) {
+		warnp("pthread_mutex_init");
+		goto err8;
+	}
+	ctx->bufs = NULL;
+	ctx->nbufs = 0;
+	ctx->nbufskeep = 1;
+
+	/* We set up asynchronous reads when the first one is submitted. */
+	ctx->aio = NULL;
+	ctx->nasync = 0;
+	ctx->adone = ctx->adonetail = NULL;
+
 	/* Clean up temporary buffers. */
 	free(hb);
 	free(hbc);
@@ -221,6 +414,10 @@ bsdiff_ra_read_open(const char * patchname, const char * oldname)
 	/* Success! */
 	return (ctx);
 
+err8:
+	pthread_mutex_destroy(&ctx->ramtx);
+err7:
+	bsdiff_ra_cache_free(ctx->cache);
 err6:
 	free(ctx->SH);
 err5:
@@ -228,9 +425,9 @@ err5:
 err4:
 	free(hbc);
 err3:
-	close(ctx->fdo);
+	closefile(ctx->omap, ctx->fdo, ctx->osize);
 err2:
-	close(ctx->fdp);
+	closefile(ctx->pmap, ctx->fdp, ctx->psize);
 err1:
 	free(ctx);
 err0:
@@ -238,18 +435,274 @@ err0:
 	return (NULL);
 }
 
-/* Patch obuf[olen] with pbuf[plen] and write from start into buf[len]. */
+/*
+ * Make sure that *buf, which is *size bytes long (or NULL), has room for len
+ * bytes.  Some codecs don't accept a NULL buffer even if it's zero bytes
+ * long, so always allocate something.
+ */
+static int
+reserve(uint8_t ** buf, size_t * size, size_t len)
+{
+	uint8_t * nbuf;
+
+	/* Is it already large enough? */
+	if ((*buf != NULL) && (*size >= len))
+		return (0);
+
+	/* Replace it with a larger buffer; we don't need the contents. */
+	if ((nbuf = malloc((len > 0) ? len : 1)) == NULL)
+		return (-1);
+	free(*buf);
+	*buf = nbuf;
+	*size = len;
+
+	/* Success! */
+	return (0);
+}
+
+/* Free a set of decode buffers. */
+static void
+bufs_free(struct decbufs * D)
+{
+
+	free(D->extra);
+	free(D->diff);
+	free(D->ctrl);
+	free(D->obuf);
+	free(D->pbuf);
+	free(D);
+}
+
+/* Take a set of decode buffers from the context, or make a new one. */
+static struct decbufs *
+bufs_get(struct bsdiff_ra_read_file * ctx)
+{
+	struct decbufs * D;
+
+	/* Grab an unused set if there is one. */
+	if ((errno = pthread_mutex_lock(&ctx->bufmtx)) != 0) {
+		warnp("pthread_mutex_lock");
+		goto err0;
+	}
+	if ((D = ctx->bufs) != NULL) {
+		ctx->bufs = D->next;
+		ctx->nbufs--;
+	}
+	if ((errno = pthread_mutex_unlock(&ctx->bufmtx)) != 0) {
+		warnp("pthread_mutex_unlock");
+		goto err1;
+	}
+
+	/* Otherwise, make an empty set; the buffers are allocated on use. */
+	if (D == NULL) {
+		if ((D = malloc(sizeof(struct decbufs))) == NULL)
+			goto err0;
+		D->pbuf = D->obuf = D->ctrl = D->diff = D->extra = NULL;
+		D->psize = D->osize = D->ctrlsize = 0;
+		D->diffsize = D->extrasize = 0;
+	}
+
+	/* Success! */
+	return (D);
+
+err1:
+	if (D != NULL)
+		bufs_free(D);
+err0:
+	/* Failure! */
+	return (NULL);
+}
+
+/*
+ * Return a set of decode buffers to the context for reuse.  Each set can be
+ * as large as the largest segment's patch data and old file data, and isn't
+ * counted against the cache size, so we keep only one unused set for each
+ * thread which decodes segments (the pool's threads and one caller); a burst
+ * of asynchronous reads or concurrent callers allocates more sets, but
+ * doesn't leave us holding on to them.
+ */
+static void
+bufs_put(struct bsdiff_ra_read_file * ctx, struct decbufs * D)
+{
+
+	/* Add the set to the list if there's room. */
+	if ((errno = pthread_mutex_lock(&ctx->bufmtx)) != 0) {
+		warnp("pthread_mutex_lock");
+		bufs_free(D);
+		return;
+	}
+	if (ctx->nbufs < ctx->nbufskeep) {
+		D->next = ctx->bufs;
+		ctx->bufs = D;
+		ctx->nbufs++;
+		D = NULL;
+	}
+	if ((errno = pthread_mutex_unlock(&ctx->bufmtx)) != 0)
+		warnp("pthread_mutex_unlock");
+
+	/* If we didn't keep the set, free it. */
+	if (D != NULL)
+		bufs_free(D);
+}
+
+/*
+ * Make sure that D has room for the patch data and old file data of any
+ * segment.
+ */
+static int
+bufs_reserve(struct bsdiff_ra_read_file * ctx, struct decbufs * D)
+{
+
+	if (reserve(&D->pbuf, &D->psize, ctx->maxplen))
+		return (-1);
+	if (reserve(&D->obuf, &D->osize, ctx->maxolen))
+		return (-1);
+	return (0);
+}
+
+/*
+ * Find the parts [d0, d1) of the diff block and [e0, e1) of the extra block
+ * which are needed to produce bytes [start, start + len) of a segment with
+ * the provided ctrl block.
+ */
+static void
+findneeded(const uint8_t * ctrl, size_t ctrllen, size_t start, size_t len,
+    size_t * d0, size_t * d1, size_t * e0, size_t * e1)
+{
+	size_t npos, dpos, epos;
+	size_t rlen, lo, hi;
+	size_t i;
+
+	/* Nothing needed yet. */
+	*d0 = *e0 = SIZE_MAX;
+	*d1 = *e1 = 0;
+
+	/* Walk through the ctrl tuples, keeping track of where we are. */
+	for (npos = dpos = epos = i = 0; i < ctrllen; i += 12) {
+		/* Which part of the copy-and-add region overlaps the range? */
+		rlen = be32dec(&ctrl[i + 4]);
+		lo = (npos > start) ? npos : start;
+		hi = (npos + rlen < start + len) ? npos + rlen : start + len;
+		if (lo < hi) {
+			if (dpos + (lo - npos) < *d0)
+				*d0 = dpos + (lo - npos);
+			*d1 = dpos + (hi - npos);
+		}
+		npos += rlen;
+		dpos += rlen;
+
+		/* Which part of the insert region overlaps the range? */
+		rlen = be32dec(&ctrl[i + 8]);
+		lo = (npos > start) ? npos : start;
+		hi = (npos + rlen < start + len) ? npos + rlen : start + len;
+		if (lo < hi) {
+			if (epos + (lo - npos) < *e0)
+				*e0 = epos + (lo - npos);
+			*e1 = epos + (hi - npos);
+		}
+		npos += rlen;
+		epos += rlen;
+	}
+
+	/* If we don't need anything from a block, say so. */
+	if (*d0 == SIZE_MAX)
+		*d0 = *d1 = 0;
+	if (*e0 == SIZE_MAX)
+		*e0 = *e1 = 0;
+}
+
+/*
+ * Decompress the part [lo, hi) of a len-byte diff or extra block, which is
+ * stored in in[inlen] (split into sublen-byte sub-blocks if sublen is
+ * non-zero).  Set *out (which is *outsize bytes long, and is grown if
+ * necessary) to bytes [*base, end) of the block, where *base <= lo and
+ * hi <= end.
+ */
+static int
+getblock(int codec, size_t sublen, const uint8_t * in, size_t inlen,
+    size_t len, size_t lo, size_t hi, uint8_t ** out, size_t * outsize,
+    size_t * base)
+{
+	size_t nsub, tlen, k0, k1;
+	size_t pos, plen, k;
+
+	/*
+	 * Make sure we have room for the whole block, so that we don't need
+	 * to grow the buffer again if a later read wants more of it.
+	 */
+	if (reserve(out, outsize, len))
+		goto err0;
+
+	/* Without sub-blocks, we have to decompress everything. */
+	if (sublen == 0) {
+		*base = 0;
+		return (codec_decompress(codec, in, inlen, *out, len));
+	}
+
+	/* Make sure the table of compressed sub-block lengths is there. */
+	nsub = (len + sublen - 1) / sublen;
+	tlen = nsub * 4;
+	if (tlen > inlen) {
+		warn0("patch file is corrupt");
+		goto err0;
+	}
+
+	/* Which sub-blocks do we need? */
+	if (hi > lo) {
+		k0 = lo / sublen;
+		k1 = (hi + sublen - 1) / sublen;
+	} else {
+		k0 = k1 = 0;
+	}
+
+	/* Decompress them to the start of the buffer. */
+	*base = k0 * sublen;
+
+	/* Skip to the first sub-block we need. */
+	for (pos = tlen, k = 0; k < k0; k++)
+		pos += be32dec(&in[k * 4]);
+
+	/* Decompress the sub-blocks we need. */
+	for (k = k0; k < k1; k++) {
+		plen = be32dec(&in[k * 4]);
+		if ((pos > inlen) || (plen > inlen - pos)) {
+			warn0("patch file is corrupt");
+			goto err0;
+		}
+		if (codec_decompress(codec, &in[pos], plen,
+		    &(*out)[k * sublen - *base], (k < nsub - 1) ? sublen :
+		    len - k * sublen))
+			goto err0;
+		pos += plen;
+	}
+
+	/* Success! */
+	return (0);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/*
+ * Patch obuf[olen] with pbuf[plen], which was compressed with the specified
+ * codec (with the diff and extra blocks split into sublen-byte sub-blocks if
+ * sublen is non-zero), and write from start into buf[len].  Decompress the
+ * ctrl, diff, and extra blocks into the decode buffers D.
+ */
 static int
-patchseg(uint8_t * pbuf, size_t plen, uint8_t * obuf, size_t olen,
-    size_t start, size_t len, uint8_t * buf)
+patchseg(int codec, size_t sublen, const uint8_t * pbuf, size_t plen,
+    const uint8_t * obuf, size_t olen, size_t start, size_t len,
+    uint8_t * buf, struct decbufs * D)
 {
 	size_t ctrllen, ctrllenc;
 	size_t difflen, difflenc;
 	size_t extralen, extralenc;
 	uint8_t * ctrl, * diff, * extra;
+	size_t d0, d1, e0, e1, dbase, ebase;
 	size_t opos, dpos, epos;
-	size_t rlen, slen;
-	size_t i, j;
+	size_t rlen, slen, clen;
+	size_t i;
 
 	/* Sanity-check. */
 	assert(plen >= 16);
@@ -272,11 +725,12 @@ patchseg(uint8_t * pbuf, size_t plen, uint8_t * obuf, size_t olen,
 		goto err0;
 	}
 
-	/* Allocate buffer and decompress ctrl block. */
-	if ((ctrl = malloc(ctrllen)) == NULL)
+	/* Decompress ctrl block. */
+	if (reserve(&D->ctrl, &D->ctrlsize, ctrllen))
 		goto err0;
-	if (decompress(&pbuf[16], ctrllenc, ctrl, ctrllen))
-		goto err1;
+	if (codec_decompress(codec, &pbuf[16], ctrllenc, D->ctrl, ctrllen))
+		goto err0;
+	ctrl = D->ctrl;
 
 	/* Compute sum of diff and extra blocks. */
 	difflen = extralen = 0;
@@ -285,17 +739,27 @@ patchseg(uint8_t * pbuf, size_t plen, uint8_t * obuf, size_t olen,
 		extralen += be32dec(&ctrl[i + 8]);
 	}
 
-	/* Allocate space for decompressed diff and extra blocks. */
-	if ((diff = malloc(difflen + extralen)) == NULL)
-		goto err1;
-	extra = &diff[difflen];
+	/*
+	 * If the diff and extra blocks are split into sub-blocks, we only
+	 * need to decompress the parts which we're going to use.
+	 */
+	if (sublen > 0) {
+		findneeded(ctrl, ctrllen, start, len, &d0, &d1, &e0, &e1);
+	} else {
+		d0 = e0 = 0;
+		d1 = difflen;
+		e1 = extralen;
+	}
 
-	/* Decompress diff and extra blocks. */
-	if (decompress(&pbuf[16 + ctrllenc], difflenc, diff, difflen))
-		goto err2;
-	if (decompress(&pbuf[16 + ctrllenc + difflenc], extralenc,
-	    extra, extralen))
-		goto err2;
+	/* Decompress (the parts we need of) the diff and extra blocks. */
+	if (getblock(codec, sublen, &pbuf[16 + ctrllenc], difflenc, difflen,
+	    d0, d1, &D->diff, &D->diffsize, &dbase))
+		goto err0;
+	if (getblock(codec, sublen, &pbuf[16 + ctrllenc + difflenc],
+	    extralenc, extralen, e0, e1, &D->extra, &D->extrasize, &ebase))
+		goto err0;
+	diff = D->diff;
+	extra = D->extra;
 
 	/* Do the patching. */
 	for (dpos = epos = opos = i = 0; i < ctrllen; i += 12) {
@@ -308,7 +772,7 @@ patchseg(uint8_t * pbuf, size_t plen, uint8_t * obuf, size_t olen,
 		/* Check sanity. */
 		if (opos + rlen > olen) {
 			warn0("patch file is corrupt");
-			goto err2;
+			goto err0;
 		}
 
 		/* Skip part of the region if necessary. */
@@ -323,12 +787,19 @@ patchseg(uint8_t * pbuf, size_t plen, uint8_t * obuf, size_t olen,
 
 		/* Stop early if necessary. */
 		if (rlen > len)
-			rlen = len;
+			clen = len;
+		else
+			clen = rlen;
 
 		/* If we have anything left, copy-and-add. */
-		for (j = 0; j < rlen; j++)
-			*buf++ = obuf[opos++] + diff[dpos++];
-		len -= rlen;
+		if (clen > 0)
+			addbytes(buf, &obuf[opos], &diff[dpos - dbase], clen);
+		buf += clen;
+		len -= clen;
+
+		/* Move past the rest of the region even if we stopped early. */
+		opos += rlen;
+		dpos += rlen;
 
 		/* We need to insert a region. */
 		rlen = be32dec(&ctrl[i + 8]);
@@ -344,122 +815,848 @@ patchseg(uint8_t * pbuf, size_t plen, uint8_t * obuf, size_t olen,
 
 		/* Stop early if necessary. */
 		if (rlen > len)
-			rlen = len;
+			clen = len;
+		else
+			clen = rlen;
 
 		/* Insert extra bytes. */
-		memcpy(buf, &extra[epos], rlen);
-		buf += rlen;
+		if (clen > 0)
+			memcpy(buf, &extra[epos - ebase], clen);
+		buf += clen;
 		epos += rlen;
-		len -= rlen;
+		len -= clen;
 	}
 
 	/* Sanity-check. */
 	if ((start != 0) || (len != 0)) {
 		warn0("patch file is corrupt");
-		goto err2;
+		goto err0;
+	}
+
+	/* Success! */
+	return (0);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/*
+ * Decode segment i of the new file, writing bytes [start, start + len) of it
+ * into buf.
+ */
+static int
+decodeseg(struct bsdiff_ra_read_file * ctx, size_t i, size_t start,
+    size_t len, uint8_t * buf)
+{
+	struct decbufs * D;
+
+	/* Get a set of decode buffers. */
+	if ((D = bufs_get(ctx)) == NULL)
+		goto err0;
+
+	/* If the files are mapped, patch straight from the mappings. */
+	if (ctx->pmap != NULL) {
+		if (patchseg(ctx->codec, ctx->sublen,
+		    &ctx->pmap[ctx->SH[i].ppos], ctx->SH[i].plen,
+		    &ctx->omap[ctx->SH[i].opos], ctx->SH[i].olen, start, len,
+		    buf, D))
+			goto err1;
+		goto done;
 	}
 
-	/* Free allocated buffers. */
-	free(diff);
-	free(ctrl);
+	/* Read patch data and old file data. */
+	if (bufs_reserve(ctx, D))
+		goto err1;
+	if (pread(ctx->fdp, D->pbuf, ctx->SH[i].plen,
+	    ctx->SH[i].ppos) != ctx->SH[i].plen)
+		goto err1;
+	if (pread(ctx->fdo, D->obuf, ctx->SH[i].olen,
+	    ctx->SH[i].opos) != ctx->SH[i].olen)
+		goto err1;
+
+	/* Perform the segment of patching. */
+	if (patchseg(ctx->codec, ctx->sublen, D->pbuf, ctx->SH[i].plen,
+	    D->obuf, ctx->SH[i].olen, start, len, buf, D))
+		goto err1;
+
+done:
+	/* Return the buffers for reuse. */
+	bufs_put(ctx, D);
+
+	/* Success! */
+	return (0);
+
+err1:
+	bufs_put(ctx, D);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/* Return the length of segment i: b, or "the rest of the file". */
+static size_t
+seglength(struct bsdiff_ra_read_file * ctx, size_t i)
+{
+
+	if (i < ctx->nsegs - 1)
+		return (ctx->b);
+	else
+		return (ctx->newsize - (off_t)i * ctx->b);
+}
+
+/*
+ * Should we decode just len bytes of segment i instead of decoding all of it
+ * into the cache?  If the segment's diff and extra blocks are split into
+ * sub-blocks, decoding part of it is much cheaper than decoding the rest, so
+ * we only cache segments which are read (or read ahead) in full.
+ */
+static int
+partialseg(struct bsdiff_ra_read_file * ctx, size_t i, size_t len)
+{
+
+	return ((ctx->sublen > 0) && (len < seglength(ctx, i)));
+}
+
+/* Copy bytes [start, start + len) of segment i into buf, via the cache. */
+static int
+cachedseg(struct bsdiff_ra_read_file * ctx, size_t i, size_t start,
+    size_t len, uint8_t * buf)
+{
+	struct bsdiff_ra_cache_entry * E;
+	uint8_t * nbuf;
+	size_t seglen;
+
+	/* If we have the segment cached, copy out what we need. */
+	if ((E = bsdiff_ra_cache_get(ctx->cache, i)) != NULL) {
+		memcpy(buf, &bsdiff_ra_cache_data(E)[start], len);
+		bsdiff_ra_cache_release(E);
+		goto done;
+	}
+
+	/* If we only want part of the segment, just decode that part. */
+	if (partialseg(ctx, i, len))
+		return (decodeseg(ctx, i, start, len, buf));
+
+	/* Decode the whole segment. */
+	seglen = seglength(ctx, i);
+	if ((nbuf = malloc(seglen)) == NULL)
+		goto err0;
+	if (decodeseg(ctx, i, 0, seglen, nbuf))
+		goto err1;
+
+	/* Copy out what we need, then hand the segment to the cache. */
+	memcpy(buf, &nbuf[start], len);
+	bsdiff_ra_cache_put(ctx->cache, i, nbuf, seglen);
+
+done:
+	/* Success! */
+	return (0);
+
+err1:
+	free(nbuf);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/*
+ * Patch segment i from its patch data pbuf and old file data obuf, using the
+ * decode buffers D and writing bytes [start, start + len) of it into buf;
+ * and if we're caching, add the whole segment to the cache.
+ */
+static int
+patchsegbufs(struct bsdiff_ra_read_file * ctx, size_t i,
+    const uint8_t * pbuf, const uint8_t * obuf, size_t start, size_t len,
+    uint8_t * buf, struct decbufs * D)
+{
+	uint8_t * nbuf;
+	size_t seglen;
+
+	/*
+	 * If we're not caching or only want part of the segment, patch
+	 * straight into the caller's buffer.
+	 */
+	if ((atomic_load(&ctx->cachesize) == 0) || partialseg(ctx, i, len))
+		return (patchseg(ctx->codec, ctx->sublen, pbuf,
+		    ctx->SH[i].plen, obuf, ctx->SH[i].olen, start, len, buf,
+		    D));
+
+	/* Patch the whole segment. */
+	seglen = seglength(ctx, i);
+	if ((nbuf = malloc(seglen)) == NULL)
+		goto err0;
+	if (patchseg(ctx->codec, ctx->sublen, pbuf, ctx->SH[i].plen, obuf,
+	    ctx->SH[i].olen, 0, seglen, nbuf, D))
+		goto err1;
+
+	/* Copy out what we need, then hand the segment to the cache. */
+	memcpy(buf, &nbuf[start], len);
+	bsdiff_ra_cache_put(ctx->cache, i, nbuf, seglen);
 
 	/* Success! */
 	return (0);
 
-err2:
-	free(diff);
 err1:
-	free(ctrl);
+	free(nbuf);
 err0:
 	/* Failure! */
 	return (-1);
 }
 
+/*
+ * Find the part [segoff, segoff + seglen) of segment i which lies within
+ * [offset, epos) of the new file.
+ */
+static void
+segrange(struct bsdiff_ra_read_file * ctx, off_t i, off_t offset,
+    off_t epos, size_t * segoff, size_t * seglen)
+{
+
+	/* Where in the segment do we start? */
+	if (i * ctx->b >= offset)
+		*segoff = 0;
+	else
+		*segoff = offset - i * ctx->b;
+
+	/* How far do we read? */
+	if ((i + 1) * ctx->b < epos)
+		*seglen = ctx->b - *segoff;
+	else
+		*seglen = epos - (i * ctx->b + *segoff);
+}
+
+/*
+ * Patch the part of segment i which lies within [offset, epos) of the new
+ * file into buf, which corresponds to the new file starting at offset.
+ */
+static int
+readseg(struct bsdiff_ra_read_file * ctx, off_t i, uint8_t * buf,
+    off_t offset, off_t epos)
+{
+	size_t segoff, seglen;
+	uint8_t * dbuf;
+
+	/* Which part of the segment do we want, and where does it go? */
+	segrange(ctx, i, offset, epos, &segoff, &seglen);
+	dbuf = buf + (i * ctx->b + segoff - offset);
+
+	/*
+	 * Patch via the cache; or if we're not caching, straight into the
+	 * caller's buffer.
+	 */
+	if (atomic_load(&ctx->cachesize) > 0)
+		return (cachedseg(ctx, i, segoff, seglen, dbuf));
+	else
+		return (decodeseg(ctx, i, segoff, seglen, dbuf));
+}
+
+/* Patch one segment of a read.  Callback from parallel_pool. */
+static int
+doreadseg(void * cookie, size_t k)
+{
+	struct readjob * R = cookie;
+
+	return (readseg(R->ctx, R->first + k, R->buf, R->offset, R->epos));
+}
+
+/* Decode a segment ahead of the reader.  Callback from parallel_pool. */
+static int
+doprefetch(void * cookie, size_t k)
+{
+	struct prefetch * PF = cookie;
+	struct bsdiff_ra_read_file * ctx = PF->ctx;
+	size_t i = PF->first + k;
+	uint8_t * nbuf;
+	size_t seglen;
+
+	/*
+	 * If the segment is already cached, there's nothing to do; and if a
+	 * read is waiting for the pool, get out of its way and leave the
+	 * segment to be decoded when it is needed.
+	 */
+	if (bsdiff_ra_cache_contains(ctx->cache, i) ||
+	    (atomic_load(&ctx->nreading) > 0))
+		goto done;
+
+	/*
+	 * Decode the segment into the cache.  Failures are ignored, since
+	 * readahead is only an optimization; a read which needs the segment
+	 * will decode it again and report any error.
+	 */
+	seglen = seglength(ctx, i);
+	if ((nbuf = malloc(seglen)) == NULL)
+		goto done;
+	if (decodeseg(ctx, i, 0, seglen, nbuf)) {
+		free(nbuf);
+		goto done;
+	}
+	bsdiff_ra_cache_put(ctx->cache, i, nbuf, seglen);
+
+done:
+	/* This call is finished. */
+	atomic_fetch_sub(&PF->nleft, 1);
+
+	/* Don't cancel the rest of the readahead. */
+	return (0);
+}
+
+/*
+ * Free the readahead batches which have finished decoding; or if all is
+ * non-zero, wait for every batch to finish.  Call with ramtx held, or while
+ * no reads are in progress.
+ */
+static void
+rareap(struct bsdiff_ra_read_file * ctx, int all)
+{
+	struct prefetch ** PFp;
+	struct prefetch * PF;
+
+	for (PFp = &ctx->ra; (PF = *PFp) != NULL; ) {
+		/*
+		 * Skip batches which are still running, unless told to wait.
+		 * Once all of a batch's calls have returned, parallel_pool_wait
+		 * only has to free the job.
+		 */
+		if (!all && (atomic_load(&PF->nleft) > 0)) {
+			PFp = &PF->next;
+			continue;
+		}
+
+		/* Remove the batch from the list and free it. */
+		(void)parallel_pool_wait(PF->job);
+		*PFp = PF->next;
+		free(PF);
+	}
+}
+
+/*
+ * Wait for any readahead in progress to finish.  Call with ramtx held, or
+ * while no reads are in progress.
+ */
+static void
+rawait(struct bsdiff_ra_read_file * ctx)
+{
+
+	rareap(ctx, 1);
+}
+
+/*
+ * Record that [offset, epos) has been read.  If the read started where the
+ * previous read ended, start decoding the segments which follow it using the
+ * pool, so that they are in the cache by the time the reader wants them.
+ */
+static void
+prefetch_segs(struct bsdiff_ra_read_file * ctx, off_t offset, off_t epos)
+{
+	struct prefetch * PF;
+	size_t nseg, maxseg;
+	off_t next, first, end;
+	int sequential;
+
+	/* Lock the readahead state. */
+	if ((errno = pthread_mutex_lock(&ctx->ramtx)) != 0) {
+		warnp("pthread_mutex_lock");
+		return;
+	}
+
+	/* Free any batches which have finished. */
+	rareap(ctx, 0);
+
+	/* Is this read sequential?  Either way, remember where it ended. */
+	sequential = (offset == ctx->ranext);
+	ctx->ranext = epos;
+
+	/* A random read means anything we read ahead was a waste of time. */
+	if (!sequential) {
+		ctx->raend = 0;
+		goto done;
+	}
+
+	/*
+	 * Readahead needs threads to decode in and a cache to decode into;
+	 * and we don't want to evict segments before the reader gets to them,
+	 * so use at most half of the cache.
+	 */
+	if (ctx->pool == NULL)
+		goto done;
+	nseg = ctx->ranseg;
+	maxseg = atomic_load(&ctx->cachesize) / 2 / ctx->b;
+	if (nseg > maxseg)
+		nseg = maxseg;
+	if (nseg == 0)
+		goto done;
+
+	/*
+	 * The reader will want segment next and the nseg - 1 after it.  Wait
+	 * until half of the segments we've read ahead have been consumed, so
+	 * that we queue several segments at once.
+	 */
+	next = (epos - 1) / ctx->b + 1;
+	if (ctx->raend - next > (off_t)(nseg / 2))
+		goto done;
+	first = (ctx->raend > next) ? ctx->raend : next;
+	end = next + nseg;
+	if (end > (off_t)ctx->nsegs)
+		end = ctx->nsegs;
+	if (first >= end)
+		goto done;
+
+	/*
+	 * Queue a new batch behind any which are still being decoded, rather
+	 * than waiting for them with ramtx held (which would hold up other
+	 * readers too).
+	 */
+	if ((PF = malloc(sizeof(struct prefetch))) == NULL)
+		goto done;
+	PF->ctx = ctx;
+	PF->first = first;
+	atomic_init(&PF->nleft, end - first);
+	if ((PF->job = parallel_pool_submit(ctx->pool, end - first,
+	    doprefetch, PF)) == NULL) {
+		warnp("parallel_pool_submit");
+		free(PF);
+		goto done;
+	}
+	PF->next = ctx->ra;
+	ctx->ra = PF;
+	ctx->raend = end;
+
+done:
+	/* Unlock the readahead state. */
+	pthread_mutex_unlock(&ctx->ramtx);
+}
+
 /**
  * bsdiff_ra_read_pread(ctx, buf, nbytes, offset):
  * Starting from the specified offset in the "new file", read nbytes into buf.
  * (The "new file" is the file which was used along with the "old file" to
  * construct the patch file.)  Return -1 on error or the number of bytes read
- * (which will be nbytes unless the read hits EOF).
+ * (which will be nbytes unless the read hits EOF).  Concurrent reads share
+ * the segment cache.
  */
 ssize_t
 bsdiff_ra_read_pread(struct bsdiff_ra_read_file * ctx, void * buf,
     size_t nbytes, off_t offset)
 {
+	struct parallel_pool_job * job;
+	struct readjob R;
 	off_t epos;
+	off_t first, last;
 	off_t i;
-	size_t segoff, seglen;
-	uint8_t * pbuf, * obuf;
+	int rc;
 
 	/* Figure out how far we can read in total. */
 	epos = offset + nbytes;
 	if (epos > ctx->newsize)
 		epos = ctx->newsize;
 
-	/* Perform one segment of patching at once. */
-	for (i = offset / ctx->b; i * ctx->b < epos; i++) {
-		/* Where in the segment do we start? */
-		if (i * ctx->b >= offset)
-			segoff = 0;
-		else
-			segoff = offset - i * ctx->b;
-
-		/* How far do we read? */
-		if ((i + 1) * ctx->b < epos)
-			seglen = ctx->b - segoff;
-		else
-			seglen = epos - (i * ctx->b + segoff);
+	/* Nothing to do? */
+	if (epos <= offset)
+		goto done;
+
+	/* Which segments does the read touch? */
+	first = offset / ctx->b;
+	last = (epos - 1) / ctx->b;
+
+	/* If we have a pool and several segments, patch them in parallel. */
+	if ((ctx->pool != NULL) && (last > first)) {
+		R.ctx = ctx;
+		R.buf = buf;
+		R.offset = offset;
+		R.epos = epos;
+		R.first = first;
+
+		/* Any readahead ahead of us in the queue will step aside. */
+		atomic_fetch_add(&ctx->nreading, 1);
+		if ((job = parallel_pool_submit(ctx->pool, last - first + 1,
+		    doreadseg, &R)) == NULL) {
+			warnp("parallel_pool_submit");
+			atomic_fetch_sub(&ctx->nreading, 1);
+			goto err0;
+		}
+		rc = parallel_pool_wait(job);
+		atomic_fetch_sub(&ctx->nreading, 1);
+		if (rc)
+			goto err0;
+		goto readdone;
+	}
 
-		/* Allocate a buffer and read patch data. */
-		if ((pbuf = malloc(ctx->SH[i].plen)) == NULL)
+	/* Otherwise, perform one segment of patching at once. */
+	for (i = first; i <= last; i++) {
+		if (readseg(ctx, i, buf, offset, epos))
 			goto err0;
-		if (pread(ctx->fdp, pbuf, ctx->SH[i].plen,
-		    ctx->SH[i].ppos) != ctx->SH[i].plen)
-			goto err1;
+	}
 
-		/* Allocate a buffer and read old file data. */
-		if ((obuf = malloc(ctx->SH[i].olen)) == NULL)
-			goto err1;
-		if (pread(ctx->fdo, obuf, ctx->SH[i].olen,
-		    ctx->SH[i].opos) != ctx->SH[i].olen)
-			goto err2;
+readdone:
+	/* Decode what a sequential reader will want next. */
+	prefetch_segs(ctx, offset, epos);
 
-		/* Perform the segment of patching. */
-		if (patchseg(pbuf, ctx->SH[i].plen, obuf, ctx->SH[i].olen,
-		    segoff, seglen,
-		    (uint8_t *)(buf) + (i * ctx->b + segoff - offset)))
-			goto err2;
+done:
+	/* Success!  Return bytes read (truncated if we reached EOF). */
+	return ((epos > offset) ? epos - offset : 0);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/* Add a finished asynchronous read to the list of completed reads. */
+static void
+adone_push(struct bsdiff_ra_read_file * ctx, struct aread * R)
+{
+
+	R->next = NULL;
+	if (ctx->adonetail != NULL)
+		ctx->adonetail->next = R;
+	else
+		ctx->adone = R;
+	ctx->adonetail = R;
+}
+
+/**
+ * bsdiff_ra_read_submit(ctx, buf, nbytes, offset, cookie):
+ * Start reading nbytes from the specified offset in the "new file" into buf,
+ * and return without waiting for the read to complete.  The patch data and
+ * old file data for all of the segments which the read touches are read at
+ * once, via io_uring where available, or using the pool provided via
+ * bsdiff_ra_read_setpool; or if the files are mapped, the segments are
+ * patched immediately.  The buffer must not be touched until the read is
+ * returned by bsdiff_ra_read_reap along with the cookie.  Only one thread
+ * may submit and reap asynchronous reads on a context.
+ */
+int
+bsdiff_ra_read_submit(struct bsdiff_ra_read_file * ctx, void * buf,
+    size_t nbytes, off_t offset, void * cookie)
+{
+	struct bsdiff_ra_cache_entry * E;
+	struct decbufs * D;
+	struct aread * R;
+	struct aseg * S;
+	off_t first, last;
+	off_t i;
+
+	/* Set up for asynchronous reads if we need to and haven't already. */
+	if ((ctx->pmap == NULL) && (ctx->aio == NULL) &&
+	    ((ctx->aio = asyncpread_init(ASYNC_DEPTH, ctx->pool)) == NULL))
+		goto err0;
+
+	/* Record the read. */
+	if ((R = malloc(sizeof(struct aread))) == NULL)
+		goto err0;
+	R->cookie = cookie;
+	R->buf = buf;
+	R->offset = offset;
+	R->epos = offset + nbytes;
+	if (R->epos > ctx->newsize)
+		R->epos = ctx->newsize;
+	R->S = NULL;
+	R->nleft = 0;
+	R->failed = 0;
+
+	/* Nothing to do? */
+	if (R->epos <= offset)
+		goto done;
+
+	/* Which segments does the read touch? */
+	first = offset / ctx->b;
+	last = (R->epos - 1) / ctx->b;
+	if ((R->S = malloc((last - first + 1) * sizeof(struct aseg))) == NULL)
+		goto err1;
+
+	/* Start reading the data we need for each segment. */
+	for (i = first; i <= last; i++) {
+		S = &R->S[i - first];
+		S->R = R;
+		S->i = i;
+		S->D = NULL;
+		segrange(ctx, i, offset, R->epos, &S->segoff, &S->seglen);
+
+		/* If the segment is cached, copy out what we need. */
+		if ((atomic_load(&ctx->cachesize) > 0) &&
+		    ((E = bsdiff_ra_cache_get(ctx->cache, i)) != NULL)) {
+			memcpy(R->buf + (i * ctx->b + S->segoff - offset),
+			    &bsdiff_ra_cache_data(E)[S->segoff], S->seglen);
+			bsdiff_ra_cache_release(E);
+			continue;
+		}
 
-		/* Free patch and old file data buffers. */
-		free(obuf);
-		free(pbuf);
+		/* If the files are mapped, there's no I/O to wait for. */
+		if (ctx->pmap != NULL) {
+			if ((D = bufs_get(ctx)) == NULL) {
+				R->failed = 1;
+				break;
+			}
+			if (patchsegbufs(ctx, i, &ctx->pmap[ctx->SH[i].ppos],
+			    &ctx->omap[ctx->SH[i].opos], S->segoff, S->seglen,
+			    R->buf + (i * ctx->b + S->segoff - offset), D))
+				R->failed = 1;
+			bufs_put(ctx, D);
+			if (R->failed)
+				break;
+			continue;
+		}
+
+		/* Get buffers for patch data and old file data. */
+		if ((S->D = bufs_get(ctx)) == NULL) {
+			R->failed = 1;
+			break;
+		}
+		if (bufs_reserve(ctx, S->D)) {
+			bufs_put(ctx, S->D);
+			R->failed = 1;
+			break;
+		}
+		S->nio = 0;
+		S->nread = 0;
+
+		/*
+		 * Read both.  If we can't start the second read, we'll finish
+		 * with the segment when the first one completes.
+		 */
+		if (asyncpread_submit(ctx->aio, ctx->fdp, S->D->pbuf,
+		    ctx->SH[i].plen, ctx->SH[i].ppos, S)) {
+			bufs_put(ctx, S->D);
+			R->failed = 1;
+			break;
+		}
+		S->nio++;
+		R->nleft++;
+		if (asyncpread_submit(ctx->aio, ctx->fdo, S->D->obuf,
+		    ctx->SH[i].olen, ctx->SH[i].opos, S)) {
+			R->failed = 1;
+			break;
+		}
+		S->nio++;
 	}
 
-	/* Success!  Return bytes read (truncated if we reached EOF). */
-	return (epos - offset);
+	/* Decode what a sequential reader will want next. */
+	if (!R->failed)
+		prefetch_segs(ctx, offset, R->epos);
+
+done:
+	/*
+	 * If we're not waiting for any data, the read is complete; otherwise
+	 * any readahead queued ahead of its preads should step aside.
+	 */
+	ctx->nasync++;
+	if (R->nleft == 0)
+		adone_push(ctx, R);
+	else
+		atomic_fetch_add(&ctx->nreading, 1);
+
+	/* Success! */
+	return (0);
 
-err2:
-	free(obuf);
 err1:
-	free(pbuf);
+	free(R);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/**
+ * bsdiff_ra_read_reap(ctx, cookie, result):
+ * Wait for one of the reads submitted via bsdiff_ra_read_submit to complete.
+ * Set cookie to the cookie it was submitted with, and result to -1 if the
+ * read failed or the number of bytes read (which will be nbytes unless the
+ * read hit EOF).  Reads are not necessarily returned in the order in which
+ * they were submitted.  This must not be called unless a submitted read has
+ * not yet been reaped.
+ */
+int
+bsdiff_ra_read_reap(struct bsdiff_ra_read_file * ctx, void ** cookie,
+    ssize_t * result)
+{
+	struct aread * R;
+	struct aseg * S;
+	void * c;
+	ssize_t res;
+
+	/* Sanity-check. */
+	assert(ctx->nasync > 0);
+
+	/* Wait until a read has all the data it needs. */
+	while (ctx->adone == NULL) {
+		/* Wait for a pread to complete. */
+		if (asyncpread_reap(ctx->aio, &c, &res))
+			goto err0;
+		S = c;
+		R = S->R;
+		if (res == -1)
+			R->failed = 1;
+		else
+			S->nread += res;
+
+		/* Do we have both the patch data and old file data? */
+		if (--S->nio > 0)
+			continue;
+
+		/* Patch the segment, unless we've already failed. */
+		if (!R->failed && (S->nread !=
+		    (size_t)ctx->SH[S->i].plen + ctx->SH[S->i].olen))
+			R->failed = 1;
+		if (!R->failed && patchsegbufs(ctx, S->i, S->D->pbuf,
+		    S->D->obuf, S->segoff, S->seglen,
+		    R->buf + (S->i * ctx->b + S->segoff - R->offset), S->D))
+			R->failed = 1;
+		bufs_put(ctx, S->D);
+
+		/* Is the read complete? */
+		if (--R->nleft == 0) {
+			atomic_fetch_sub(&ctx->nreading, 1);
+			adone_push(ctx, R);
+		}
+	}
+
+	/* Remove the read from the list. */
+	R = ctx->adone;
+	if ((ctx->adone = R->next) == NULL)
+		ctx->adonetail = NULL;
+	ctx->nasync--;
+
+	/* Return its cookie and result. */
+	*cookie = R->cookie;
+	if (R->failed)
+		*result = -1;
+	else
+		*result = (R->epos > R->offset) ? R->epos - R->offset : 0;
+
+	/* Free the read. */
+	free(R->S);
+	free(R);
+
+	/* Success! */
+	return (0);
+
 err0:
 	/* Failure! */
 	return (-1);
 }
 
+/**
+ * bsdiff_ra_read_setcache(ctx, maxbytes):
+ * Keep up to maxbytes bytes of recently read segments of the new file in
+ * memory, so that reads which touch them again don't need to redo the
+ * patching.  The default is BSDIFF_RA_READ_CACHE_DEFAULT bytes; zero disables
+ * caching.
+ */
+void
+bsdiff_ra_read_setcache(struct bsdiff_ra_read_file * ctx, size_t maxbytes)
+{
+
+	atomic_store(&ctx->cachesize, maxbytes);
+	bsdiff_ra_cache_setsize(ctx->cache, maxbytes);
+}
+
+/**
+ * bsdiff_ra_read_setpool(ctx, pool):
+ * Use the worker threads in the pool to patch the segments of reads which
+ * span more than one segment in parallel, and to read ahead of sequential
+ * reads; or if pool is NULL, patch segments only in the calling thread and
+ * only when they are read.  This must not be called while reads are in
+ * progress, and the pool must not be destroyed while the context is using it.
+ */
+void
+bsdiff_ra_read_setpool(struct bsdiff_ra_read_file * ctx,
+    struct parallel_pool * pool)
+{
+	struct decbufs * D;
+
+	/* Finish reading ahead with the old pool, if any. */
+	rawait(ctx);
+	ctx->raend = 0;
+
+	/* Asynchronous reads will be set up again with the new pool. */
+	if (ctx->aio != NULL) {
+		asyncpread_free(ctx->aio);
+		ctx->aio = NULL;
+	}
+
+	/* Use the new pool. */
+	ctx->pool = pool;
+
+	/* Keep a set of decode buffers for each thread which decodes. */
+	ctx->nbufskeep = 1;
+	if (pool != NULL)
+		ctx->nbufskeep += parallel_pool_nthreads(pool);
+	while (ctx->nbufs > ctx->nbufskeep) {
+		D = ctx->bufs;
+		ctx->bufs = D->next;
+		ctx->nbufs--;
+		bufs_free(D);
+	}
+}
+
+/**
+ * bsdiff_ra_read_setreadahead(ctx, nsegs):
+ * When a read starts where the previous read ended, decode the nsegs
+ * segments following it in the background, so that a reader streaming
+ * through the new file finds them in the cache.  The default is
+ * BSDIFF_RA_READ_READAHEAD_DEFAULT segments; zero disables readahead.
+ * Readahead only happens when a pool has been provided via
+ * bsdiff_ra_read_setpool, and is limited to half of the cache.
+ */
+void
+bsdiff_ra_read_setreadahead(struct bsdiff_ra_read_file * ctx, size_t nsegs)
+{
+
+	/* Lock the readahead state. */
+	if ((errno = pthread_mutex_lock(&ctx->ramtx)) != 0) {
+		warnp("pthread_mutex_lock");
+		return;
+	}
+
+	/* Record the new readahead length. */
+	ctx->ranseg = nsegs;
+
+	/* Unlock the readahead state. */
+	pthread_mutex_unlock(&ctx->ramtx);
+}
+
+/**
+ * bsdiff_ra_read_stats(ctx, hits, misses, bytes):
+ * Return the number of times a segment was found and not found in the cache,
+ * and the number of bytes of segments currently cached.
+ */
+void
+bsdiff_ra_read_stats(struct bsdiff_ra_read_file * ctx, uint64_t * hits,
+    uint64_t * misses, size_t * bytes)
+{
+
+	bsdiff_ra_cache_stats(ctx->cache, hits, misses, bytes);
+}
+
 /**
  * bsdiff_ra_read_close(ctx):
- * Close the patching context.
+ * Close the patching context.  All asynchronous reads must have been reaped.
  */
 void
 bsdiff_ra_read_close(struct bsdiff_ra_read_file * ctx)
 {
+	struct decbufs * D;
+
+	/* Wait for any readahead to finish. */
+	rawait(ctx);
+	pthread_mutex_destroy(&ctx->ramtx);
+
+	/* Free the asynchronous read state. */
+	if (ctx->aio != NULL)
+		asyncpread_free(ctx->aio);
+
+	/* Free the decode buffers. */
+	while ((D = ctx->bufs) != NULL) {
+		ctx->bufs = D->next;
+		bufs_free(D);
+	}
+	pthread_mutex_destroy(&ctx->bufmtx);
 
-	/* Close files. */
-	close(ctx->fdo);
-	close(ctx->fdp);
+	/* Close (and unmap) files. */
+	closefile(ctx->omap, ctx->fdo, ctx->osize);
+	closefile(ctx->pmap, ctx->fdp, ctx->psize);
 
-	/* Free headers and context structure. */
+	/* Free the cache, headers, and context structure. */
+	bsdiff_ra_cache_free(ctx->cache);
 	free(ctx->SH);
 	free(ctx);
 }
@@ -30,28 +30,112 @@
 #include <sys/types.h>
 
 #include <stddef.h>
+#include <stdint.h>
 
-/* Opaque type. */
+/* Opaque types. */
 struct bsdiff_ra_read_file;
+struct parallel_pool;
+
+/* Flags for bsdiff_ra_read_open. */
+#define BSDIFF_RA_READ_MMAP	0x1	/* Map the files into memory. */
+
+/* Default amount of decoded segment data to cache. */
+#define BSDIFF_RA_READ_CACHE_DEFAULT	(32 * 1024 * 1024)
+
+/* Default number of segments to decode ahead of a sequential reader. */
+#define BSDIFF_RA_READ_READAHEAD_DEFAULT	4
 
 /**
- * bsdiff_ra_read_open(patchname, oldname):
- * Open the patch file and the "old" file and return a context.
+ * bsdiff_ra_read_open(patchname, oldname, flags):
+ * Open the patch file and the "old" file and return a context.  If flags
+ * includes BSDIFF_RA_READ_MMAP, map both files into memory and patch
+ * directly from the mappings instead of reading segments into buffers; this
+ * avoids copying data and lets processes share the page cache.  The context
+ * may be shared by several threads: bsdiff_ra_read_pread,
+ * bsdiff_ra_read_setcache, bsdiff_ra_read_setreadahead, and
+ * bsdiff_ra_read_stats may be called concurrently, but bsdiff_ra_read_close
+ * must not be called until all other calls have returned.
  */
-struct bsdiff_ra_read_file * bsdiff_ra_read_open(const char *, const char *);
+struct bsdiff_ra_read_file * bsdiff_ra_read_open(const char *, const char *,
+    int);
 
 /**
  * bsdiff_ra_read_pread(ctx, buf, nbytes, offset):
  * Starting from the specified offset in the "new file", read nbytes into buf.
  * (The "new file" is the file which was used along with the "old file" to
  * construct the patch file.)  Return -1 on error or the number of bytes read
- * (which will be nbytes unless the read hits EOF).
+ * (which will be nbytes unless the read hits EOF).  Concurrent reads share
+ * the segment cache.
  */
 ssize_t bsdiff_ra_read_pread(struct bsdiff_ra_read_file *, void *, size_t, off_t);
 
+/**
+ * bsdiff_ra_read_submit(ctx, buf, nbytes, offset, cookie):
+ * Start reading nbytes from the specified offset in the "new file" into buf,
+ * and return without waiting for the read to complete.  The patch data and
+ * old file data for all of the segments which the read touches are read at
+ * once, via io_uring where available, or using the pool provided via
+ * bsdiff_ra_read_setpool; or if the files are mapped, the segments are
+ * patched immediately.  The buffer must not be touched until the read is
+ * returned by bsdiff_ra_read_reap along with the cookie.  Only one thread
+ * may submit and reap asynchronous reads on a context.
+ */
+int bsdiff_ra_read_submit(struct bsdiff_ra_read_file *, void *, size_t,
+    off_t, void *);
+
+/**
+ * bsdiff_ra_read_reap(ctx, cookie, result):
+ * Wait for one of the reads submitted via bsdiff_ra_read_submit to complete.
+ * Set cookie to the cookie it was submitted with, and result to -1 if the
+ * read failed or the number of bytes read (which will be nbytes unless the
+ * read hit EOF).  Reads are not necessarily returned in the order in which
+ * they were submitted.  This must not be called unless a submitted read has
+ * not yet been reaped.
+ */
+int bsdiff_ra_read_reap(struct bsdiff_ra_read_file *, void **, ssize_t *);
+
+/**
+ * bsdiff_ra_read_setcache(ctx, maxbytes):
+ * Keep up to maxbytes bytes of recently read segments of the new file in
+ * memory, so that reads which touch them again don't need to redo the
+ * patching.  The default is BSDIFF_RA_READ_CACHE_DEFAULT bytes; zero disables
+ * caching.
+ */
+void bsdiff_ra_read_setcache(struct bsdiff_ra_read_file *, size_t);
+
+/**
+ * bsdiff_ra_read_setpool(ctx, pool):
+ * Use the worker threads in the pool to patch the segments of reads which
+ * span more than one segment in parallel, and to read ahead of sequential
+ * reads; or if pool is NULL, patch segments only in the calling thread and
+ * only when they are read.  This must not be called while reads are in
+ * progress, and the pool must not be destroyed while the context is using it.
+ */
+void bsdiff_ra_read_setpool(struct bsdiff_ra_read_file *,
+    struct parallel_pool *);
+
+/**
+ * bsdiff_ra_read_setreadahead(ctx, nsegs):
+ * When a read starts where the previous read ended, decode the nsegs
+ * segments following it in the background, so that a reader streaming
+ * through the new file finds them in the cache.  The default is
+ * BSDIFF_RA_READ_READAHEAD_DEFAULT segments; zero disables readahead.
+ * Readahead only happens when a pool has been provided via
+ * bsdiff_ra_read_setpool, and is limited to half of the cache.
+ */
+void bsdiff_ra_read_setreadahead(struct bsdiff_ra_read_file *, size_t);
+
+/**
+ * bsdiff_ra_read_stats(ctx, hits, misses, bytes):
+ * Return the number of times a segment was found and not found in the cache,
+ * and the number of bytes of segments currently cached.
+ */
+void bsdiff_ra_read_stats(struct bsdiff_ra_read_file *, uint64_t *,
+    uint64_t *, size_t *);
+
 /**
  * bsdiff_ra_read_close(ctx):
- * Close the patching context.
+ * Close the patching context.  All asynchronous reads must have been reaped.
  */
 void bsdiff_ra_read_close(struct bsdiff_ra_read_file *);
 
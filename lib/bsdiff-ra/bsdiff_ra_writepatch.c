@@ -24,25 +24,61 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <sys/types.h>
+
 #include <assert.h>
-#include <bzlib.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "bsdiff_alignment.h"
+#include "codec_buf.h"
+#include "parallel_pool.h"
 #include "sysendian.h"
 #include "warnp.h"
 
 #include "bsdiff_ra_writepatch.h"
 
+/*
+ * Number of segments per pool thread to encode in each window; and number of
+ * windows to keep queued in the pool while we write out the oldest one.
+ */
+#define WINDOW_SEGS	4
+#define WINDOW_AHEAD	2
+
 struct seghdr {
 	size_t ostart;
 	size_t olen;
 	size_t plen;
 };
 
+/* Segment encoding state. */
+struct state {
+	/* Parameters to bsdiff_ra_writepatch. */
+	size_t b;
+	size_t sublen;
+	const uint8_t * new;
+	size_t newsize;
+	const uint8_t * old;
+	int codec;
+
+	/* Values generated in bsdiff_ra_writepatch. */
+	size_t nsegs;
+	BSDIFF_ALIGNMENT * SA;
+	struct seghdr * SH;
+	uint8_t ** PD;
+};
+
+/* A range of segments encoded by one pool job; passed to doencode. */
+struct window {
+	struct state * state;
+	size_t start;
+	size_t end;
+	struct parallel_pool_job * job;
+};
+
 /* Encode a sign-magnitude 32-bit integer. */
 static void
 encval(uint8_t buf[4], int32_t x)
@@ -60,46 +96,79 @@ encval(uint8_t buf[4], int32_t x)
 	be32enc(buf, y);
 }
 
-/* Compress a block and return a pointer. */
-static uint8_t *
-acompress(const uint8_t * in, size_t inlen, size_t * outlen)
+/*
+ * Return the maximum size of a len-byte diff or extra block compressed by
+ * compblock.
+ */
+static size_t
+compbound(int codec, size_t sublen, size_t len)
 {
-	uint8_t * out;
-	unsigned int olen;
-	int bz2err;
+	size_t bound, k;
 
-	/* Allocate out buffer. */
-	olen = inlen + inlen / 100 + 600;
-	if ((out = malloc(olen)) == NULL)
-		goto err0;
+	/* Without sub-blocks, it's just the codec's bound. */
+	if (sublen == 0)
+		return (codec_bound(codec, len));
 
-	/* Perform the compression. */
-	if ((bz2err = BZ2_bzBuffToBuffCompress(out, &olen,
-	    (char *)(uintptr_t)(in), inlen, 9, 0, 0)) != BZ_OK) {
-		warn0("BZ2_bzBuffToBuffCompress error: %d", bz2err);
-		goto err1;
+	/* Otherwise, we have a table of lengths followed by sub-blocks. */
+	for (bound = k = 0; k < len; k += sublen)
+		bound += 4 + codec_bound(codec,
+		    (len - k < sublen) ? len - k : sublen);
+	return (bound);
+}
+
+/*
+ * Compress the diff or extra block in[len] into out[], split into sublen-byte
+ * sub-blocks if sublen is non-zero, and record the compressed length in
+ * ${outlen}.
+ */
+static int
+compblock(int codec, size_t sublen, const uint8_t * in, size_t len,
+    uint8_t * out, size_t * outlen)
+{
+	size_t nsub, pos, plen, k;
+
+	/* Without sub-blocks, compress the whole block in one go. */
+	if (sublen == 0)
+		return (codec_compress(codec, in, len, out, outlen));
+
+	/*
+	 * Compress each sub-block separately after a table of their
+	 * compressed lengths, so that readers can decompress just the
+	 * sub-blocks they need.
+	 */
+	nsub = (len + sublen - 1) / sublen;
+	for (pos = nsub * 4, k = 0; k < nsub; k++) {
+		if (codec_compress(codec, &in[k * sublen],
+		    (k < nsub - 1) ? sublen : len - k * sublen, &out[pos],
+		    &plen))
+			goto err0;
+		be32enc(&out[k * 4], plen);
+		pos += plen;
 	}
 
+	/* Record the total length. */
+	*outlen = pos;
+
 	/* Success! */
-	*outlen = olen;
-	return (out);
+	return (0);
 
-err1:
-	free(out);
 err0:
 	/* Failure! */
-	return (NULL);
+	return (-1);
 }
 
-/* Construct and write a patch data segment and record its length. */
-static int
-writeseg(FILE * f, BSDIFF_ALIGNMENT A, const uint8_t * new, size_t newsize,
+/*
+ * Construct a patch data segment and return a pointer to it; record its
+ * length in ${plen}.  If sublen is non-zero, split the diff and extra blocks
+ * into sublen-byte sub-blocks.
+ */
+static uint8_t *
+encseg(int codec, size_t sublen, BSDIFF_ALIGNMENT A, const uint8_t * new, size_t newsize,
     const uint8_t * old, size_t * plen)
 {
-	uint8_t hbuf[16];
 	struct bsdiff_alignseg * asegp;
 	uint8_t * ctrl, * diff, * extra;
-	uint8_t * ctrlc, * diffc, * extrac;
+	uint8_t * pd;
 	size_t ctrllen, difflen, extralen;
 	size_t ctrllenc, difflenc, extralenc;
 	size_t ctrlpos, diffpos, extrapos, npos, opos;
@@ -222,84 +291,134 @@ writeseg(FILE * f, BSDIFF_ALIGNMENT A, const uint8_t * new, size_t newsize,
 	/* Sanity-check. */
 	assert(extrapos == extralen);
 
-	/* Compress the three blocks. */
-	if ((ctrlc = acompress(ctrl, ctrllen, &ctrllenc)) == NULL)
+	/* Allocate space for the patch data segment. */
+	if ((pd = malloc(16 + codec_bound(codec, ctrllen) +
+	    compbound(codec, sublen, difflen) +
+	    compbound(codec, sublen, extralen))) == NULL)
 		goto err3;
-	if ((diffc = acompress(diff, difflen, &difflenc)) == NULL)
+
+	/* Compress the three blocks into place after the segment header. */
+	if (codec_compress(codec, ctrl, ctrllen, &pd[16], &ctrllenc))
+		goto err4;
+	if (compblock(codec, sublen, diff, difflen, &pd[16 + ctrllenc],
+	    &difflenc))
+		goto err4;
+	if (compblock(codec, sublen, extra, extralen,
+	    &pd[16 + ctrllenc + difflenc], &extralenc))
 		goto err4;
-	if ((extrac = acompress(extra, extralen, &extralenc)) == NULL)
-		goto err5;
 
-	/* Construct patch data segment. */
-	be32enc(&hbuf[0], ctrllenc);
-	be32enc(&hbuf[4], ctrllen);
-	be32enc(&hbuf[8], difflenc);
-	be32enc(&hbuf[12], extralenc);
-
-	/* Write out the patch data segment. */
-	if ((fwrite(hbuf, 16, 1, f) != 1) ||
-	    (fwrite(ctrlc, ctrllenc, 1, f) != 1) ||
-	    (fwrite(diffc, difflenc, 1, f) != 1) ||
-	    (fwrite(extrac, extralenc, 1, f) != 1)) {
-		warnp("fwrite");
-		goto err6;
-	}
+	/* Construct patch data segment header. */
+	be32enc(&pd[0], ctrllenc);
+	be32enc(&pd[4], ctrllen);
+	be32enc(&pd[8], difflenc);
+	be32enc(&pd[12], extralenc);
 
 	/* Record the total size of the patch data segment. */
 	*plen = 16 + ctrllenc + difflenc + extralenc;
 
 	/* Free allocated buffers. */
-	free(extrac);
-	free(diffc);
-	free(ctrlc);
 	free(extra);
 	free(diff);
 	free(ctrl);
 
 	/* Success! */
-	return (0);
+	return (pd);
 
-err6:
-	free(extrac);
-err5:
-	free(diffc);
 err4:
-	free(ctrlc);
+	free(pd);
 err3:
 	free(extra);
 err2:
 	free(diff);
 err1:
 	free(ctrl);
+err0:
+	/* Failure! */
+	return (NULL);
+}
+
+/* Encode one patch data segment.  Callback from parallel_pool. */
+static int
+doencode(void * cookie, size_t k)
+{
+	struct window * window = cookie;
+	struct state * state = window->state;
+	size_t i = window->start + k;
+	BSDIFF_ALIGNMENT A = state->SA[i];
+	struct seghdr * SH = &state->SH[i];
+	struct bsdiff_alignseg * asegp;
+	size_t omin, omax;
+	size_t j;
+
+	/* Find the minimum and maximum old positions used. */
+	omin = SIZE_MAX;
+	omax = 0;
+	for (j = 0; j < bsdiff_alignment_getsize(A); j++) {
+		asegp = bsdiff_alignment_get(A, j);
+		if (asegp->opos < omin)
+			omin = asegp->opos;
+		if (asegp->opos + asegp->alen > omax)
+			omax = asegp->opos + asegp->alen;
+	}
+
+	/* If there are no segments, use [0, 0) as the range. */
+	if (omin == SIZE_MAX)
+		omin = 0;
+
+	/* Record old segment start and length values. */
+	SH->ostart = omin;
+	SH->olen = omax - omin;
+
+	/* Sanity-check. */
+	assert(SH->olen <= (1 << 30));
+
+	/* Make sub-alignment relative to ostart. */
+	for (j = 0; j < bsdiff_alignment_getsize(A); j++)
+		bsdiff_alignment_get(A, j)->opos -= SH->ostart;
+
+	/* Construct the patch data segment. */
+	if ((state->PD[i] = encseg(state->codec, state->sublen, A, &state->new[i * state->b],
+	    (i < state->nsegs - 1) ? state->b :
+	    (state->newsize - i * state->b), &state->old[SH->ostart],
+	    &SH->plen)) == NULL)
+		goto err0;
+
+	/* Success! */
+	return (0);
+
 err0:
 	/* Failure! */
 	return (-1);
 }
 
 /**
- * bsdiff_ra_writepatch(name, b, A, new, newsize, old):
+ * bsdiff_ra_writepatch(name, b, sublen, A, new, newsize, old, codec, pool):
  * Write a seekable patch with the specified name, using b-byte patch segments,
  * based on the alignment A of the new data new[0 .. newsize - 1] with the old
- * data old[].
+ * data old[], and compressed with the specified codec.  If sublen is non-zero,
+ * the diff and extra blocks of each segment are compressed in sublen-byte
+ * sub-blocks so that part of a segment can be decoded by itself.  The patch
+ * segments are encoded by the threads in the provided pool.
  */
 int
-bsdiff_ra_writepatch(const char * name, size_t b, BSDIFF_ALIGNMENT A,
-    const uint8_t * new, size_t newsize, const uint8_t * old)
+bsdiff_ra_writepatch(const char * name, size_t b, size_t sublen,
+    BSDIFF_ALIGNMENT A, const uint8_t * new, size_t newsize,
+    const uint8_t * old, int codec, struct parallel_pool * pool)
 {
-	uint8_t buf[4096];
-	uint8_t hbuf[32];
+	uint8_t hbuf[40];
+	struct state state;
+	struct window * W;
 	BSDIFF_ALIGNMENT * SA;
 	struct seghdr * SH;
-	FILE * tmpf, * f;
+	uint8_t ** PD;
+	FILE * f;
 	uint8_t * hb;
 	uint8_t * hbc;
-	size_t hblenc, pdblen;
+	size_t hblenc, hbspace, pdblen, hlen;
 	struct bsdiff_alignseg aseg;
 	struct bsdiff_alignseg * asegp;
-	size_t nsegs;
-	size_t omin, omax;
-	size_t copylen;
-	size_t i, j;
+	size_t nsegs, winsegs, nwin, nsub;
+	size_t i, j, k;
 
 	/* Sanity-check. */
 	assert(b > 0);
@@ -381,129 +500,156 @@ bsdiff_ra_writepatch(const char * name, size_t b, BSDIFF_ALIGNMENT A,
 	    (nsegs > 0))
 		goto err1;
 
+	/* Allocate array for pointers to encoded patch data segments. */
+	if (((PD = malloc(nsegs * sizeof(uint8_t *))) == NULL) &&
+	    (nsegs > 0))
+		goto err2;
+	for (i = 0; i < nsegs; i++)
+		PD[i] = NULL;
+
 	/*
-	 * Fill in "old segment start" and "old segment length" values for
-	 * each patch segment, and make sub-alignments relative to old[ostart].
+	 * We don't know how large the compressed header block will be until
+	 * all of the patch data segments have been written, so reserve as
+	 * much space for it as it could possibly need.
 	 */
-	for (i = 0; i < nsegs; i++) {
-		/* Find the minimum and maximum old positions used. */
-		omin = SIZE_MAX;
-		omax = 0;
-		for (j = 0; j < bsdiff_alignment_getsize(SA[i]); j++) {
-			asegp = bsdiff_alignment_get(SA[i], j);
-			if (asegp->opos < omin)
-				omin = asegp->opos;
-			if (asegp->opos + asegp->alen > omax)
-				omax = asegp->opos + asegp->alen;
-		}
+	hbspace = codec_bound(codec, nsegs * 16);
 
-		/* If there are no segments, use [0, 0) as the range. */
-		if (omin == SIZE_MAX)
-			omin = 0;
-
-		/* Record old segment start and length values. */
-		SH[i].ostart = omin;
-		SH[i].olen = omax - omin;
-
-		/* Sanity-check. */
-		assert(SH[i].olen <= (1 << 30));
+	/*
+	 * Patches compressed with bzip2 and without sub-blocks don't need the
+	 * version 1 header fields, so give them the original 32-byte header,
+	 * which older readers understand.
+	 */
+	hlen = ((codec == CODEC_BZIP2) && (sublen == 0)) ? 32 : 40;
 
-		/* Make sub-alignment relative to ostart. */
-		for (j = 0; j < bsdiff_alignment_getsize(SA[i]); j++)
-			bsdiff_alignment_get(SA[i], j)->opos -= SH[i].ostart;
+	/* Open patch file and skip past where the headers will go. */
+	if ((f = fopen(name, "w")) == NULL) {
+		warnp("fopen(%s)", name);
+		goto err3;
+	}
+	if (fseeko(f, hlen + hbspace, SEEK_SET)) {
+		warnp("fseeko(%s)", name);
+		goto err4;
 	}
 
-	/* Open a temporary file for storing patch data segments. */
-	if ((tmpf = tmpfile()) == NULL) {
-		warnp("tmpfile");
-		goto err2;
+	/* Construct state structure for access from compute threads. */
+	state.b = b;
+	state.sublen = sublen;
+	state.new = new;
+	state.newsize = newsize;
+	state.old = old;
+	state.codec = codec;
+	state.nsegs = nsegs;
+	state.SA = SA;
+	state.SH = SH;
+	state.PD = PD;
+
+	/* Split the segments into windows. */
+	winsegs = WINDOW_SEGS * parallel_pool_nthreads(pool);
+	nwin = (nsegs + winsegs - 1) / winsegs;
+	if (((W = malloc(nwin * sizeof(struct window))) == NULL) &&
+	    (nwin > 0))
+		goto err4;
+	for (k = 0; k < nwin; k++) {
+		W[k].state = &state;
+		W[k].start = k * winsegs;
+		W[k].end = W[k].start + winsegs;
+		if (W[k].end > nsegs)
+			W[k].end = nsegs;
+		W[k].job = NULL;
 	}
 
-	/* Generate patch data blocks and add up their lengths. */
-	for (pdblen = i = 0; i < nsegs; i++) {
-		if (writeseg(tmpf, SA[i], &new[i * b],
-		    (i < nsegs - 1) ? b : (newsize - i * b),
-		    &old[SH[i].ostart], &SH[i].plen))
-			goto err3;
-		pdblen += SH[i].plen;
+	/*
+	 * Generate patch data segments, writing out each window of segments
+	 * in order while the pool encodes the next windows, and add up their
+	 * lengths.  If encoding a segment fails, the rest of its window is
+	 * skipped.
+	 */
+	for (pdblen = nsub = k = 0; k < nwin; k++) {
+		/* Keep the pool busy with the next few windows. */
+		for (; (nsub < nwin) && (nsub <= k + WINDOW_AHEAD); nsub++) {
+			if ((W[nsub].job = parallel_pool_submit(pool,
+			    W[nsub].end - W[nsub].start, doencode,
+			    &W[nsub])) == NULL)
+				goto err5;
+		}
+
+		/* Wait for this window to be encoded. */
+		if (parallel_pool_wait(W[k].job)) {
+			W[k].job = NULL;
+			goto err5;
+		}
+		W[k].job = NULL;
+
+		/* Write out the segments in order and free them. */
+		for (i = W[k].start; i < W[k].end; i++) {
+			if (fwrite(PD[i], SH[i].plen, 1, f) != 1) {
+				warnp("failed to write patch data");
+				goto err5;
+			}
+			pdblen += SH[i].plen;
+			free(PD[i]);
+			PD[i] = NULL;
+		}
 	}
 
 	/* Construct header block. */
 	if (((hb = malloc(nsegs * 16)) == NULL) &&
 	    (nsegs > 0))
-		goto err3;
+		goto err5;
 	for (i = 0; i < nsegs; i++) {
 		be64enc(&hb[i * 16], SH[i].ostart);
 		be32enc(&hb[i * 16 + 8], SH[i].olen);
 		be32enc(&hb[i * 16 + 12], SH[i].plen);
 	}
 
-	/* Compress header block. */
-	if ((hbc = acompress(hb, nsegs * 16, &hblenc)) == NULL)
-		goto err4;
+	/* Compress header block; the reserved space after it is zeroed. */
+	if ((hbc = calloc(hbspace, 1)) == NULL)
+		goto err6;
+	if (codec_compress(codec, hb, nsegs * 16, hbc, &hblenc))
+		goto err7;
+
+	/* Sanity-check. */
+	assert(hblenc <= hbspace);
 
 	/* Construct patch header. */
-	memcpy(&hbuf[0], "BSDIFFSX", 8);
+	memcpy(&hbuf[0], (hlen == 32) ? "BSDIFFSX" : "BSDIFFS1", 8);
 	be64enc(&hbuf[8], newsize);
 	be32enc(&hbuf[16], b);
-	be32enc(&hbuf[20], hblenc);
+	be32enc(&hbuf[20], hbspace);
 	be64enc(&hbuf[24], pdblen);
+	be32enc(&hbuf[32], codec);
+	be32enc(&hbuf[36], sublen);
 
-	/* Open patch file. */
-	if ((f = fopen(name, "w")) == NULL) {
-		warnp("fopen(%s)", name);
-		goto err5;
+	/* Go back to the start of the patch file. */
+	if (fseeko(f, 0, SEEK_SET)) {
+		warnp("fseeko(%s)", name);
+		goto err7;
 	}
 
 	/* Write patch header. */
-	if (fwrite(hbuf, 32, 1, f) != 1) {
+	if (fwrite(hbuf, hlen, 1, f) != 1) {
 		warnp("failed to write patch header");
-		goto err6;
+		goto err7;
 	}
 
-	/* Write compressed header block. */
-	if (fwrite(hbc, hblenc, 1, f) != 1) {
+	/* Write compressed header block, padded to the space we reserved. */
+	if (fwrite(hbc, hbspace, 1, f) != 1) {
 		warnp("failed to write compressed header block");
-		goto err6;
-	}
-
-	/* Copy patch data block. */
-	if (fseek(tmpf, 0, SEEK_SET)) {
-		warnp("fseek on temporary file");
-		goto err6;
-	}
-	for (i = 0; i < pdblen; i += 4096) {
-		/* Copy a buffer or whatever's left. */
-		if (i + 4096 < pdblen)
-			copylen = 4096;
-		else
-			copylen = pdblen - i;
-
-		/* Read some data. */
-		if (fread(buf, copylen, 1, tmpf) != 1) {
-			warnp("failed to read patch data from temporary file");
-			goto err6;
-		}
-
-		/* Write it back out. */
-		if (fwrite(buf, copylen, 1, f) != 1) {
-			warnp("failed to write patch data");
-			goto err6;
-		}
+		goto err7;
 	}
 
 	/* We've finished writing the patch. */
 	if (fclose(f)) {
 		warnp("fclose(%s)", name);
-		goto err5;
+		f = NULL;
+		goto err7;
 	}
 
-	/* Close the temporary file. */
-	fclose(tmpf);
-
 	/* Free buffers and arrays. */
 	free(hbc);
 	free(hb);
+	free(W);
+	free(PD);
 	free(SH);
 	for (i = 0; i < nsegs; i++) {
 		if (SA[i] != NULL)
@@ -514,14 +660,26 @@ bsdiff_ra_writepatch(const char * name, size_t b, BSDIFF_ALIGNMENT A,
 	/* Success! */
 	return (0);
 
+err7:
+	free(hbc);
 err6:
-	fclose(f);
+	free(hb);
 err5:
-	free(hbc);
+	/* Wait for any windows still in the pool. */
+	for (k = 0; k < nsub; k++) {
+		if (W[k].job != NULL)
+			parallel_pool_wait(W[k].job);
+	}
+	free(W);
 err4:
-	free(hb);
+	/* Don't leave a partial patch file behind. */
+	if (f != NULL)
+		fclose(f);
+	unlink(name);
 err3:
-	fclose(tmpf);
+	for (i = 0; i < nsegs; i++)
+		free(PD[i]);
+	free(PD);
 err2:
 	free(SH);
 err1:
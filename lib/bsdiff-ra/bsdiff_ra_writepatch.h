@@ -31,13 +31,19 @@
 
 #include "bsdiff_alignment.h"
 
+/* Opaque type. */
+struct parallel_pool;
+
 /**
- * bsdiff_ra_writepatch(name, b, A, new, newsize, old):
+ * bsdiff_ra_writepatch(name, b, sublen, A, new, newsize, old, codec, pool):
  * Write a seekable patch with the specified name, using b-byte patch segments,
  * based on the alignment A of the new data new[0 .. newsize - 1] with the old
- * data old[].
+ * data old[], and compressed with the specified codec.  If sublen is non-zero,
+ * the diff and extra blocks of each segment are compressed in sublen-byte
+ * sub-blocks so that part of a segment can be decoded by itself.  The patch
+ * segments are encoded by the threads in the provided pool.
  */
-int bsdiff_ra_writepatch(const char *, size_t, BSDIFF_ALIGNMENT,
-    const uint8_t *, size_t, const uint8_t *);
+int bsdiff_ra_writepatch(const char *, size_t, size_t, BSDIFF_ALIGNMENT,
+    const uint8_t *, size_t, const uint8_t *, int, struct parallel_pool *);
 
 #endif /* !_BSDIFF_RA_WRITEPATCH_H_ */
@@ -24,7 +24,6 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
-#include <err.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
@@ -76,6 +75,11 @@ search(size_t *I, const uint8_t *old, size_t oldsize, const uint8_t *new,
 	}
 }
 
+/**
+ * bsdiff_align(new, newsize, old, oldsize):
+ * Align new[0 .. newsize - 1] against old[0 .. oldsize - 1].  Return NULL on
+ * error.
+ */
 BSDIFF_ALIGNMENT
 bsdiff_align(const uint8_t * new, size_t newsize,
     const uint8_t * old, size_t oldsize)
@@ -93,11 +97,11 @@ bsdiff_align(const uint8_t * new, size_t newsize,
 
 	/* Suffix sort the old file. */
 	if ((I = sufsort_qsufsort(old, oldsize)) == NULL)
-		err(1, NULL);
+		goto err0;
 
 	/* Initialize empty alignment array. */
 	if ((A = bsdiff_alignment_init(0)) == NULL)
-		err(1, NULL);
+		goto err1;
 
 	/*
 	 * We have no "last offset", so set a value of lastoffset such that
@@ -151,7 +155,7 @@ bsdiff_align(const uint8_t * new, size_t newsize,
 				aseg.npos = scan;
 				aseg.opos = pos;
 				if (bsdiff_alignment_append(A, &aseg, 1))
-					err(1, NULL);
+					goto err2;
 				lastoffset = pos - scan;
 				break;
 			}
@@ -313,6 +317,11 @@ bsdiff_align(const uint8_t * new, size_t newsize,
 	/* Success! */
 	return (A);
 
+err2:
+	bsdiff_alignment_free(A);
+err1:
+	free(I);
+err0:
 	/* Failure! */
 	return (NULL);
 }
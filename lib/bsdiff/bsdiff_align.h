@@ -31,7 +31,8 @@
 
 /**
  * bsdiff_align(new, newsize, old, oldsize):
- * Align new[0 .. newsize - 1] against old[0 .. oldsize - 1].
+ * Align new[0 .. newsize - 1] against old[0 .. oldsize - 1].  Return NULL on
+ * error.
  */
 BSDIFF_ALIGNMENT bsdiff_align(const uint8_t *, size_t,
     const uint8_t *, size_t);
@@ -26,18 +26,25 @@
 
 #include <stdlib.h>
 #include <stdint.h>
-#include <stdio.h>
 
 #include "warnp.h"
 
 #include "blockmatch_index.h"
 #include "bsdiff_align.h"
 #include "bsdiff_alignment.h"
-#include "parallel_iter.h"
+#include "parallel_pool.h"
 
 #include "bsdiff_align_multi.h"
 
-/* Alignment state; passed to doalign. */
+/*
+ * Number of blocks per pool thread to align in each window; and number of
+ * windows to keep queued in the pool while we process the results from the
+ * oldest one.
+ */
+#define WINDOW_BLOCKS	4
+#define WINDOW_AHEAD	2
+
+/* Alignment state. */
 struct state {
 	/* Parameters to align_multi. */
 	const uint8_t * new;
@@ -52,11 +59,21 @@ struct state {
 	BSDIFF_ALIGNMENT * BA;
 };
 
-/* Compute one part of the alignment.  Callback from parallel_iter. */
+/* A range of blocks aligned by one pool job; passed to doalign. */
+struct window {
+	struct state * state;
+	size_t start;
+	size_t end;
+	struct parallel_pool_job * job;
+};
+
+/* Compute one part of the alignment.  Callback from parallel_pool. */
 static int
-doalign(void * cookie, size_t i)
+doalign(void * cookie, size_t k)
 {
-	struct state * state = cookie;
+	struct window * window = cookie;
+	struct state * state = window->state;
+	size_t i = window->start + k;
 	size_t opos, nblocklen, oblocklen;
 	ssize_t pos;
 	size_t j;
@@ -117,27 +134,56 @@ err0:
 	return (-1);
 }
 
+/* Add a block's alignment to the whole-file alignment. */
+static int
+appendalign(void * cookie, BSDIFF_ALIGNMENT BA)
+{
+	BSDIFF_ALIGNMENT A = cookie;
+	size_t j;
+
+	/* Add these alignment segments to the whole-file alignment. */
+	for (j = 0; j < bsdiff_alignment_getsize(BA); j++) {
+		if (bsdiff_alignment_append(A,
+		    bsdiff_alignment_get(BA, j), 1)) {
+			warnp("bsdiff_alignment_append");
+			goto err0;
+		}
+	}
+
+	/* Success! */
+	return (0);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
 /**
- * bsdiff_align_multi(new, newsize, old, oldsize, blocklen, digestlen, ncores):
- * Align new[0 .. newsize - 1] against old[0 .. oldsize - 1] by individually
- * matching and aligning blocklen-byte blocks using length-digestlen digests,
- * using ncores computation threads.
+ * bsdiff_align_multi_stream(new, newsize, old, oldsize, blocklen, digestlen,
+ *     pool, func, cookie):
+ * Align new[0 .. newsize - 1] against old[0 .. oldsize - 1] as for
+ * bsdiff_align_multi, but instead of returning the alignment, invoke
+ * func(cookie, BA) with the alignment of each block in turn.  The calls are
+ * made in order from the calling thread while the threads in the pool align
+ * later blocks; only a bounded window of blocks is aligned ahead of the block
+ * being handed to func.  The alignment BA is freed when func returns.
  */
-BSDIFF_ALIGNMENT
-bsdiff_align_multi(const uint8_t * new, size_t newsize, const uint8_t * old,
-    size_t oldsize, size_t blocklen, size_t digestlen, size_t ncores)
+int
+bsdiff_align_multi_stream(const uint8_t * new, size_t newsize,
+    const uint8_t * old, size_t oldsize, size_t blocklen, size_t digestlen,
+    struct parallel_pool * pool, int (* func)(void *, BSDIFF_ALIGNMENT),
+    void * cookie)
 {
 	struct state state;
 	struct blockmatch_index * index;
-	size_t nblocks;
-	size_t i, j;
+	struct window * W;
+	size_t nblocks, winblocks, nwin, nsub;
+	size_t i, k;
 	BSDIFF_ALIGNMENT * BA;
-	BSDIFF_ALIGNMENT A;
 
 	/* Index the old file. */
-	printf("Indexing old file...\n");
 	if ((index = blockmatch_index_index(old, oldsize,
-	    blocklen, digestlen, ncores)) == NULL) {
+	    blocklen, digestlen, pool)) == NULL) {
 		warnp("blockmatch_index_index");
 		goto err0;
 	}
@@ -153,6 +199,8 @@ bsdiff_align_multi(const uint8_t * new, size_t newsize, const uint8_t * old,
 	/* Allocate an array for holding sub-alignments. */
 	if ((BA = malloc(nblocks * sizeof(BSDIFF_ALIGNMENT))) == NULL)
 		goto err1;
+	for (i = 0; i < nblocks; i++)
+		BA[i] = NULL;
 
 	/* Construct state structure for access from compute threads. */
 	state.new = new;
@@ -164,53 +212,107 @@ bsdiff_align_multi(const uint8_t * new, size_t newsize, const uint8_t * old,
 	state.nblocks = nblocks;
 	state.BA = BA;
 
+	/* Split the blocks into windows. */
+	winblocks = WINDOW_BLOCKS * parallel_pool_nthreads(pool);
+	nwin = (nblocks + winblocks - 1) / winblocks;
+	if ((W = malloc(nwin * sizeof(struct window))) == NULL)
+		goto err2;
+	for (k = 0; k < nwin; k++) {
+		W[k].state = &state;
+		W[k].start = k * winblocks;
+		W[k].end = W[k].start + winblocks;
+		if (W[k].end > nblocks)
+			W[k].end = nblocks;
+		W[k].job = NULL;
+	}
+
 	/*
-	 * Figure out where blocks of the new file match up.  The incomplete
-	 * error-handling path is because parallel_iter can fail with function
-	 * calls still in progress.
+	 * Figure out where blocks of the new file match up, passing each
+	 * window of blocks to func while the pool works on the next windows.
+	 * If aligning a block fails, the rest of its window is skipped.
 	 */
-	printf("Computing alignments...\n");
-	if (parallel_iter(ncores, nblocks, doalign, &state))
-		goto err0;
+	for (nsub = k = 0; k < nwin; k++) {
+		/* Keep the pool busy with the next few windows. */
+		for (; (nsub < nwin) && (nsub <= k + WINDOW_AHEAD); nsub++) {
+			if ((W[nsub].job = parallel_pool_submit(pool,
+			    W[nsub].end - W[nsub].start, doalign,
+			    &W[nsub])) == NULL)
+				goto err3;
+		}
 
-	/* Initialize empty alignment. */
-	if ((A = bsdiff_alignment_init(0)) == NULL) {
-		warnp("bsdiff_alignment_init");
-		goto err2;
-	}
+		/* Wait for this window to be aligned. */
+		if (parallel_pool_wait(W[k].job)) {
+			W[k].job = NULL;
+			goto err3;
+		}
+		W[k].job = NULL;
 
-	/* Combine partial alignments. */
-	printf("Combining partial alignments...\n");
-	for (i = 0; i < nblocks; i++) {
-		/* Add these alignment segments to the whole-file alignment. */
-		for (j = 0; j < bsdiff_alignment_getsize(BA[i]); j++) {
-			if (bsdiff_alignment_append(A,
-			    bsdiff_alignment_get(BA[i], j), 1)) {
-				warnp("bsdiff_alignment_append");
+		/* Hand the alignments over in order and free them. */
+		for (i = W[k].start; i < W[k].end; i++) {
+			if (func(cookie, BA[i]))
 				goto err3;
-			}
+			bsdiff_alignment_free(BA[i]);
+			BA[i] = NULL;
 		}
 	}
 
-	/* Free partial alignments. */
-	for (i = 0; i < nblocks; i++)
-		bsdiff_alignment_free(BA[i]);
+	/* Free the window and partial alignment arrays. */
+	free(W);
 	free(BA);
 
 	/* Free the index of the old file. */
 	blockmatch_index_free(index);
 
 	/* Success! */
-	return (A);
+	return (0);
 
 err3:
-	bsdiff_alignment_free(A);
+	/* Wait for any windows still in the pool. */
+	for (k = 0; k < nsub; k++) {
+		if (W[k].job != NULL)
+			parallel_pool_wait(W[k].job);
+	}
+	free(W);
 err2:
 	for (i = 0; i < nblocks; i++)
 		bsdiff_alignment_free(BA[i]);
 	free(BA);
 err1:
 	blockmatch_index_free(index);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/**
+ * bsdiff_align_multi(new, newsize, old, oldsize, blocklen, digestlen, pool):
+ * Align new[0 .. newsize - 1] against old[0 .. oldsize - 1] by individually
+ * matching and aligning blocklen-byte blocks using length-digestlen digests,
+ * using the computation threads in the provided pool.
+ */
+BSDIFF_ALIGNMENT
+bsdiff_align_multi(const uint8_t * new, size_t newsize, const uint8_t * old,
+    size_t oldsize, size_t blocklen, size_t digestlen,
+    struct parallel_pool * pool)
+{
+	BSDIFF_ALIGNMENT A;
+
+	/* Initialize empty alignment. */
+	if ((A = bsdiff_alignment_init(0)) == NULL) {
+		warnp("bsdiff_alignment_init");
+		goto err0;
+	}
+
+	/* Align the files, combining the partial alignments as we go. */
+	if (bsdiff_align_multi_stream(new, newsize, old, oldsize, blocklen,
+	    digestlen, pool, appendalign, A))
+		goto err1;
+
+	/* Success! */
+	return (A);
+
+err1:
+	bsdiff_alignment_free(A);
 err0:
 	/* Failure! */
 	return (NULL);
@@ -29,13 +29,30 @@
 
 #include "bsdiff_alignment.h"
 
+/* Opaque type. */
+struct parallel_pool;
+
 /**
- * bsdiff_align_multi(new, newsize, old, oldsize, blocklen, digestlen, ncores):
+ * bsdiff_align_multi(new, newsize, old, oldsize, blocklen, digestlen, pool):
  * Align new[0 .. newsize - 1] against old[0 .. oldsize - 1] by individually
  * matching and aligning blocklen-byte blocks using length-digestlen digests,
- * using ncores computation threads.
+ * using the computation threads in the provided pool.
  */
 BSDIFF_ALIGNMENT bsdiff_align_multi(const uint8_t *, size_t, const uint8_t *,
-    size_t, size_t, size_t, size_t);
+    size_t, size_t, size_t, struct parallel_pool *);
+
+/**
+ * bsdiff_align_multi_stream(new, newsize, old, oldsize, blocklen, digestlen,
+ *     pool, func, cookie):
+ * Align new[0 .. newsize - 1] against old[0 .. oldsize - 1] as for
+ * bsdiff_align_multi, but instead of returning the alignment, invoke
+ * func(cookie, BA) with the alignment of each block in turn.  The calls are
+ * made in order from the calling thread while the threads in the pool align
+ * later blocks; only a bounded window of blocks is aligned ahead of the block
+ * being handed to func.  The alignment BA is freed when func returns.
+ */
+int bsdiff_align_multi_stream(const uint8_t *, size_t, const uint8_t *,
+    size_t, size_t, size_t, struct parallel_pool *,
+    int (*)(void *, BSDIFF_ALIGNMENT), void *);
 
 #endif /* !_BSDIFF_ALIGN_MULTI_H_ */
@@ -0,0 +1,454 @@
+/*-
+ * Copyright 2012 Colin Percival
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions 
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "warnp.h"
+
+#include "bsdiff_align.h"
+#include "bsdiff_align_multi.h"
+#include "bsdiff_alignment.h"
+#include "bsdiff_writepatch.h"
+#include "codec_buf.h"
+#include "parallel_pool.h"
+
+#include "bsdiff_create.h"
+
+/* Limits on the options, as enforced by bsdiff-big. */
+#define NTHREADS_MAX	64
+#define BLOCKLEN_MIN	0x200
+#define BLOCKLEN_MAX	0x10000000
+#define DIGESTLEN_MIN	0x10
+#define DIGESTLEN_MAX	0x10000
+
+/* State passed to writeblock. */
+struct create {
+	const struct bsdiff_options * opts;
+	struct bsdiff_writepatch * patch;
+	size_t newsize;
+	size_t done;
+	int rc;
+};
+
+/* Report progress, if we have been asked to. */
+static void
+progress(const struct bsdiff_options * opts, uint64_t done, uint64_t total)
+{
+
+	if (opts->progress != NULL)
+		opts->progress(opts->cookie, done, total);
+}
+
+/* Return non-zero if we have been asked to stop. */
+static int
+canceled(const struct bsdiff_options * opts)
+{
+
+	return ((opts->cancel != NULL) && opts->cancel(opts->cookie));
+}
+
+/* Add a block's alignment to the patch.  Callback from align_multi. */
+static int
+writeblock(void * cookie, BSDIFF_ALIGNMENT A)
+{
+	struct create * C = cookie;
+
+	/* Stop if we have been asked to. */
+	if (canceled(C->opts)) {
+		C->rc = BSDIFF_ECANCELED;
+		goto err0;
+	}
+
+	/* Add the block to the patch. */
+	if (bsdiff_writepatch_append(C->patch, A)) {
+		C->rc = BSDIFF_EWRITE;
+		goto err0;
+	}
+
+	/* Only the final block can be longer than blocklen. */
+	C->done += C->opts->blocklen;
+	if (C->done > C->newsize)
+		C->done = C->newsize;
+	progress(C->opts, C->done, C->newsize);
+
+	/* Success! */
+	return (0);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/* Align using a suffix sort of all of the old data, then write the patch. */
+static int
+create_sufsort(struct create * C, const char * name, const uint8_t * new,
+    size_t newsize, const uint8_t * old, size_t oldsize,
+    struct parallel_pool * pool)
+{
+	BSDIFF_ALIGNMENT A;
+
+	/* Compute an alignment of the two files. */
+	progress(C->opts, 0, newsize);
+	if ((A = bsdiff_align(new, newsize, old, oldsize)) == NULL) {
+		warnp("bsdiff_align");
+		C->rc = BSDIFF_EINTERNAL;
+		goto err0;
+	}
+	progress(C->opts, newsize, newsize);
+
+	/* Stop if we have been asked to. */
+	if (canceled(C->opts)) {
+		C->rc = BSDIFF_ECANCELED;
+		goto err1;
+	}
+
+	/*
+	 * Write the patch in one go, compressing it in this thread if we only
+	 * have one, so that older versions of bspatch can read it.
+	 */
+	if (bsdiff_writepatch(name, A, new, newsize, old, C->opts->codec,
+	    C->opts->flags, (C->opts->nthreads > 1) ? pool : NULL)) {
+		C->rc = BSDIFF_EWRITE;
+		goto err1;
+	}
+
+	/* Free the alignment. */
+	bsdiff_alignment_free(A);
+
+	/* Success! */
+	return (0);
+
+err1:
+	bsdiff_alignment_free(A);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/*
+ * Align blocks of the new data against matching parts of the old data,
+ * writing each part of the patch as we go.
+ */
+static int
+create_blocks(struct create * C, const char * name, const uint8_t * new,
+    size_t newsize, const uint8_t * old, size_t oldsize,
+    struct parallel_pool * pool)
+{
+
+	/*
+	 * Start writing the patch file, compressing it in this thread if we
+	 * only have one, so that older versions of bspatch can read it.
+	 */
+	if ((C->patch = bsdiff_writepatch_open(name, new, newsize, old,
+	    C->opts->codec, C->opts->flags,
+	    (C->opts->nthreads > 1) ? pool : NULL)) == NULL) {
+		C->rc = BSDIFF_EWRITE;
+		goto err0;
+	}
+
+	/* Align the files in parts, adding each part to the patch. */
+	progress(C->opts, 0, newsize);
+	if (bsdiff_align_multi_stream(new, newsize, old, oldsize,
+	    C->opts->blocklen, C->opts->digestlen, pool, writeblock, C)) {
+		if (C->rc == BSDIFF_OK) {
+			warnp("bsdiff_align_multi_stream");
+			C->rc = BSDIFF_EINTERNAL;
+		}
+		goto err1;
+	}
+
+	/* Finish the patch file. */
+	if (bsdiff_writepatch_close(C->patch)) {
+		C->rc = BSDIFF_EWRITE;
+		goto err0;
+	}
+
+	/* Success! */
+	return (0);
+
+err1:
+	bsdiff_writepatch_abort(C->patch);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/*
+ * Pick a matcher for BSDIFF_MATCHER_AUTO: a suffix sort if it fits within
+ * O->memlimit, or otherwise blocks which are as long as possible, since
+ * longer blocks give the aligner more context.  Only if no block length fits
+ * do we make the index smaller by shortening the digests.
+ */
+static int
+choose(struct bsdiff_options * O, size_t newsize, size_t oldsize)
+{
+
+	/* Use a suffix sort if we can. */
+	O->matcher = BSDIFF_MATCHER_SUFSORT;
+	if ((O->memlimit == 0) ||
+	    (bsdiff_memusage(O, newsize, oldsize) <= O->memlimit))
+		return (0);
+
+	/* Find the longest digests and then blocks which fit. */
+	O->matcher = BSDIFF_MATCHER_BLOCKS;
+	for (; O->digestlen >= DIGESTLEN_MIN; O->digestlen /= 2) {
+		for (O->blocklen = BLOCKLEN_MAX; O->blocklen >= BLOCKLEN_MIN;
+		    O->blocklen /= 2) {
+			if (bsdiff_memusage(O, newsize, oldsize) <= O->memlimit)
+				return (0);
+		}
+	}
+
+	/* Nothing fits. */
+	return (-1);
+}
+
+/**
+ * bsdiff_options_init(opts):
+ * Fill in ${opts} with the default options: match with a suffix sort using
+ * one thread from a private pool, 1 MiB blocks and length-8000 digests if
+ * the block matcher is selected, compress with bzip2, write an ordinary patch,
+ * and have no memory limit or callbacks.
+ */
+void
+bsdiff_options_init(struct bsdiff_options * opts)
+{
+
+	opts->matcher = BSDIFF_MATCHER_SUFSORT;
+	opts->nthreads = 1;
+	opts->pool = NULL;
+	opts->blocklen = 1048576;
+	opts->digestlen = 8000;
+	opts->codec = CODEC_BZIP2;
+	opts->flags = 0;
+	opts->memlimit = 0;
+	opts->progress = NULL;
+	opts->cancel = NULL;
+	opts->cookie = NULL;
+}
+
+/**
+ * bsdiff_memusage(opts, newsize, oldsize):
+ * Return an estimate of the working memory, in bytes, which bsdiff_create
+ * will use to make a patch from oldsize bytes of old data to newsize bytes
+ * of new data with the options ${opts}: for matching, for compressing the
+ * patch, and for the segments which an in-place patch holds until it is
+ * written out.  This does not include the old and new data themselves.  For
+ * BSDIFF_MATCHER_AUTO, return the estimate for the matcher which would be
+ * picked, or UINT64_MAX if none fits within opts->memlimit.  If opts->pool
+ * is not NULL, estimate for as many threads as it has.
+ */
+uint64_t
+bsdiff_memusage(const struct bsdiff_options * opts, size_t newsize,
+    size_t oldsize)
+{
+	struct bsdiff_options O;
+	uint64_t writing, nblocks, window;
+
+	/* Estimate for the threads in the pool we would use. */
+	O = *opts;
+	if (O.pool != NULL)
+		O.nthreads = parallel_pool_nthreads(O.pool);
+	opts = &O;
+
+	/* Estimate for the matcher we would pick. */
+	if ((O.matcher == BSDIFF_MATCHER_AUTO) &&
+	    choose(&O, newsize, oldsize))
+		return (UINT64_MAX);
+
+	/*
+	 * Writing the patch: a suffix sort gives us the whole alignment, so
+	 * the patch is written directly; the block matcher streams it.  With
+	 * one thread, the patch is compressed in the calling thread.
+	 */
+	writing = bsdiff_writepatch_memusage(newsize, opts->codec, opts->flags,
+	    (opts->nthreads > 1) ? opts->nthreads : 0,
+	    opts->matcher == BSDIFF_MATCHER_SUFSORT);
+
+	/* A suffix sort needs two size_t values per byte. */
+	if (opts->matcher == BSDIFF_MATCHER_SUFSORT)
+		return (writing + 2 * ((uint64_t)oldsize + 1) *
+		    sizeof(size_t));
+
+	/* The block matcher keeps a digest of each block of old data... */
+	nblocks = oldsize / opts->blocklen + 1;
+
+	/*
+	 * ... and each thread suffix sorts a window of old data, which is up
+	 * to 5.5 blocks long around a one-and-a-half block final block.
+	 */
+	window = (uint64_t)opts->blocklen * 11 / 2;
+	if (window > oldsize)
+		window = oldsize;
+
+	return (writing + nblocks * opts->digestlen * sizeof(double) +
+	    opts->nthreads * 2 * (window + 1) * sizeof(size_t));
+}
+
+/**
+ * bsdiff_create(name, new, newsize, old, oldsize, opts):
+ * Write a patch with the specified name which turns old[0 .. oldsize - 1]
+ * into new[0 .. newsize - 1], using the options ${opts}.  While matching,
+ * call opts->progress(opts->cookie, done, newsize) as the number of bytes of
+ * new data which have been matched increases, and call
+ * opts->cancel(opts->cookie) periodically; if it returns non-zero, stop.
+ * The suffix sort matcher can only report progress and check for
+ * cancellation before and after it runs; the block matcher does so after
+ * each block.  Return BSDIFF_OK on success or one of the other BSDIFF_*
+ * values on failure, in which case no patch file is left behind.  Nothing is
+ * printed to the standard output; errors are reported via warnp.
+ * If opts->matcher is BSDIFF_MATCHER_AUTO, suffix sort all of the old data
+ * if that fits within opts->memlimit (or there is no limit); otherwise use
+ * the block matcher with the longest blocks which fit, shortening the
+ * digests if even the shortest blocks do not fit.  The provided block
+ * length is ignored, and the digests are at most opts->digestlen long.
+ * If opts->pool is NULL, threads are launched for the call and shut down
+ * before it returns; otherwise the pool's threads are used and
+ * opts->nthreads is ignored, so that a caller making many patches can
+ * launch its threads once.
+ */
+int
+bsdiff_create(const char * name, const uint8_t * new, size_t newsize,
+    const uint8_t * old, size_t oldsize, const struct bsdiff_options * opts)
+{
+	struct bsdiff_options O;
+	struct create C;
+	struct parallel_pool * pool;
+	int rc;
+
+	/* Sanity-check the options. */
+	if (((opts->matcher != BSDIFF_MATCHER_SUFSORT) &&
+	    (opts->matcher != BSDIFF_MATCHER_BLOCKS) &&
+	    (opts->matcher != BSDIFF_MATCHER_AUTO)) ||
+	    ((opts->pool == NULL) && ((opts->nthreads < 1) ||
+	    (opts->nthreads > NTHREADS_MAX))) ||
+	    (opts->blocklen < BLOCKLEN_MIN) ||
+	    (opts->blocklen > BLOCKLEN_MAX) ||
+	    (opts->digestlen < DIGESTLEN_MIN) ||
+	    (opts->digestlen > DIGESTLEN_MAX) ||
+	    !codec_supported(opts->codec) ||
+	    (opts->flags & ~BSDIFF_WRITEPATCH_INPLACE)) {
+		rc = BSDIFF_EINVAL;
+		goto err0;
+	}
+
+	/* Use as many threads as the provided pool has, if any. */
+	O = *opts;
+	if (O.pool != NULL)
+		O.nthreads = parallel_pool_nthreads(O.pool);
+
+	/* Pick a matcher if asked to, and make sure it fits in memory. */
+	if (O.matcher == BSDIFF_MATCHER_AUTO) {
+		if (choose(&O, newsize, oldsize)) {
+			rc = BSDIFF_EMEMLIMIT;
+			goto err0;
+		}
+	} else if ((O.memlimit != 0) &&
+	    (bsdiff_memusage(&O, newsize, oldsize) > O.memlimit)) {
+		rc = BSDIFF_EMEMLIMIT;
+		goto err0;
+	}
+
+	/* Stop if we have been asked to before we start. */
+	if (canceled(&O)) {
+		rc = BSDIFF_ECANCELED;
+		goto err0;
+	}
+
+	/*
+	 * Launch threads for matching blocks and compressing the patch, unless
+	 * we were given some.  A single-threaded suffix sort compresses the
+	 * patch in the calling thread, which writes each part of the patch as
+	 * a single stream.
+	 */
+	pool = O.pool;
+	if ((pool == NULL) &&
+	    ((O.matcher == BSDIFF_MATCHER_BLOCKS) || (O.nthreads > 1))) {
+		if ((pool = parallel_pool_create(O.nthreads, 0)) == NULL) {
+			warnp("parallel_pool_create");
+			rc = BSDIFF_EINTERNAL;
+			goto err0;
+		}
+	}
+
+	/* Align the data and write the patch. */
+	C.opts = &O;
+	C.newsize = newsize;
+	C.done = 0;
+	C.rc = BSDIFF_OK;
+	if (O.matcher == BSDIFF_MATCHER_SUFSORT) {
+		if (create_sufsort(&C, name, new, newsize, old, oldsize,
+		    pool))
+			goto err1;
+	} else {
+		if (create_blocks(&C, name, new, newsize, old, oldsize,
+		    pool))
+			goto err1;
+	}
+
+	/* Shut down the threads if we launched them. */
+	if ((pool != NULL) && (pool != O.pool))
+		parallel_pool_destroy(pool);
+
+	/* Success! */
+	return (BSDIFF_OK);
+
+err1:
+	rc = C.rc;
+	if ((pool != NULL) && (pool != O.pool))
+		parallel_pool_destroy(pool);
+err0:
+	/* Failure! */
+	return (rc);
+}
+
+/**
+ * bsdiff_strerror(error):
+ * Return a string describing an error returned by bsdiff_create.
+ */
+const char *
+bsdiff_strerror(int error)
+{
+
+	switch (error) {
+	case BSDIFF_OK:
+		return ("Success");
+	case BSDIFF_EINTERNAL:
+		return ("Internal error");
+	case BSDIFF_EINVAL:
+		return ("Invalid options");
+	case BSDIFF_EMEMLIMIT:
+		return ("Memory limit is too small");
+	case BSDIFF_ECANCELED:
+		return ("Canceled");
+	case BSDIFF_EWRITE:
+		return ("Error writing patch");
+	default:
+		return ("Unknown error");
+	}
+}
@@ -0,0 +1,119 @@
+/*-
+ * Copyright 2012 Colin Percival
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions 
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _BSDIFF_CREATE_H_
+#define _BSDIFF_CREATE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Opaque type. */
+struct parallel_pool;
+
+/* Methods of matching the new data against the old data. */
+#define BSDIFF_MATCHER_SUFSORT	0	/* Suffix sort all of the old data. */
+#define BSDIFF_MATCHER_BLOCKS	1	/* Align blocks matched by digest. */
+#define BSDIFF_MATCHER_AUTO	2	/* Pick one which fits in memlimit. */
+
+/* Errors returned by bsdiff_create. */
+#define BSDIFF_OK		0	/* Success. */
+#define BSDIFF_EINTERNAL	1	/* Out of memory or similar. */
+#define BSDIFF_EINVAL		2	/* Invalid options. */
+#define BSDIFF_EMEMLIMIT	3	/* Would exceed the memory limit. */
+#define BSDIFF_ECANCELED	4	/* Canceled via the cancel callback. */
+#define BSDIFF_EWRITE		5	/* Patch file could not be written. */
+
+/* Options for bsdiff_create. */
+struct bsdiff_options {
+	int matcher;		/* BSDIFF_MATCHER_*. */
+	size_t nthreads;	/* Matching and compression threads. */
+	struct parallel_pool * pool;	/* Threads to use, or NULL. */
+	size_t blocklen;	/* Block length for BSDIFF_MATCHER_BLOCKS. */
+	size_t digestlen;	/* Digest length for BSDIFF_MATCHER_BLOCKS. */
+	int codec;		/* CODEC_*. */
+	int flags;		/* BSDIFF_WRITEPATCH_*. */
+	uint64_t memlimit;	/* Working memory limit, or 0 for none. */
+
+	/* Callbacks; any of these may be NULL. */
+	void (* progress)(void *, uint64_t, uint64_t);
+	int (* cancel)(void *);
+	void * cookie;
+};
+
+/**
+ * bsdiff_options_init(opts):
+ * Fill in ${opts} with the default options: match with a suffix sort using
+ * one thread from a private pool, 1 MiB blocks and length-8000 digests if
+ * the block matcher is selected, compress with bzip2, write an ordinary patch,
+ * and have no memory limit or callbacks.
+ */
+void bsdiff_options_init(struct bsdiff_options *);
+
+/**
+ * bsdiff_memusage(opts, newsize, oldsize):
+ * Return an estimate of the working memory, in bytes, which bsdiff_create
+ * will use to make a patch from oldsize bytes of old data to newsize bytes
+ * of new data with the options ${opts}: for matching, for compressing the
+ * patch, and for the segments which an in-place patch holds until it is
+ * written out.  This does not include the old and new data themselves.  For
+ * BSDIFF_MATCHER_AUTO, return the estimate for the matcher which would be
+ * picked, or UINT64_MAX if none fits within opts->memlimit.  If opts->pool
+ * is not NULL, estimate for as many threads as it has.
+ */
+uint64_t bsdiff_memusage(const struct bsdiff_options *, size_t, size_t);
+
+/**
+ * bsdiff_create(name, new, newsize, old, oldsize, opts):
+ * Write a patch with the specified name which turns old[0 .. oldsize - 1]
+ * into new[0 .. newsize - 1], using the options ${opts}.  While matching,
+ * call opts->progress(opts->cookie, done, newsize) as the number of bytes of
+ * new data which have been matched increases, and call
+ * opts->cancel(opts->cookie) periodically; if it returns non-zero, stop.
+ * The suffix sort matcher can only report progress and check for
+ * cancellation before and after it runs; the block matcher does so after
+ * each block.  Return BSDIFF_OK on success or one of the other BSDIFF_*
+ * values on failure, in which case no patch file is left behind.  Nothing is
+ * printed to the standard output; errors are reported via warnp.
+ * If opts->matcher is BSDIFF_MATCHER_AUTO, suffix sort all of the old data
+ * if that fits within opts->memlimit (or there is no limit); otherwise use
+ * the block matcher with the longest blocks which fit, shortening the
+ * digests if even the shortest blocks do not fit.  The provided block
+ * length is ignored, and the digests are at most opts->digestlen long.
+ * If opts->pool is NULL, threads are launched for the call and shut down
+ * before it returns; otherwise the pool's threads are used and
+ * opts->nthreads is ignored, so that a caller making many patches can
+ * launch its threads once.
+ */
+int bsdiff_create(const char *, const uint8_t *, size_t, const uint8_t *,
+    size_t, const struct bsdiff_options *);
+
+/**
+ * bsdiff_strerror(error):
+ * Return a string describing an error returned by bsdiff_create.
+ */
+const char * bsdiff_strerror(int);
+
+#endif /* !_BSDIFF_CREATE_H_ */
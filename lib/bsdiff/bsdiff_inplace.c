@@ -0,0 +1,290 @@
+/*-
+ * Copyright 2012 Colin Percival
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions 
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "bsdiff_alignment.h"
+
+#include "bsdiff_inplace.h"
+
+/* Segment states. */
+#define QUEUED	0x1	/* In the copy order. */
+#define DROPPED	0x2	/* Will be written out as new data instead. */
+#define ONPATH	0x4	/* On the path being searched for a cycle. */
+
+/* Return the first segment which writes new data at or after position pos. */
+static size_t
+firstwriter(const struct bsdiff_alignseg * segs, size_t nsegs, uint64_t pos)
+{
+	size_t lo = 0;
+	size_t hi = nsegs;
+	size_t mid;
+
+	/* The segments are in order and don't overlap, so bisect. */
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (segs[mid].npos + segs[mid].alen > pos)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+
+	return (lo);
+}
+
+/*
+ * Find the other segments which overwrite the old data read by segment i,
+ * and hence must be copied after it; store their indexes in out[] if it is
+ * not NULL.  Return the number of such segments.
+ */
+static size_t
+overwriters(const struct bsdiff_alignseg * segs, size_t nsegs, size_t i,
+    size_t * out)
+{
+	uint64_t end = segs[i].opos + segs[i].alen;
+	size_t j, n;
+
+	/* A segment which reads nothing doesn't care what is overwritten. */
+	if (segs[i].alen == 0)
+		return (0);
+
+	/* Scan the segments which write to the range we read from. */
+	n = 0;
+	for (j = firstwriter(segs, nsegs, segs[i].opos);
+	    (j < nsegs) && (segs[j].npos < end); j++) {
+		/*
+		 * The patcher reads all of a segment's old data before
+		 * writing any of it, so a segment can overwrite itself.
+		 */
+		if ((j == i) || (segs[j].alen == 0))
+			continue;
+		if (out != NULL)
+			out[n] = j;
+		n++;
+	}
+
+	return (n);
+}
+
+/**
+ * bsdiff_inplace_order(segs, nsegs, order, ncopies):
+ * Given nsegs alignment segments segs[] in order of position in the new data,
+ * pick an order in which to copy them when the new data is built on top of
+ * the old data, so that no segment's old data is overwritten before it is
+ * read.  Store the indexes of the segments to copy, in that order, in
+ * order[0 .. *ncopies - 1]; the remaining segments form cycles which cannot
+ * be copied in any order, so they must be written out as new data after all
+ * the copying is done.  The order[] array must have space for nsegs entries.
+ */
+int
+bsdiff_inplace_order(const struct bsdiff_alignseg * segs, size_t nsegs,
+    size_t * order, size_t * ncopies)
+{
+	size_t * outstart, * outedges;
+	size_t * instart, * inedges, * inpos;
+	size_t * indeg;
+	size_t * path;
+	uint8_t * state;
+	size_t nedges, npath, head, tail, scan;
+	size_t i, j, k, best;
+
+	/*
+	 * Segment i has an edge to segment j if j overwrites old data which i
+	 * reads.  Count the edges out of each segment, then list them.
+	 */
+	if ((outstart = malloc((nsegs + 1) * sizeof(size_t))) == NULL)
+		goto err0;
+	for (nedges = i = 0; i < nsegs; i++) {
+		outstart[i] = nedges;
+		nedges += overwriters(segs, nsegs, i, NULL);
+	}
+	outstart[nsegs] = nedges;
+	if ((outedges = malloc((nedges + 1) * sizeof(size_t))) == NULL)
+		goto err1;
+	for (i = 0; i < nsegs; i++)
+		overwriters(segs, nsegs, i, &outedges[outstart[i]]);
+
+	/* Count the edges into each segment. */
+	if ((indeg = malloc((nsegs + 1) * sizeof(size_t))) == NULL)
+		goto err2;
+	for (j = 0; j < nsegs; j++)
+		indeg[j] = 0;
+	for (k = 0; k < nedges; k++)
+		indeg[outedges[k]]++;
+
+	/* List the edges into each segment too, so we can walk backwards. */
+	if ((instart = malloc((nsegs + 1) * sizeof(size_t))) == NULL)
+		goto err3;
+	if ((inpos = malloc((nsegs + 1) * sizeof(size_t))) == NULL)
+		goto err4;
+	if ((inedges = malloc((nedges + 1) * sizeof(size_t))) == NULL)
+		goto err5;
+	for (k = j = 0; j < nsegs; j++) {
+		instart[j] = inpos[j] = k;
+		k += indeg[j];
+	}
+	instart[nsegs] = k;
+	for (i = 0; i < nsegs; i++) {
+		for (k = outstart[i]; k < outstart[i + 1]; k++)
+			inedges[inpos[outedges[k]]++] = i;
+	}
+	for (j = 0; j < nsegs; j++)
+		inpos[j] = instart[j];
+
+	/* Allocate state and the path used for finding cycles. */
+	if ((state = malloc(nsegs + 1)) == NULL)
+		goto err6;
+	if ((path = malloc((nsegs + 1) * sizeof(size_t))) == NULL)
+		goto err7;
+	for (i = 0; i < nsegs; i++)
+		state[i] = 0;
+
+	/*
+	 * Sort the segments topologically, using order[] as the queue of
+	 * segments which nobody needs to read from before they're copied.
+	 */
+	head = tail = 0;
+	for (i = 0; i < nsegs; i++) {
+		if (indeg[i] == 0) {
+			order[tail++] = i;
+			state[i] |= QUEUED;
+		}
+	}
+	npath = 0;
+	scan = 0;
+	do {
+		/* Copying a segment unblocks the segments overwriting it. */
+		while (head < tail) {
+			i = order[head++];
+			for (k = outstart[i]; k < outstart[i + 1]; k++) {
+				j = outedges[k];
+				if (state[j] & (QUEUED | DROPPED))
+					continue;
+				if (--indeg[j] == 0) {
+					order[tail++] = j;
+					state[j] |= QUEUED;
+				}
+			}
+		}
+
+		/*
+		 * Each segment on the path is read by the one after it, so if
+		 * one has been queued, so have all of those which follow it.
+		 */
+		while ((npath > 0) &&
+		    (state[path[npath - 1]] & (QUEUED | DROPPED)))
+			state[path[--npath]] &= ~ONPATH;
+
+		/* Start a new path if necessary; stop if we're done. */
+		if (npath == 0) {
+			while ((scan < nsegs) &&
+			    (state[scan] & (QUEUED | DROPPED)))
+				scan++;
+			if (scan == nsegs)
+				break;
+			path[npath++] = scan;
+			state[scan] |= ONPATH;
+		}
+
+		/*
+		 * Every segment left is read by another segment which is
+		 * left, so walking backwards must eventually lead us back to
+		 * a segment already on the path.  Each segment's list of
+		 * readers is only scanned once, since segments never return
+		 * once they're queued or dropped.
+		 */
+		do {
+			i = path[npath - 1];
+			while (state[inedges[inpos[i]]] & (QUEUED | DROPPED))
+				inpos[i]++;
+			j = inedges[inpos[i]];
+			if (state[j] & ONPATH)
+				break;
+			path[npath++] = j;
+			state[j] |= ONPATH;
+		} while (1);
+
+		/* Find where the cycle starts, and its shortest segment. */
+		for (k = npath - 1; path[k] != j; k--)
+			continue;
+		for (best = k; k < npath; k++) {
+			if (segs[path[k]].alen < segs[path[best]].alen)
+				best = k;
+		}
+
+		/* Drop that segment and cut the path back to before it. */
+		i = path[best];
+		state[i] |= DROPPED;
+		while (npath > best)
+			state[path[--npath]] &= ~ONPATH;
+
+		/* A dropped segment doesn't read anything. */
+		for (k = outstart[i]; k < outstart[i + 1]; k++) {
+			j = outedges[k];
+			if (state[j] & (QUEUED | DROPPED))
+				continue;
+			if (--indeg[j] == 0) {
+				order[tail++] = j;
+				state[j] |= QUEUED;
+			}
+		}
+	} while (1);
+
+	/* Return the number of segments to copy. */
+	*ncopies = tail;
+
+	/* Free working space. */
+	free(path);
+	free(state);
+	free(inedges);
+	free(inpos);
+	free(instart);
+	free(indeg);
+	free(outedges);
+	free(outstart);
+
+	/* Success! */
+	return (0);
+
+err7:
+	free(state);
+err6:
+	free(inedges);
+err5:
+	free(inpos);
+err4:
+	free(instart);
+err3:
+	free(indeg);
+err2:
+	free(outedges);
+err1:
+	free(outstart);
+err0:
+	/* Failure! */
+	return (-1);
+}
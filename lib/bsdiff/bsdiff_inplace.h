@@ -0,0 +1,47 @@
+/*-
+ * Copyright 2012 Colin Percival
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions 
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _BSDIFF_INPLACE_H_
+#define _BSDIFF_INPLACE_H_
+
+#include <stddef.h>
+
+#include "bsdiff_alignment.h"
+
+/**
+ * bsdiff_inplace_order(segs, nsegs, order, ncopies):
+ * Given nsegs alignment segments segs[] in order of position in the new data,
+ * pick an order in which to copy them when the new data is built on top of
+ * the old data, so that no segment's old data is overwritten before it is
+ * read.  Store the indexes of the segments to copy, in that order, in
+ * order[0 .. *ncopies - 1]; the remaining segments form cycles which cannot
+ * be copied in any order, so they must be written out as new data after all
+ * the copying is done.  The order[] array must have space for nsegs entries.
+ */
+int bsdiff_inplace_order(const struct bsdiff_alignseg *, size_t, size_t *,
+    size_t *);
+
+#endif /* !_BSDIFF_INPLACE_H_ */
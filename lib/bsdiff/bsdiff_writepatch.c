@@ -24,45 +24,24 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
-#include <bzlib.h>
-#include <err.h>
+#include <sys/types.h>
+
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "sysendian.h"
 #include "warnp.h"
 
 #include "bsdiff_alignment.h"
+#include "bsdiff_inplace.h"
+#include "codec_buf.h"
+#include "codec_write.h"
 
 #include "bsdiff_writepatch.h"
 
-/* Write to a BZ2-encoded stream. */
-static int
-bzwrite(BZFILE * fbz2, const uint8_t * buf, size_t len)
-{
-	void * _buf;
-	int bz2err;
-
-	/*
-	 * The bz2 library API is broken, in that it takes a write buffer as a
-	 * "void *" instead of a "const void *".  Since we're writing const
-	 * buffers, we need to "de-const-ify" the pointer.
-	 */
-	_buf = (void *)(intptr_t)(buf);
-
-	/* Perform the write. */
-	BZ2_bzWrite(&bz2err, fbz2, _buf, len);
-
-	/* Check for error. */
-	if (bz2err != BZ_OK) {
-		warn0("BZ2_bzWrite failed: %d", bz2err);
-		return (-1);
-	} else
-		return (0);
-}
-
 /* Encode an int64_t as a sequence of 8 bytes. */
 static void
 encval(int64_t x, uint8_t buf[8])
@@ -80,9 +59,22 @@ encval(int64_t x, uint8_t buf[8])
 	le64enc(buf, y);
 }
 
-/* Write an encoded int64_t to the bz2 stream. */
+/*
+ * Write to a compressed stream, or do nothing if fz is NULL (because we're
+ * making a pass over the segments to write one of the other blocks).
+ */
+static int
+zwrite(struct codec_write * fz, const uint8_t * buf, size_t len)
+{
+
+	if (fz == NULL)
+		return (0);
+	return (codec_write_write(fz, buf, len));
+}
+
+/* Write an encoded int64_t to the compressed stream. */
 static int
-writeval(BZFILE * fbz2, int64_t val)
+writeval(struct codec_write * fz, int64_t val)
 {
 	uint8_t buf[8];
 
@@ -90,112 +82,249 @@ writeval(BZFILE * fbz2, int64_t val)
 	encval(val, buf);
 
 	/* Write it out. */
-	return (bzwrite(fbz2, buf, 8));
+	return (zwrite(fz, buf, 8));
 }
 
-/* Append the (compressed) control block to the the file. */
+/* Magic strings for patches compressed with each codec. */
+static const char * magics[] = {
+	"BSDIFF40",	/* CODEC_BZIP2 */
+	"BSDIFF4L",	/* CODEC_XZ */
+	"BSDIFF4Z",	/* CODEC_ZSTD */
+	"BSDIFF4B"	/* CODEC_BROTLI */
+};
+
+/*
+ * Magic string for bzip2 patches whose blocks may be several concatenated
+ * streams, which bspatch versions predating parallel compression reject.
+ */
+#define MULTIMAGIC	"BSDIFF4P"
+#define INPLACEMULTIMAGIC	"BSDIFI4P"
+
+/* Magic strings for in-place patches compressed with each codec. */
+static const char * inplacemagics[] = {
+	"BSDIFI40",	/* CODEC_BZIP2 */
+	"BSDIFI4L",	/* CODEC_XZ */
+	"BSDIFI4Z",	/* CODEC_ZSTD */
+	"BSDIFI4B"	/* CODEC_BROTLI */
+};
+
+/*
+ * Maximum length of a segment copied by an in-place patch; bspatch reads all
+ * of a segment's old data into a buffer of this size before writing any of
+ * its new data.
+ */
+#define INPLACE_MAXLEN	(1024 * 1024)
+
+/* Typical length of an alignment segment, for bsdiff_writepatch_memusage. */
+#define INPLACE_SEGLEN	256
+
+/* Patch being written. */
+struct bsdiff_writepatch {
+	/* Parameters to bsdiff_writepatch_open. */
+	const char * name;
+	const uint8_t * new;
+	size_t newsize;
+	const uint8_t * old;
+	int codec;
+	int flags;
+	struct parallel_pool * pool;
+
+	/*
+	 * Non-zero if all of the segments are in A by the time the patch is
+	 * closed, so the blocks can be written straight into the patch file
+	 * one after another; otherwise, segments are written as they are
+	 * appended, with the diff and extra blocks going to temporary files.
+	 */
+	int direct;
+
+	/*
+	 * The segments of a direct patch.  For an in-place patch we own
+	 * these; for bsdiff_writepatch they are the caller's.
+	 */
+	BSDIFF_ALIGNMENT A;
+
+	/* The patch file, and temporary files for the diff and extra data. */
+	FILE * f;
+	FILE * fdiff;
+	FILE * fextra;
+
+	/* Compressed streams for the three blocks, or NULL if not writing. */
+	struct codec_write * ctrlz;
+	struct codec_write * diffz;
+	struct codec_write * extraz;
+
+	/* Positions reached in the new and old data. */
+	size_t npos;
+	size_t opos;
+
+	/* Non-zero if we haven't written any control data yet. */
+	int first;
+
+	/* Non-zero if bsdiff_writepatch_append failed. */
+	int failed;
+};
+
+/* Write a segment of diff. */
 static int
-writectrl(FILE * f, BSDIFF_ALIGNMENT A, size_t newsize)
+writediffseg(struct codec_write * fz, const uint8_t * new,
+    const uint8_t * old, size_t len)
 {
-	struct bsdiff_alignseg * asegp;
-	BZFILE * fbz2;
-	size_t opos, npos;
+	uint8_t buf[4096];
 	size_t i;
-	int bz2err;
 
-	/* Start writing control tuples. */
-	if ((fbz2 = BZ2_bzWriteOpen(&bz2err, f, 9, 0, 0)) == NULL) {
-		warn0("BZ2_bzWriteOpen failed: %d", bz2err);
+	/* Don't bother computing the diff if we're not writing it. */
+	if (fz == NULL)
+		return (0);
+
+	/* Loop until we've written everything. */
+	while (len > 0) {
+		/* Diff until we fill the buffer or run out of data. */
+		for (i = 0; i < 4096 && len > 0; i++, len--)
+			buf[i] = *new++ - *old++;
+
+		/* Write out the diffed data. */
+		if (codec_write_write(fz, buf, i))
+			goto err0;
+	}
+
+	/* Success! */
+	return (0);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/* Append the contents of the temporary file src to the patch file. */
+static int
+copyfile(struct bsdiff_writepatch * P, FILE * src)
+{
+	uint8_t buf[65536];
+	size_t len;
+
+	/* Go back to the start of the temporary file. */
+	if (fseeko(src, 0, SEEK_SET)) {
+		warnp("fseeko");
 		goto err0;
 	}
 
-	/*
-	 * The control block starts with "copy X bytes from position 0 in the
-	 * old file to position 0 in the new file".  If we have a first
-	 * alignment segment and it aligns position 0 to position 0, this is
-	 * great -- we can emit the number of bytes to copy and move on to the
-	 * next alignment segment.  Otherwise, we need to say "copy zero bytes"
-	 * and start processing at the start of the alignment list.
-	 */
-	if ((bsdiff_alignment_getsize(A) > 0) &&
-	    (bsdiff_alignment_get(A, 0)->npos == 0) &&
-	    (bsdiff_alignment_get(A, 0)->opos == 0)) {
-		asegp = bsdiff_alignment_get(A, 0);
-		if (writeval(fbz2, asegp->alen))
-			goto err1;
-		npos = opos = asegp->alen;
-		i = 1;
-	} else {
-		if (writeval(fbz2, 0))
-			goto err1;
-		npos = opos = 0;
-		i = 0;
+	/* Copy data until we hit EOF. */
+	while ((len = fread(buf, 1, sizeof(buf), src)) > 0) {
+		if (fwrite(buf, len, 1, P->f) != 1) {
+			warnp("fwrite(%s)", P->name);
+			goto err0;
+		}
+	}
+	if (ferror(src)) {
+		warnp("fread");
+		goto err0;
 	}
 
-	/* Read through the alignment array, processing segments. */
-	for ( ; i < bsdiff_alignment_getsize(A); i++) {
-		asegp = bsdiff_alignment_get(A, i);
+	/* Success! */
+	return (0);
 
-		/* Extra length is the gap before this segment starts. */
-		if (writeval(fbz2, asegp->npos - npos))
-			goto err1;
+err0:
+	/* Failure! */
+	return (-1);
+}
 
-		/* Seek length is the difference between positions in old. */
-		if (writeval(fbz2, asegp->opos - opos))
-			goto err1;
+/* Save the segments in A, split into pieces of at most INPLACE_MAXLEN. */
+static int
+saveinplace(struct bsdiff_writepatch * P, BSDIFF_ALIGNMENT A)
+{
+	struct bsdiff_alignseg * asegp;
+	struct bsdiff_alignseg piece;
+	uint64_t off;
+	size_t i;
 
-		/* Diff length is the length of the aligned region. */
-		if (writeval(fbz2, asegp->alen))
-			goto err1;
+	/* Process alignment segments one by one. */
+	for (i = 0; i < bsdiff_alignment_getsize(A); i++) {
+		asegp = bsdiff_alignment_get(A, i);
 
-		/* Update our pointers within the two files. */
-		npos = asegp->npos + asegp->alen;
-		opos = asegp->opos + asegp->alen;
+		/* Split the segment up. */
+		for (off = 0; off < asegp->alen; off += piece.alen) {
+			piece.npos = asegp->npos + off;
+			piece.opos = asegp->opos + off;
+			piece.alen = asegp->alen - off;
+			if (piece.alen > INPLACE_MAXLEN)
+				piece.alen = INPLACE_MAXLEN;
+			if (bsdiff_alignment_append(P->A, &piece, 1))
+				goto err0;
+		}
 	}
 
-	/* Extra length is the rest up to the end of the file. */
-	if (writeval(fbz2, newsize - npos))
-		goto err1;
+	/* Success! */
+	return (0);
 
-	/* Seek length is zero; no point seeking after we're finished. */
-	if (writeval(fbz2, 0))
-		goto err1;
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/* Write a run of new data to an in-place patch. */
+static int
+writeliteral(struct bsdiff_writepatch * P, size_t npos, size_t len)
+{
 
-	/* We've finished writing control tuples. */
-	BZ2_bzWriteClose(&bz2err, fbz2, 0, NULL, NULL);
-	if (bz2err != BZ_OK) {
-		warn0("BZ2_bzWriteClose failed: %d", bz2err);
+	/* The control tuple has -1 in place of the old position. */
+	if (writeval(P->ctrlz, npos))
+		goto err0;
+	if (writeval(P->ctrlz, -1))
+		goto err0;
+	if (writeval(P->ctrlz, len))
+		goto err0;
+
+	/* Write the data to the extra block. */
+	if (zwrite(P->extraz, &P->new[npos], len))
 		goto err0;
-	}
 
 	/* Success! */
 	return (0);
 
-err1:
-	BZ2_bzWriteClose(&bz2err, fbz2, 0, NULL, NULL);
 err0:
 	/* Failure! */
 	return (-1);
 }
 
-/* Write a segment of diff. */
+/*
+ * Write the control, diff, and extra data for an in-place patch: first the
+ * saved segments order[0 .. ncopies - 1], which can be copied in that order
+ * without overwriting anything before it is read; then everything which
+ * copied[] doesn't mark as copied, as new data.
+ */
 static int
-writediffseg(BZFILE * fbz2, const uint8_t * new, const uint8_t * old,
-    size_t len)
+writeinplace(struct bsdiff_writepatch * P, const size_t * order,
+    size_t ncopies, const uint8_t * copied)
 {
-	uint8_t buf[4096];
-	size_t i;
+	struct bsdiff_alignseg * segs = bsdiff_alignment_get(P->A, 0);
+	size_t nsegs = bsdiff_alignment_getsize(P->A);
+	size_t npos, i;
 
-	/* Loop until we've written everything. */
-	while (len > 0) {
-		/* Diff until we fill the buffer or run out of data. */
-		for (i = 0; i < 4096 && len > 0; i++, len--)
-			buf[i] = *new++ - *old++;
+	/* Write the copies. */
+	for (i = 0; i < ncopies; i++) {
+		if (writeval(P->ctrlz, segs[order[i]].npos))
+			goto err0;
+		if (writeval(P->ctrlz, segs[order[i]].opos))
+			goto err0;
+		if (writeval(P->ctrlz, segs[order[i]].alen))
+			goto err0;
+		if (writediffseg(P->diffz, &P->new[segs[order[i]].npos],
+		    &P->old[segs[order[i]].opos], segs[order[i]].alen))
+			goto err0;
+	}
 
-		/* Write out the diffed data. */
-		if (bzwrite(fbz2, buf, i))
+	/* Write the gaps between the copied segments as new data. */
+	for (npos = i = 0; i < nsegs; i++) {
+		if (!copied[i])
+			continue;
+		if ((segs[i].npos > npos) &&
+		    writeliteral(P, npos, segs[i].npos - npos))
 			goto err0;
+		npos = segs[i].npos + segs[i].alen;
 	}
+	if ((P->newsize > npos) &&
+	    writeliteral(P, npos, P->newsize - npos))
+		goto err0;
 
 	/* Success! */
 	return (0);
@@ -205,164 +334,623 @@ err0:
 	return (-1);
 }
 
-/* Append the (compressed) diff block to the the file. */
+/* Write the control, diff, and extra data for the segments in A. */
 static int
-writediff(FILE * f, BSDIFF_ALIGNMENT A, const uint8_t * new,
-    const uint8_t * old)
+writesegs(struct bsdiff_writepatch * P, BSDIFF_ALIGNMENT A)
 {
 	struct bsdiff_alignseg * asegp;
-	BZFILE * fbz2;
 	size_t i;
-	int bz2err;
 
-	/* Start writing diff segments. */
-	if ((fbz2 = BZ2_bzWriteOpen(&bz2err, f, 9, 0, 0)) == NULL) {
-		warn0("BZ2_bzWriteOpen failed: %d", bz2err);
+	/* Process alignment segments one by one. */
+	for (i = 0; i < bsdiff_alignment_getsize(A); i++) {
+		asegp = bsdiff_alignment_get(A, i);
+
+		/*
+		 * The control block starts with "copy X bytes from position
+		 * 0 in the old file to position 0 in the new file".  If the
+		 * first alignment segment aligns position 0 to position 0,
+		 * this is great -- we can emit the number of bytes to copy
+		 * and move on to the next alignment segment.  Otherwise, we
+		 * need to say "copy zero bytes" and then process the segment
+		 * normally.
+		 */
+		if (P->first && (asegp->npos == 0) && (asegp->opos == 0)) {
+			if (writeval(P->ctrlz, asegp->alen))
+				goto err0;
+		} else {
+			if (P->first && writeval(P->ctrlz, 0))
+				goto err0;
+
+			/* Extra length is the gap before this segment. */
+			if (writeval(P->ctrlz, asegp->npos - P->npos))
+				goto err0;
+
+			/* Seek length is the difference in old positions. */
+			if (writeval(P->ctrlz, asegp->opos - P->opos))
+				goto err0;
+
+			/* Diff length is the length of the aligned region. */
+			if (writeval(P->ctrlz, asegp->alen))
+				goto err0;
+
+			/* Write data up to the start of this section. */
+			if (zwrite(P->extraz, &P->new[P->npos],
+			    asegp->npos - P->npos))
+				goto err0;
+		}
+		P->first = 0;
+
+		/* Write the diff for this aligned section. */
+		if (writediffseg(P->diffz, &P->new[asegp->npos],
+		    &P->old[asegp->opos], asegp->alen))
+			goto err0;
+
+		/* Update our pointers within the two files. */
+		P->npos = asegp->npos + asegp->alen;
+		P->opos = asegp->opos + asegp->alen;
+	}
+
+	/* Success! */
+	return (0);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/* Write the control and extra data following the last aligned segment. */
+static int
+writetail(struct bsdiff_writepatch * P)
+{
+
+	/* If we haven't written anything yet, copy zero bytes. */
+	if (P->first && writeval(P->ctrlz, 0))
+		goto err0;
+
+	/* Extra length is the rest up to the end of the file. */
+	if (writeval(P->ctrlz, P->newsize - P->npos))
 		goto err0;
+
+	/* Seek length is zero; no point seeking after we're finished. */
+	if (writeval(P->ctrlz, 0))
+		goto err0;
+
+	/* Write extra data from the end of the last aligned section to EOF. */
+	if (zwrite(P->extraz, &P->new[P->npos], P->newsize - P->npos))
+		goto err0;
+
+	/* Success! */
+	return (0);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/*
+ * Write the three blocks of a direct patch straight into the patch file, one
+ * after another, by making a pass over the segments for each block.  Store
+ * the compressed lengths of the control and diff blocks.
+ */
+static int
+writedirect(struct bsdiff_writepatch * P, off_t * ctrllen, off_t * difflen)
+{
+	struct codec_write ** zs[3] = {&P->ctrlz, &P->diffz, &P->extraz};
+	off_t end[3];
+	size_t nsegs = bsdiff_alignment_getsize(P->A);
+	size_t * order = NULL;
+	uint8_t * copied = NULL;
+	size_t ncopies = 0;
+	size_t i, k;
+
+	/* Figure out which segments of an in-place patch to copy, and when. */
+	if (P->flags & BSDIFF_WRITEPATCH_INPLACE) {
+		if ((order = malloc((nsegs + 1) * sizeof(size_t))) == NULL)
+			goto err0;
+		if (bsdiff_inplace_order(bsdiff_alignment_get(P->A, 0), nsegs,
+		    order, &ncopies))
+			goto err1;
+		if ((copied = malloc(nsegs + 1)) == NULL)
+			goto err1;
+		for (i = 0; i < nsegs; i++)
+			copied[i] = 0;
+		for (i = 0; i < ncopies; i++)
+			copied[order[i]] = 1;
 	}
 
-	/* Write segments one by one. */
-	for (i = 0; i < bsdiff_alignment_getsize(A); i++) {
-		asegp = bsdiff_alignment_get(A, i);
+	/* Write each block in turn. */
+	for (k = 0; k < 3; k++) {
+		if ((*zs[k] = codec_write_open(P->codec, P->f,
+		    P->pool)) == NULL)
+			goto err1;
 
-		if (writediffseg(fbz2, &new[asegp->npos], &old[asegp->opos],
-		    asegp->alen))
+		/* Go through all of the segments. */
+		P->npos = P->opos = 0;
+		P->first = 1;
+		if (P->flags & BSDIFF_WRITEPATCH_INPLACE) {
+			if (writeinplace(P, order, ncopies, copied))
+				goto err2;
+		} else {
+			if (writesegs(P, P->A) || writetail(P))
+				goto err2;
+		}
+
+		/* Finish the block and see where it ends. */
+		if (codec_write_close(*zs[k], 0)) {
+			*zs[k] = NULL;
+			goto err1;
+		}
+		*zs[k] = NULL;
+		if ((end[k] = ftello(P->f)) == -1) {
+			warnp("ftello");
 			goto err1;
+		}
 	}
 
-	/* We've finished writing the diff block. */
-	BZ2_bzWriteClose(&bz2err, fbz2, 0, NULL, NULL);
-	if (bz2err != BZ_OK) {
-		warn0("BZ2_bzWriteClose failed: %d", bz2err);
+	/* The control block starts after the 32-byte header. */
+	*ctrllen = end[0] - 32;
+	*difflen = end[1] - end[0];
+
+	/* Free working space. */
+	free(copied);
+	free(order);
+
+	/* Success! */
+	return (0);
+
+err2:
+	codec_write_close(*zs[k], 1);
+	*zs[k] = NULL;
+err1:
+	free(copied);
+	free(order);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/*
+ * Write the rest of a streamed patch: the control and extra data after the
+ * last segment; then, after the control block, the diff and extra blocks
+ * from their temporary files.  Store the compressed lengths of the control
+ * and diff blocks.  The compressed streams are closed in either case.
+ */
+static int
+writestreamed(struct bsdiff_writepatch * P, off_t * ctrllen, off_t * difflen)
+{
+
+	/* Write out the data we haven't written yet. */
+	if (writetail(P))
+		goto err1;
+
+	/* Finish the three compressed streams. */
+	if (codec_write_close(P->ctrlz, 0)) {
+		codec_write_close(P->diffz, 1);
+		codec_write_close(P->extraz, 1);
+		goto err0;
+	}
+	if (codec_write_close(P->diffz, 0)) {
+		codec_write_close(P->extraz, 1);
+		goto err0;
+	}
+	if (codec_write_close(P->extraz, 0))
+		goto err0;
+
+	/* The control block runs from the end of the header to here. */
+	if ((*ctrllen = ftello(P->f)) == -1) {
+		warnp("ftello");
+		goto err0;
+	}
+	*ctrllen -= 32;
+
+	/* Append the diff block. */
+	if (copyfile(P, P->fdiff))
+		goto err0;
+	if ((*difflen = ftello(P->f)) == -1) {
+		warnp("ftello");
 		goto err0;
 	}
+	*difflen -= 32 + *ctrllen;
+
+	/* Append the extra block. */
+	if (copyfile(P, P->fextra))
+		goto err0;
 
 	/* Success! */
 	return (0);
 
 err1:
-	BZ2_bzWriteClose(&bz2err, fbz2, 0, NULL, NULL);
+	codec_write_close(P->extraz, 1);
+	codec_write_close(P->diffz, 1);
+	codec_write_close(P->ctrlz, 1);
 err0:
 	/* Failure! */
 	return (-1);
 }
 
-/* Append the (compressed) extra block to the file. */
-static int
-writeextra(FILE * f, BSDIFF_ALIGNMENT A, const uint8_t * new, size_t newsize)
+/*
+ * Allocate the state for a patch and start the patch file; the caller fills
+ * in the rest according to how the patch will be written.
+ */
+static struct bsdiff_writepatch *
+patch_open(const char * name, const uint8_t * new, size_t newsize,
+    const uint8_t * old, int codec, int flags, struct parallel_pool * pool)
 {
-	struct bsdiff_alignseg * asegp;
-	BZFILE * fbz2;
-	size_t npos;
-	size_t i;
-	int bz2err;
+	struct bsdiff_writepatch * P;
+	uint8_t header[32];
 
-	/* Start writing extra segments. */
-	if ((fbz2 = BZ2_bzWriteOpen(&bz2err, f, 9, 0, 0)) == NULL) {
-		warn0("BZ2_bzWriteOpen failed: %d", bz2err);
+	/* Allocate a structure and record parameters. */
+	if ((P = malloc(sizeof(struct bsdiff_writepatch))) == NULL)
 		goto err0;
+	P->name = name;
+	P->new = new;
+	P->newsize = newsize;
+	P->old = old;
+	P->codec = codec;
+	P->flags = flags;
+	P->pool = pool;
+	P->direct = 0;
+	P->A = NULL;
+	P->fdiff = P->fextra = NULL;
+	P->ctrlz = P->diffz = P->extraz = NULL;
+	P->npos = P->opos = 0;
+	P->first = 1;
+	P->failed = 0;
+
+	/* Open the patch file for writing. */
+	if ((P->f = fopen(name, "wb")) == NULL) {
+		warnp("%s", name);
+		goto err1;
 	}
 
-	/* Write segments one by one. */
-	npos = 0;
-	for (i = 0; i < bsdiff_alignment_getsize(A); i++) {
-		asegp = bsdiff_alignment_get(A, i);
+	/* Write a placeholder header; we'll fill in the lengths later. */
+	memset(header, 0, 32);
+	if (fwrite(header, 32, 1, P->f) != 1) {
+		warnp("fwrite(%s)", name);
+		goto err2;
+	}
+
+	/* Success! */
+	return (P);
+
+err2:
+	fclose(P->f);
+	unlink(name);
+err1:
+	free(P);
+err0:
+	/* Failure! */
+	return (NULL);
+}
+
+/* Give up on the patch after patch_open: delete the file and free P. */
+static void
+patch_abort(struct bsdiff_writepatch * P)
+{
+
+	if (P->fextra != NULL)
+		fclose(P->fextra);
+	if (P->fdiff != NULL)
+		fclose(P->fdiff);
+	fclose(P->f);
+	unlink(P->name);
+	if (P->flags & BSDIFF_WRITEPATCH_INPLACE)
+		bsdiff_alignment_free(P->A);
+	free(P);
+}
+
+/**
+ * bsdiff_writepatch_open(name, new, newsize, old, codec, flags, pool):
+ * Start writing a patch with the specified name which turns the old data
+ * old[] into the new data new[0 .. newsize - 1].  The alignment of new[]
+ * against old[] is provided in pieces via bsdiff_writepatch_append.  Compress
+ * the patch with the specified codec, using the threads in the pool if it is
+ * not NULL; each part of the patch may then be written as a series of
+ * concatenated compressed streams, and a bzip2 patch is marked "BSDIFF4P"
+ * (or "BSDIFI4P") instead of "BSDIFF40" (or "BSDIFI40"), since older
+ * versions of bspatch cannot read such patches.  Pass a NULL pool to write a
+ * patch which they can read.  Since the diff and extra blocks follow the
+ * control block, they are compressed into temporary files as the pieces
+ * arrive and copied into the patch file by bsdiff_writepatch_close; this
+ * needs temporary disk space for, and writes twice, most of the patch.  If
+ * the whole alignment is known in advance, bsdiff_writepatch avoids this.
+ * If ${flags} includes BSDIFF_WRITEPATCH_INPLACE, write a patch which
+ * bspatch can apply by overwriting the old file; in that case the segments
+ * are held until bsdiff_writepatch_close, since they must be reordered, and
+ * the patch is then written directly.
+ */
+struct bsdiff_writepatch *
+bsdiff_writepatch_open(const char * name, const uint8_t * new,
+    size_t newsize, const uint8_t * old, int codec, int flags,
+    struct parallel_pool * pool)
+{
+	struct bsdiff_writepatch * P;
 
-		/* Write data up to the start of the next aligned section. */
-		if (bzwrite(fbz2, &new[npos], asegp->npos - npos))
+	/* Allocate the state and start the patch file. */
+	if ((P = patch_open(name, new, newsize, old, codec, flags,
+	    pool)) == NULL)
+		goto err0;
+
+	/* Make somewhere to keep the segments of an in-place patch. */
+	if (flags & BSDIFF_WRITEPATCH_INPLACE) {
+		P->direct = 1;
+		if ((P->A = bsdiff_alignment_init(0)) == NULL)
 			goto err1;
 
-		/* The next unaligned section starts here. */
-		npos = asegp->npos + asegp->alen;
+		/* Success! */
+		return (P);
 	}
 
-	/* Write extra data from the end of the last aligned section to EOF. */
-	BZ2_bzWrite(&bz2err, fbz2, (void *)(uintptr_t)&new[npos],
-	    newsize - npos);
-	if (bz2err != BZ_OK) {
-		warn0("BZ2_bzWrite failed: %d", bz2err);
+	/*
+	 * The diff and extra blocks come after the control block, so we
+	 * stash them in temporary files until we're done.
+	 */
+	if ((P->fdiff = tmpfile()) == NULL) {
+		warnp("tmpfile");
+		goto err1;
+	}
+	if ((P->fextra = tmpfile()) == NULL) {
+		warnp("tmpfile");
 		goto err1;
 	}
 
-	/* We've finished writing the extra block. */
-	BZ2_bzWriteClose(&bz2err, fbz2, 0, NULL, NULL);
-	if (bz2err != BZ_OK) {
-		warn0("BZ2_bzWriteClose failed: %d", bz2err);
-		goto err0;
+	/* Start the three compressed streams. */
+	if ((P->ctrlz = codec_write_open(codec, P->f, pool)) == NULL)
+		goto err1;
+	if ((P->diffz = codec_write_open(codec, P->fdiff, pool)) == NULL)
+		goto err2;
+	if ((P->extraz = codec_write_open(codec, P->fextra, pool)) == NULL)
+		goto err3;
+
+	/* Success! */
+	return (P);
+
+err3:
+	codec_write_close(P->diffz, 1);
+err2:
+	codec_write_close(P->ctrlz, 1);
+err1:
+	patch_abort(P);
+err0:
+	/* Failure! */
+	return (NULL);
+}
+
+/**
+ * bsdiff_writepatch_append(P, A):
+ * Add the alignment segments in A to the patch being written.  The segments
+ * must be in order and must follow any segments previously appended.
+ */
+int
+bsdiff_writepatch_append(struct bsdiff_writepatch * P, BSDIFF_ALIGNMENT A)
+{
+
+	/* If we're writing an in-place patch, save the segments for later. */
+	if (P->flags & BSDIFF_WRITEPATCH_INPLACE) {
+		if (saveinplace(P, A))
+			goto err0;
+	} else {
+		if (writesegs(P, A))
+			goto err0;
 	}
 
 	/* Success! */
 	return (0);
 
-err1:
-	BZ2_bzWriteClose(&bz2err, fbz2, 0, NULL, NULL);
 err0:
+	/* The patch is now garbage. */
+	P->failed = 1;
+
 	/* Failure! */
 	return (-1);
 }
 
 /**
- * bsdiff_writepatch(name, A, new, newsize, old):
- * Write a patch with the specified name based on the alignment A of the new
- * data new[0 .. newsize - 1] with the old data old[].
+ * bsdiff_writepatch_close(P):
+ * Finish writing the patch and free the state.  Return 0 on success or -1 on
+ * error (including if a call to bsdiff_writepatch_append failed, in which
+ * case the patch file is deleted); in either case P is freed.
  */
-void
-bsdiff_writepatch(const char * name, BSDIFF_ALIGNMENT A, const uint8_t * new,
-    size_t newsize, const uint8_t * old)
+int
+bsdiff_writepatch_close(struct bsdiff_writepatch * P)
 {
-	size_t len;
-	size_t flen;
+	off_t ctrllen, difflen;
 	uint8_t header[32];
-	FILE * f;
 
-	/* Open the patch file for writing. */
-	if ((f = fopen(name, "wb")) == NULL)
-		err(1, "%s", name);
+	/* If we failed to add some of the data, give up. */
+	if (P->failed) {
+		if (!P->direct) {
+			codec_write_close(P->extraz, 1);
+			codec_write_close(P->diffz, 1);
+			codec_write_close(P->ctrlz, 1);
+		}
+		goto err1;
+	}
+
+	/* Write the three blocks. */
+	if (P->direct) {
+		if (writedirect(P, &ctrllen, &difflen))
+			goto err1;
+	} else {
+		if (writestreamed(P, &ctrllen, &difflen))
+			goto err1;
+	}
 
 	/* Header is
-		0	8	 "BSDIFF40"
-		8	8	length of bzip2ed ctrl block
-		16	8	length of bzip2ed diff block
+		0	8	 "BSDIFF40" (bzip2), "BSDIFF4P" (bzip2,
+			 compressed in parallel), "BSDIFF4L" (xz),
+			 "BSDIFF4Z" (zstd), or "BSDIFF4B" (brotli)
+		8	8	length of compressed ctrl block
+		16	8	length of compressed diff block
 		24	8	length of new file */
 	/* File is
 		0	32	Header
-		32	??	Bzip2ed ctrl block
-		??	??	Bzip2ed diff block
-		??	??	Bzip2ed extra block */
-	memcpy(header, "BSDIFF40", 8);
-	encval(0, header + 8);
-	encval(0, header + 16);
-	encval(newsize, header + 24);
-	if (fwrite(header, 32, 1, f) != 1)
-		err(1, "fwrite(%s)", name);
-
-	/* Write control block. */
-	if (writectrl(f, A, newsize))
-		exit(1);
-
-	/* Compute size of compressed ctrl data */
-	if ((len = ftello(f)) == (size_t)(-1))
-		err(1, "ftello");
-	encval(len - 32, header + 8);
-
-	/* Write diff block. */
-	if (writediff(f, A, new, old))
-		exit(1);
-
-	/* Compute size of compressed diff data */
-	if ((flen = ftello(f)) == (size_t)(-1))
-		err(1, "ftello");
-	encval(flen - len, header + 16);
-
-	/* Write extra block. */
-	if (writeextra(f, A, new, newsize))
-		exit(1);
-
-	/* Seek to the beginning, write the header, and close the file */
-	if (fseeko(f, 0, SEEK_SET))
-		err(1, "fseeko");
-	if (fwrite(header, 32, 1, f) != 1)
-		err(1, "fwrite(%s)", name);
-	if (fclose(f))
-		err(1, "fclose");
+		32	??	Compressed ctrl block
+		??	??	Compressed diff block
+		??	??	Compressed extra block
+	   Each block may consist of several concatenated streams, except
+	   in "BSDIFF40" and "BSDIFI40" patches; older versions of bspatch
+	   read only the former. */
+	/* In-place patches have magic "BSDIFI4x" instead of "BSDIFF4x", and
+	   their ctrl block is a set of triples (npos, opos, len) meaning
+	   "overwrite len bytes at npos with len bytes read from opos before
+	   anything was written, plus len bytes from the diff block"; or if
+	   opos is -1, "overwrite len bytes at npos with len bytes from the
+	   extra block".  The file is extended to the new length before the
+	   first triple and truncated to it after the last; copies are at most
+	   INPLACE_MAXLEN bytes and read only data which no earlier triple has
+	   overwritten. */
+	if ((P->codec == CODEC_BZIP2) && (P->pool != NULL)) {
+		if (P->flags & BSDIFF_WRITEPATCH_INPLACE)
+			memcpy(header, INPLACEMULTIMAGIC, 8);
+		else
+			memcpy(header, MULTIMAGIC, 8);
+	} else if (P->flags & BSDIFF_WRITEPATCH_INPLACE)
+		memcpy(header, inplacemagics[P->codec], 8);
+	else
+		memcpy(header, magics[P->codec], 8);
+	encval(ctrllen, header + 8);
+	encval(difflen, header + 16);
+	encval(P->newsize, header + 24);
+
+	/* Seek to the beginning and write the header. */
+	if (fseeko(P->f, 0, SEEK_SET)) {
+		warnp("fseeko");
+		goto err1;
+	}
+	if (fwrite(header, 32, 1, P->f) != 1) {
+		warnp("fwrite(%s)", P->name);
+		goto err1;
+	}
+
+	/* Close the temporary files and the patch file. */
+	if (P->fextra != NULL)
+		fclose(P->fextra);
+	if (P->fdiff != NULL)
+		fclose(P->fdiff);
+	if (fclose(P->f)) {
+		warnp("fclose(%s)", P->name);
+		goto err0;
+	}
+
+	/* Free our state. */
+	if (P->flags & BSDIFF_WRITEPATCH_INPLACE)
+		bsdiff_alignment_free(P->A);
+	free(P);
+
+	/* Success! */
+	return (0);
+
+err1:
+	patch_abort(P);
+
+	/* Failure! */
+	return (-1);
+
+err0:
+	unlink(P->name);
+	if (P->flags & BSDIFF_WRITEPATCH_INPLACE)
+		bsdiff_alignment_free(P->A);
+	free(P);
+
+	/* Failure! */
+	return (-1);
+}
+
+/**
+ * bsdiff_writepatch_abort(P):
+ * Stop writing the patch, delete the patch file, and free the state.
+ */
+void
+bsdiff_writepatch_abort(struct bsdiff_writepatch * P)
+{
+
+	/* Closing the patch after a failure deletes the file. */
+	P->failed = 1;
+	bsdiff_writepatch_close(P);
+}
+
+/**
+ * bsdiff_writepatch(name, A, new, newsize, old, codec, flags, pool):
+ * Write a patch with the specified name based on the alignment A of the new
+ * data new[0 .. newsize - 1] with the old data old[].  The codec, flags, and
+ * pool are as for bsdiff_writepatch_open, but since the whole alignment is
+ * known, the three blocks are written straight into the patch file without
+ * using temporary files.  Return 0 on success or -1 on error, in which case
+ * the patch file is deleted.
+ */
+int
+bsdiff_writepatch(const char * name, BSDIFF_ALIGNMENT A, const uint8_t * new,
+    size_t newsize, const uint8_t * old, int codec, int flags,
+    struct parallel_pool * pool)
+{
+	struct bsdiff_writepatch * P;
+
+	/* An in-place patch needs its segments split and saved anyway. */
+	if (flags & BSDIFF_WRITEPATCH_INPLACE) {
+		if ((P = bsdiff_writepatch_open(name, new, newsize, old,
+		    codec, flags, pool)) == NULL)
+			goto err0;
+		if (bsdiff_writepatch_append(P, A)) {
+			bsdiff_writepatch_close(P);
+			goto err0;
+		}
+	} else {
+		if ((P = patch_open(name, new, newsize, old, codec, flags,
+		    pool)) == NULL)
+			goto err0;
+		P->direct = 1;
+		P->A = A;
+	}
+
+	/* Write the patch. */
+	if (bsdiff_writepatch_close(P))
+		goto err0;
+
+	/* Success! */
+	return (0);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/**
+ * bsdiff_writepatch_memusage(newsize, codec, flags, nthreads, direct):
+ * Return an estimate of the memory used to write a patch for newsize bytes
+ * of new data with the specified codec and flags, using a pool of nthreads
+ * threads (or a NULL pool if nthreads is zero), via bsdiff_writepatch if
+ * direct is non-zero or otherwise via bsdiff_writepatch_open.  This includes
+ * the compression buffers and state, and the segments which an in-place
+ * patch holds, but not an alignment passed to bsdiff_writepatch.
+ */
+uint64_t
+bsdiff_writepatch_memusage(size_t newsize, int codec, int flags,
+    size_t nthreads, int direct)
+{
+	uint64_t nsegs;
+	size_t nstreams;
+
+	/*
+	 * A direct patch compresses one block at a time; otherwise all three
+	 * are compressed at once.  In-place patches are always direct.
+	 */
+	if (direct || (flags & BSDIFF_WRITEPATCH_INPLACE))
+		nstreams = 1;
+	else
+		nstreams = 3;
+
+	/* Not in place?  The compression is all we need. */
+	if (!(flags & BSDIFF_WRITEPATCH_INPLACE))
+		return (codec_write_memusage(codec, nthreads, nstreams));
+
+	/*
+	 * An in-place patch holds each segment, split into pieces of at most
+	 * INPLACE_MAXLEN, and ordering the copies needs several words for
+	 * each.  We can't know how many segments there will be; assume one
+	 * for every INPLACE_SEGLEN bytes of new data.
+	 */
+	nsegs = newsize / INPLACE_SEGLEN + newsize / INPLACE_MAXLEN + 1;
+	return (codec_write_memusage(codec, nthreads, nstreams) +
+	    nsegs * (sizeof(struct bsdiff_alignseg) + 8 * sizeof(size_t)));
 }
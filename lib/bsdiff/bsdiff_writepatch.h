@@ -31,12 +31,79 @@
 
 #include "bsdiff_alignment.h"
 
+/* Opaque types. */
+struct bsdiff_writepatch;
+struct parallel_pool;
+
+/* Flags for bsdiff_writepatch_open. */
+#define BSDIFF_WRITEPATCH_INPLACE	0x1	/* Apply by overwriting old. */
+
+/**
+ * bsdiff_writepatch_open(name, new, newsize, old, codec, flags, pool):
+ * Start writing a patch with the specified name which turns the old data
+ * old[] into the new data new[0 .. newsize - 1].  The alignment of new[]
+ * against old[] is provided in pieces via bsdiff_writepatch_append.  Compress
+ * the patch with the specified codec, using the threads in the pool if it is
+ * not NULL; each part of the patch may then be written as a series of
+ * concatenated compressed streams, and a bzip2 patch is marked "BSDIFF4P"
+ * (or "BSDIFI4P") instead of "BSDIFF40" (or "BSDIFI40"), since older
+ * versions of bspatch cannot read such patches.  Pass a NULL pool to write a
+ * patch which they can read.  Since the diff and extra blocks follow the
+ * control block, they are compressed into temporary files as the pieces
+ * arrive and copied into the patch file by bsdiff_writepatch_close; this
+ * needs temporary disk space for, and writes twice, most of the patch.  If
+ * the whole alignment is known in advance, bsdiff_writepatch avoids this.
+ * If ${flags} includes BSDIFF_WRITEPATCH_INPLACE, write a patch which
+ * bspatch can apply by overwriting the old file; in that case the segments
+ * are held until bsdiff_writepatch_close, since they must be reordered, and
+ * the patch is then written directly.
+ */
+struct bsdiff_writepatch * bsdiff_writepatch_open(const char *,
+    const uint8_t *, size_t, const uint8_t *, int, int,
+    struct parallel_pool *);
+
 /**
- * bsdiff_writepatch(name, A, new, newsize, old):
+ * bsdiff_writepatch_append(P, A):
+ * Add the alignment segments in A to the patch being written.  The segments
+ * must be in order and must follow any segments previously appended.
+ */
+int bsdiff_writepatch_append(struct bsdiff_writepatch *, BSDIFF_ALIGNMENT);
+
+/**
+ * bsdiff_writepatch_close(P):
+ * Finish writing the patch and free the state.  Return 0 on success or -1 on
+ * error (including if a call to bsdiff_writepatch_append failed, in which
+ * case the patch file is deleted); in either case P is freed.
+ */
+int bsdiff_writepatch_close(struct bsdiff_writepatch *);
+
+/**
+ * bsdiff_writepatch_abort(P):
+ * Stop writing the patch, delete the patch file, and free the state.
+ */
+void bsdiff_writepatch_abort(struct bsdiff_writepatch *);
+
+/**
+ * bsdiff_writepatch(name, A, new, newsize, old, codec, flags, pool):
  * Write a patch with the specified name based on the alignment A of the new
- * data new[0 .. newsize - 1] with the old data old[].
+ * data new[0 .. newsize - 1] with the old data old[].  The codec, flags, and
+ * pool are as for bsdiff_writepatch_open, but since the whole alignment is
+ * known, the three blocks are written straight into the patch file without
+ * using temporary files.  Return 0 on success or -1 on error, in which case
+ * the patch file is deleted.
+ */
+int bsdiff_writepatch(const char *, BSDIFF_ALIGNMENT, const uint8_t *,
+    size_t, const uint8_t *, int, int, struct parallel_pool *);
+
+/**
+ * bsdiff_writepatch_memusage(newsize, codec, flags, nthreads, direct):
+ * Return an estimate of the memory used to write a patch for newsize bytes
+ * of new data with the specified codec and flags, using a pool of nthreads
+ * threads (or a NULL pool if nthreads is zero), via bsdiff_writepatch if
+ * direct is non-zero or otherwise via bsdiff_writepatch_open.  This includes
+ * the compression buffers and state, and the segments which an in-place
+ * patch holds, but not an alignment passed to bsdiff_writepatch.
  */
-void bsdiff_writepatch(const char *, BSDIFF_ALIGNMENT, const uint8_t *,
-    size_t, const uint8_t *);
+uint64_t bsdiff_writepatch_memusage(size_t, int, int, size_t, int);
 
 #endif /* !_BSDIFF_WRITEPATCH_H_ */
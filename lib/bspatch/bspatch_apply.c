@@ -0,0 +1,531 @@
+/*-
+ * Copyright 2012 Colin Percival
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions 
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "addbytes.h"
+#include "codec_buf.h"
+#include "codec_stream.h"
+#include "sysendian.h"
+
+#include "bspatch_apply.h"
+
+/*
+ * Size of the buffers for old and new data.  Copies in in-place patches are
+ * never longer than this, so that we can read all of a copy's old data before
+ * writing any of its new data.
+ */
+#define BUFLEN	(1024 * 1024)
+
+/*
+ * Positions and lengths in a patch must be no larger than this in magnitude,
+ * so that we can do arithmetic on them without worrying about overflow.
+ */
+#define POSMAX	((int64_t)1 << 61)
+
+/*
+ * Map from patch file magic to the codec used to compress the blocks, and
+ * whether the patch is applied by overwriting the old data.
+ */
+static const struct {
+	const char * magic;
+	int codec;
+	int inplace;
+} magics[] = {
+	{ "BSDIFF40", CODEC_BZIP2, 0 },
+	{ "BSDIFF4P", CODEC_BZIP2, 0 },
+	{ "BSDIFF4L", CODEC_XZ, 0 },
+	{ "BSDIFF4Z", CODEC_ZSTD, 0 },
+	{ "BSDIFF4B", CODEC_BROTLI, 0 },
+	{ "BSDIFI40", CODEC_BZIP2, 1 },
+	{ "BSDIFI4P", CODEC_BZIP2, 1 },
+	{ "BSDIFI4L", CODEC_XZ, 1 },
+	{ "BSDIFI4Z", CODEC_ZSTD, 1 },
+	{ "BSDIFI4B", CODEC_BROTLI, 1 }
+};
+
+/* One of the three compressed blocks in the patch. */
+struct block {
+	struct patch * P;
+	uint64_t pos;		/* Position in the patch of the next read. */
+	int failed;		/* Non-zero if read_patch failed. */
+	struct codec_stream * S;
+};
+
+/* Patch being applied. */
+struct patch {
+	/* Parameters to bspatch_apply. */
+	int64_t oldsize;
+	int (* read_old)(void *, uint64_t, uint8_t *, size_t);
+	ssize_t (* read_patch)(void *, uint64_t, uint8_t *, size_t);
+	int (* write_new)(void *, uint64_t, const uint8_t *, size_t);
+	void * cookie;
+
+	/* Length of the new data. */
+	int64_t newsize;
+
+	/* The control, diff, and extra blocks. */
+	struct block ctrl;
+	struct block diff;
+	struct block extra;
+
+	/* Buffers for old and new data. */
+	uint8_t * old;
+	uint8_t * new;
+};
+
+/* Decode an int64_t from a sequence of 8 bytes. */
+static int64_t
+decval(const uint8_t buf[8])
+{
+	uint64_t y;
+
+	/* Convert from sign-magnitude to 2's-complement. */
+	y = le64dec(buf);
+	if (y & ((uint64_t)(1) << 63))
+		return (-(int64_t)(y & ~((uint64_t)(1) << 63)));
+	return ((int64_t)y);
+}
+
+/* Read compressed data for a block.  Callback from codec_stream. */
+static ssize_t
+readblock(void * cookie, uint8_t * buf, size_t len)
+{
+	struct block * B = cookie;
+	struct patch * P = B->P;
+	ssize_t readlen;
+
+	/* Read from where we left off. */
+	if ((readlen = (P->read_patch)(P->cookie, B->pos, buf, len)) == -1) {
+		B->failed = 1;
+		return (-1);
+	}
+	B->pos += readlen;
+
+	/* Return the number of bytes read. */
+	return (readlen);
+}
+
+/* Start decompressing len bytes of the patch at pos (or to EOF if -1). */
+static int
+block_open(struct patch * P, struct block * B, int codec, uint64_t pos,
+    int64_t len, int flags)
+{
+
+	/* Initialize the block. */
+	B->P = P;
+	B->pos = pos;
+	B->failed = 0;
+
+	/* Start decompressing it. */
+	if ((B->S = codec_stream_open(codec, readblock, B, len)) == NULL)
+		goto err0;
+
+	/* Start a thread to decompress it if requested. */
+	if ((flags & BSPATCH_READAHEAD) &&
+	    codec_stream_readahead(B->S, BUFLEN))
+		goto err1;
+
+	/* Success! */
+	return (0);
+
+err1:
+	codec_stream_close(B->S);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/* Decompress exactly len bytes from the block into buf. */
+static int
+block_read(struct block * B, uint8_t * buf, size_t len)
+{
+
+	/* If we can't get the data, figure out why. */
+	if (codec_stream_read(B->S, buf, len))
+		return (B->failed ? BSPATCH_EREADPATCH : BSPATCH_ECORRUPT);
+
+	/* Success! */
+	return (BSPATCH_OK);
+}
+
+/* Read a control triple. */
+static int
+readctrl(struct patch * P, int64_t ctrl[3])
+{
+	uint8_t buf[24];
+	int rc;
+
+	/* Read and decode the values. */
+	if ((rc = block_read(&P->ctrl, buf, 24)) != BSPATCH_OK)
+		return (rc);
+	ctrl[0] = decval(&buf[0]);
+	ctrl[1] = decval(&buf[8]);
+	ctrl[2] = decval(&buf[16]);
+
+	/* Success! */
+	return (BSPATCH_OK);
+}
+
+/*
+ * Apply a regular patch.  Its control triples (x, y, z) mean "add x bytes of
+ * old data to x bytes from the diff block; copy y bytes from the extra block;
+ * seek forwards in the old data by z bytes".  The new data is built up a
+ * buffer at a time, so memory usage doesn't depend on the data sizes.
+ */
+static int
+apply(struct patch * P)
+{
+	int64_t newpos, oldpos, outpos, pos, lo, hi;
+	int64_t ctrl[3];
+	int64_t i, n;
+	size_t newlen;
+	int rc;
+
+	/* Nothing has been done yet. */
+	newpos = oldpos = outpos = 0;
+	newlen = 0;
+
+	/* Process control triples until the new data is complete. */
+	while (newpos < P->newsize) {
+		/* Read control data. */
+		if ((rc = readctrl(P, ctrl)) != BSPATCH_OK)
+			return (rc);
+
+		/* Sanity-check. */
+		if ((ctrl[0] < 0) || (ctrl[0] > P->newsize - newpos) ||
+		    (ctrl[1] < 0) ||
+		    (ctrl[1] > P->newsize - newpos - ctrl[0]) ||
+		    (ctrl[2] < -POSMAX) || (ctrl[2] > POSMAX))
+			return (BSPATCH_ECORRUPT);
+
+		/* Read the diff string and add old data, a piece at a time. */
+		for (i = 0; i < ctrl[0]; i += n) {
+			/* Read as much as fits in the buffer. */
+			n = ctrl[0] - i;
+			if (n > (int64_t)(BUFLEN - newlen))
+				n = BUFLEN - newlen;
+			if ((rc = block_read(&P->diff, &P->new[newlen], n)) !=
+			    BSPATCH_OK)
+				return (rc);
+
+			/* Add old data to the part of the piece it covers. */
+			pos = oldpos + i;
+			lo = (pos < 0) ? -pos : 0;
+			hi = (pos + n > P->oldsize) ? P->oldsize - pos : n;
+			if (lo < hi) {
+				if ((P->read_old)(P->cookie, pos + lo, P->old,
+				    hi - lo))
+					return (BSPATCH_EREADOLD);
+				addbytes(&P->new[newlen + lo],
+				    &P->new[newlen + lo], P->old, hi - lo);
+			}
+
+			/* Write out the buffer if it's full. */
+			if ((newlen += n) == BUFLEN) {
+				if ((P->write_new)(P->cookie, outpos, P->new,
+				    newlen))
+					return (BSPATCH_EWRITENEW);
+				outpos += newlen;
+				newlen = 0;
+			}
+		}
+
+		/* Adjust pointers. */
+		newpos += ctrl[0];
+		oldpos += ctrl[0];
+
+		/* Read the extra string, a piece at a time. */
+		for (i = 0; i < ctrl[1]; i += n) {
+			n = ctrl[1] - i;
+			if (n > (int64_t)(BUFLEN - newlen))
+				n = BUFLEN - newlen;
+			if ((rc = block_read(&P->extra, &P->new[newlen], n)) !=
+			    BSPATCH_OK)
+				return (rc);
+			if ((newlen += n) == BUFLEN) {
+				if ((P->write_new)(P->cookie, outpos, P->new,
+				    newlen))
+					return (BSPATCH_EWRITENEW);
+				outpos += newlen;
+				newlen = 0;
+			}
+		}
+
+		/* Adjust pointers. */
+		newpos += ctrl[1];
+		oldpos += ctrl[2];
+
+		/* Positions this far out can't be real. */
+		if ((oldpos < -POSMAX) || (oldpos > POSMAX))
+			return (BSPATCH_ECORRUPT);
+	}
+
+	/* Write out the rest of the new data. */
+	if ((newlen > 0) && (P->write_new)(P->cookie, outpos, P->new, newlen))
+		return (BSPATCH_EWRITENEW);
+
+	/* Success! */
+	return (BSPATCH_OK);
+}
+
+/*
+ * Apply an in-place patch.  Its control triples (x, y, z) mean "overwrite z
+ * bytes at x with z bytes read from y before anything was written, plus z
+ * bytes from the diff block", or if y is -1, "overwrite z bytes at x with z
+ * bytes from the extra block".  Together they cover all of the new data.
+ */
+static int
+apply_inplace(struct patch * P)
+{
+	int64_t newlen;
+	int64_t ctrl[3];
+	int64_t i, n;
+	int rc;
+
+	/* Each triple overwrites part of the data. */
+	for (newlen = 0; newlen < P->newsize; newlen += ctrl[2]) {
+		/* Read control data. */
+		if ((rc = readctrl(P, ctrl)) != BSPATCH_OK)
+			return (rc);
+
+		/* Sanity-check. */
+		if ((ctrl[0] < 0) || (ctrl[1] < -1) || (ctrl[2] <= 0) ||
+		    (ctrl[2] > P->newsize - newlen) ||
+		    (ctrl[0] > P->newsize - ctrl[2]))
+			return (BSPATCH_ECORRUPT);
+
+		/* Write the extra string, a piece at a time. */
+		if (ctrl[1] == -1) {
+			for (i = 0; i < ctrl[2]; i += n) {
+				n = ctrl[2] - i;
+				if (n > BUFLEN)
+					n = BUFLEN;
+				if ((rc = block_read(&P->extra, P->new, n)) !=
+				    BSPATCH_OK)
+					return (rc);
+				if ((P->write_new)(P->cookie, ctrl[0] + i,
+				    P->new, n))
+					return (BSPATCH_EWRITENEW);
+			}
+			continue;
+		}
+
+		/* Copies fit in the buffer and only read old data. */
+		if ((ctrl[2] > BUFLEN) || (ctrl[1] > P->oldsize - ctrl[2]))
+			return (BSPATCH_ECORRUPT);
+
+		/* Read all the old data before writing any new data. */
+		if ((P->read_old)(P->cookie, ctrl[1], P->old, ctrl[2]))
+			return (BSPATCH_EREADOLD);
+		if ((rc = block_read(&P->diff, P->new, ctrl[2])) != BSPATCH_OK)
+			return (rc);
+		addbytes(P->new, P->new, P->old, ctrl[2]);
+		if ((P->write_new)(P->cookie, ctrl[0], P->new, ctrl[2]))
+			return (BSPATCH_EWRITENEW);
+	}
+
+	/* Success! */
+	return (BSPATCH_OK);
+}
+
+/**
+ * bspatch_apply(oldsize, read_old, read_patch, write_new, cookie, flags,
+ *     newsize):
+ * Apply a patch to the oldsize bytes of old data, using the provided
+ * functions for all I/O:
+ *   read_old(cookie, pos, buf, len) reads len bytes of old data at position
+ *   pos into buf, returning 0 on success or -1 on error;
+ *   read_patch(cookie, pos, buf, len) reads up to len bytes of the patch at
+ *   position pos into buf, returning the number of bytes read, 0 at the end
+ *   of the patch, or -1 on error; and
+ *   write_new(cookie, pos, buf, len) writes len bytes of new data at
+ *   position pos, returning 0 on success or -1 on error.
+ * New data is written in order, except for in-place patches (which are
+ * produced by bsdiff -i).  If ${flags} includes BSPATCH_INPLACE, read_old
+ * and write_new access the same storage, so that the new data overwrites the
+ * old data as it is written; this is only possible for in-place patches,
+ * and the storage must then be truncated to the new size after the patch is
+ * applied.  If ${flags} includes BSPATCH_READAHEAD, the patch is decompressed
+ * by separate threads, which may call read_patch concurrently.
+ * Store the length of the new data in newsize (if the patch header could be
+ * read) and return BSPATCH_OK or one of the BSPATCH_E* errors.  No state is
+ * kept between calls, so several patches may be applied at once.
+ */
+int
+bspatch_apply(uint64_t oldsize,
+    int (* read_old)(void *, uint64_t, uint8_t *, size_t),
+    ssize_t (* read_patch)(void *, uint64_t, uint8_t *, size_t),
+    int (* write_new)(void *, uint64_t, const uint8_t *, size_t),
+    void * cookie, int flags, uint64_t * newsize)
+{
+	struct patch P;
+	uint8_t header[32];
+	int64_t ctrllen, difflen;
+	ssize_t readlen;
+	size_t pos, m;
+	int rc;
+
+	/* Record parameters; old data past POSMAX can't be reached anyway. */
+	P.oldsize = (oldsize > (uint64_t)POSMAX) ? POSMAX : (int64_t)oldsize;
+	P.read_old = read_old;
+	P.read_patch = read_patch;
+	P.write_new = write_new;
+	P.cookie = cookie;
+
+	/*
+	 * Header is
+	 *	0	8	magic
+	 *	8	8	length of compressed ctrl block
+	 *	16	8	length of compressed diff block
+	 *	24	8	length of new data
+	 * and is followed by the ctrl, diff, and extra blocks, each of which
+	 * may consist of several concatenated compressed streams.
+	 */
+	for (pos = 0; pos < 32; pos += readlen) {
+		if ((readlen = (read_patch)(cookie, pos, &header[pos],
+		    32 - pos)) == -1) {
+			rc = BSPATCH_EREADPATCH;
+			goto err0;
+		}
+		if (readlen == 0) {
+			rc = BSPATCH_ECORRUPT;
+			goto err0;
+		}
+	}
+
+	/* Check for appropriate magic and find the compression codec. */
+	for (m = 0; m < sizeof(magics) / sizeof(magics[0]); m++)
+		if (memcmp(header, magics[m].magic, 8) == 0)
+			break;
+	if (m == sizeof(magics) / sizeof(magics[0])) {
+		rc = BSPATCH_ECORRUPT;
+		goto err0;
+	}
+	if (!codec_supported(magics[m].codec)) {
+		rc = BSPATCH_ECODEC;
+		goto err0;
+	}
+
+	/* Read lengths from the header. */
+	ctrllen = decval(&header[8]);
+	difflen = decval(&header[16]);
+	P.newsize = decval(&header[24]);
+	if ((ctrllen < 0) || (ctrllen > POSMAX) ||
+	    (difflen < 0) || (difflen > POSMAX) ||
+	    (P.newsize < 0) || (P.newsize > POSMAX)) {
+		rc = BSPATCH_ECORRUPT;
+		goto err0;
+	}
+	*newsize = P.newsize;
+
+	/* Only in-place patches can overwrite the old data as they go. */
+	if ((flags & BSPATCH_INPLACE) && !magics[m].inplace) {
+		rc = BSPATCH_ENOTINPLACE;
+		goto err0;
+	}
+
+	/* Allocate buffers. */
+	rc = BSPATCH_EINTERNAL;
+	if ((P.old = malloc(BUFLEN)) == NULL)
+		goto err0;
+	if ((P.new = malloc(BUFLEN)) == NULL)
+		goto err1;
+
+	/* Start decompressing the three blocks. */
+	if (block_open(&P, &P.ctrl, magics[m].codec, 32, ctrllen, flags))
+		goto err2;
+	if (block_open(&P, &P.diff, magics[m].codec, 32 + ctrllen, difflen,
+	    flags))
+		goto err3;
+	if (block_open(&P, &P.extra, magics[m].codec, 32 + ctrllen + difflen,
+	    -1, flags))
+		goto err4;
+
+	/* Apply the patch. */
+	if (magics[m].inplace)
+		rc = apply_inplace(&P);
+	else
+		rc = apply(&P);
+
+	/* Clean up the decompression. */
+	codec_stream_close(P.extra.S);
+	codec_stream_close(P.diff.S);
+	codec_stream_close(P.ctrl.S);
+
+	/* Free buffers. */
+	free(P.new);
+	free(P.old);
+
+	/* Return success or the error we hit. */
+	return (rc);
+
+err4:
+	codec_stream_close(P.diff.S);
+err3:
+	codec_stream_close(P.ctrl.S);
+err2:
+	free(P.new);
+err1:
+	free(P.old);
+err0:
+	/* Failure! */
+	return (rc);
+}
+
+/**
+ * bspatch_strerror(error):
+ * Return a string describing an error returned by bspatch_apply.
+ */
+const char *
+bspatch_strerror(int error)
+{
+
+	switch (error) {
+	case BSPATCH_OK:
+		return ("Success");
+	case BSPATCH_EINTERNAL:
+		return ("Internal error");
+	case BSPATCH_ECORRUPT:
+		return ("Corrupt patch");
+	case BSPATCH_ECODEC:
+		return ("Patch uses an unsupported compression codec");
+	case BSPATCH_ENOTINPLACE:
+		return ("Patch cannot be applied in place");
+	case BSPATCH_EREADOLD:
+		return ("Error reading old data");
+	case BSPATCH_EREADPATCH:
+		return ("Error reading patch");
+	case BSPATCH_EWRITENEW:
+		return ("Error writing new data");
+	default:
+		return ("Unknown error");
+	}
+}
@@ -0,0 +1,83 @@
+/*-
+ * Copyright 2012 Colin Percival
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions 
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _BSPATCH_APPLY_H_
+#define _BSPATCH_APPLY_H_
+
+#include <sys/types.h>
+
+#include <stdint.h>
+
+/* Flags for bspatch_apply. */
+#define BSPATCH_INPLACE		0x1	/* Old and new data share storage. */
+#define BSPATCH_READAHEAD	0x2	/* Decompress in separate threads. */
+
+/* Errors returned by bspatch_apply. */
+#define BSPATCH_OK		0	/* Success. */
+#define BSPATCH_EINTERNAL	1	/* Out of memory or similar. */
+#define BSPATCH_ECORRUPT	2	/* Patch is corrupt or truncated. */
+#define BSPATCH_ECODEC		3	/* Patch codec is not supported. */
+#define BSPATCH_ENOTINPLACE	4	/* Patch can't be applied in place. */
+#define BSPATCH_EREADOLD	5	/* read_old failed. */
+#define BSPATCH_EREADPATCH	6	/* read_patch failed. */
+#define BSPATCH_EWRITENEW	7	/* write_new failed. */
+
+/**
+ * bspatch_apply(oldsize, read_old, read_patch, write_new, cookie, flags,
+ *     newsize):
+ * Apply a patch to the oldsize bytes of old data, using the provided
+ * functions for all I/O:
+ *   read_old(cookie, pos, buf, len) reads len bytes of old data at position
+ *   pos into buf, returning 0 on success or -1 on error;
+ *   read_patch(cookie, pos, buf, len) reads up to len bytes of the patch at
+ *   position pos into buf, returning the number of bytes read, 0 at the end
+ *   of the patch, or -1 on error; and
+ *   write_new(cookie, pos, buf, len) writes len bytes of new data at
+ *   position pos, returning 0 on success or -1 on error.
+ * New data is written in order, except for in-place patches (which are
+ * produced by bsdiff -i).  If ${flags} includes BSPATCH_INPLACE, read_old
+ * and write_new access the same storage, so that the new data overwrites the
+ * old data as it is written; this is only possible for in-place patches,
+ * and the storage must then be truncated to the new size after the patch is
+ * applied.  If ${flags} includes BSPATCH_READAHEAD, the patch is decompressed
+ * by separate threads, which may call read_patch concurrently.
+ * Store the length of the new data in newsize (if the patch header could be
+ * read) and return BSPATCH_OK or one of the BSPATCH_E* errors.  No state is
+ * kept between calls, so several patches may be applied at once.
+ */
+int bspatch_apply(uint64_t,
+    int (*)(void *, uint64_t, uint8_t *, size_t),
+    ssize_t (*)(void *, uint64_t, uint8_t *, size_t),
+    int (*)(void *, uint64_t, const uint8_t *, size_t),
+    void *, int, uint64_t *);
+
+/**
+ * bspatch_strerror(error):
+ * Return a string describing an error returned by bspatch_apply.
+ */
+const char * bspatch_strerror(int);
+
+#endif /* !_BSPATCH_APPLY_H_ */
@@ -0,0 +1,360 @@
+/*-
+ * Copyright (c) 2012 Colin Percival
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <bzlib.h>
+#include <limits.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifdef HAVE_LZMA
+#include <lzma.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_BROTLI
+#include <brotli/decode.h>
+#include <brotli/encode.h>
+#endif
+
+#include "warnp.h"
+
+#include "codec_buf.h"
+
+/* Compression levels. */
+#define BZIP2_LEVEL	9
+#define XZ_PRESET	6
+#define ZSTD_LEVEL	3
+#define BROTLI_QUALITY	11
+
+/* Codec names, indexed by codec number. */
+static const char * names[] = {
+	"bzip2",
+	"xz",
+	"zstd",
+	"brotli"
+};
+
+/**
+ * codec_lookup(name):
+ * Return the codec with the specified name ("bzip2", "xz", "zstd", or
+ * "brotli"), or -1 if there is no such codec or support for it was not
+ * compiled in.
+ */
+int
+codec_lookup(const char * name)
+{
+	int codec;
+
+	/* Look for the name. */
+	for (codec = 0; codec <= CODEC_MAX; codec++) {
+		if (strcmp(name, names[codec]) == 0)
+			break;
+	}
+
+	/* Did we find a codec we can use? */
+	if ((codec > CODEC_MAX) || !codec_supported(codec))
+		return (-1);
+
+	/* Return the codec. */
+	return (codec);
+}
+
+/**
+ * codec_supported(codec):
+ * Return non-zero if the specified codec is known and was compiled in.
+ */
+int
+codec_supported(int codec)
+{
+
+	switch (codec) {
+	case CODEC_BZIP2:
+		return (1);
+#ifdef HAVE_LZMA
+	case CODEC_XZ:
+		return (1);
+#endif
+#ifdef HAVE_ZSTD
+	case CODEC_ZSTD:
+		return (1);
+#endif
+#ifdef HAVE_BROTLI
+	case CODEC_BROTLI:
+		return (1);
+#endif
+	default:
+		return (0);
+	}
+}
+
+/**
+ * codec_bound(codec, len):
+ * Return the maximum length of the result of compressing len bytes.
+ */
+size_t
+codec_bound(int codec, size_t len)
+{
+
+	switch (codec) {
+#ifdef HAVE_LZMA
+	case CODEC_XZ:
+		return (lzma_stream_buffer_bound(len));
+#endif
+#ifdef HAVE_ZSTD
+	case CODEC_ZSTD:
+		return (ZSTD_compressBound(len));
+#endif
+#ifdef HAVE_BROTLI
+	case CODEC_BROTLI:
+		return (BrotliEncoderMaxCompressedSize(len));
+#endif
+	default:
+		/* bzip2 output is at most 1% + 600 bytes larger. */
+		return (len + len / 100 + 600);
+	}
+}
+
+/**
+ * codec_compress(codec, in, inlen, out, outlen):
+ * Compress in[0 .. inlen - 1] into out[], which must be at least
+ * codec_bound(codec, inlen) bytes long, and set ${outlen} to the length of
+ * the compressed data.
+ */
+int
+codec_compress(int codec, const uint8_t * in, size_t inlen, uint8_t * out,
+    size_t * outlen)
+{
+	unsigned int bz2len;
+	int bz2err;
+#ifdef HAVE_LZMA
+	lzma_ret lzret;
+#endif
+#ifdef HAVE_ZSTD
+	size_t zlen;
+#endif
+
+	switch (codec) {
+	case CODEC_BZIP2:
+		/* libbz2 uses unsigned int for lengths. */
+		if (codec_bound(codec, inlen) > UINT_MAX) {
+			warn0("Buffer too large for bzip2: %zu bytes", inlen);
+			goto err0;
+		}
+		bz2len = codec_bound(codec, inlen);
+
+		/* The bz2 library API doesn't understand const buffers. */
+		if ((bz2err = BZ2_bzBuffToBuffCompress((char *)out, &bz2len,
+		    (char *)(uintptr_t)(in), inlen, BZIP2_LEVEL, 0, 0))
+		    != BZ_OK) {
+			warn0("BZ2_bzBuffToBuffCompress error: %d", bz2err);
+			goto err0;
+		}
+		*outlen = bz2len;
+		break;
+#ifdef HAVE_LZMA
+	case CODEC_XZ:
+		*outlen = 0;
+		if ((lzret = lzma_easy_buffer_encode(XZ_PRESET,
+		    LZMA_CHECK_CRC64, NULL, in, inlen, out, outlen,
+		    codec_bound(codec, inlen))) != LZMA_OK) {
+			warn0("lzma_easy_buffer_encode error: %d", lzret);
+			goto err0;
+		}
+		break;
+#endif
+#ifdef HAVE_ZSTD
+	case CODEC_ZSTD:
+		zlen = ZSTD_compress(out, codec_bound(codec, inlen), in,
+		    inlen, ZSTD_LEVEL);
+		if (ZSTD_isError(zlen)) {
+			warn0("ZSTD_compress error: %s",
+			    ZSTD_getErrorName(zlen));
+			goto err0;
+		}
+		*outlen = zlen;
+		break;
+#endif
+#ifdef HAVE_BROTLI
+	case CODEC_BROTLI:
+		*outlen = codec_bound(codec, inlen);
+		if (!BrotliEncoderCompress(BROTLI_QUALITY,
+		    BROTLI_DEFAULT_WINDOW, BROTLI_MODE_GENERIC, inlen, in,
+		    outlen, out)) {
+			warn0("BrotliEncoderCompress failed");
+			goto err0;
+		}
+		break;
+#endif
+	default:
+		warn0("Compression codec not supported: %d", codec);
+		goto err0;
+	}
+
+	/* Success! */
+	return (0);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/**
+ * codec_compress_memusage(codec, len):
+ * Return an estimate of the memory which codec_compress uses to compress len
+ * bytes, not counting its input and output buffers.
+ */
+size_t
+codec_compress_memusage(int codec, size_t len)
+{
+
+	/* Only brotli's memory usage depends on the length. */
+	(void)len;
+
+	switch (codec) {
+#ifdef HAVE_LZMA
+	case CODEC_XZ:
+		return (lzma_easy_encoder_memusage(XZ_PRESET));
+#endif
+#ifdef HAVE_ZSTD
+	case CODEC_ZSTD:
+		/*
+		 * Level 3 uses a hash table of 2^17 entries and a chain table
+		 * of 2^16 entries, plus room for a block's worth of sequences.
+		 */
+		return (((size_t)4 << 17) + ((size_t)4 << 16) +
+		    ((size_t)1 << 19));
+#endif
+#ifdef HAVE_BROTLI
+	case CODEC_BROTLI:
+		/*
+		 * Quality 11 keeps a binary tree over its 2^22 byte window,
+		 * and per-byte state for the data being compressed.
+		 */
+		return (((size_t)10 << 22) + 4 * len);
+#endif
+	default:
+		/* libbz2 needs 400k plus 8 times the 900k block size. */
+		return (400000 + 8 * 900000);
+	}
+}
+
+/**
+ * codec_decompress(codec, in, inlen, out, outlen):
+ * Decompress in[0 .. inlen - 1] into out[0 .. outlen - 1].  Fail if the data
+ * is corrupt or does not decompress to exactly outlen bytes.  Any data after
+ * the end of the compressed stream is ignored.
+ */
+int
+codec_decompress(int codec, const uint8_t * in, size_t inlen, uint8_t * out,
+    size_t outlen)
+{
+	unsigned int bz2len;
+	int bz2err;
+	size_t declen;
+#if defined(HAVE_LZMA) || defined(HAVE_ZSTD)
+	size_t inpos = 0;
+#endif
+#ifdef HAVE_LZMA
+	uint64_t memlimit = UINT64_MAX;
+	lzma_ret lzret;
+#endif
+#ifdef HAVE_BROTLI
+	BrotliDecoderResult bret;
+#endif
+
+	switch (codec) {
+	case CODEC_BZIP2:
+		/* libbz2 uses unsigned int for lengths. */
+		if ((inlen > UINT_MAX) || (outlen > UINT_MAX)) {
+			warn0("Buffer too large for bzip2");
+			goto err0;
+		}
+		bz2len = outlen;
+		if ((bz2err = BZ2_bzBuffToBuffDecompress((char *)out, &bz2len,
+		    (char *)(uintptr_t)(in), inlen, 0, 0)) != BZ_OK) {
+			warn0("error in BZ2_bzBuffToBuffDecompress: %d",
+			    bz2err);
+			goto err0;
+		}
+		declen = bz2len;
+		break;
+#ifdef HAVE_LZMA
+	case CODEC_XZ:
+		declen = 0;
+		if ((lzret = lzma_stream_buffer_decode(&memlimit, 0, NULL,
+		    in, &inpos, inlen, out, &declen, outlen)) != LZMA_OK) {
+			warn0("error in lzma_stream_buffer_decode: %d", lzret);
+			goto err0;
+		}
+		break;
+#endif
+#ifdef HAVE_ZSTD
+	case CODEC_ZSTD:
+		/* Don't try to decode anything after the first frame. */
+		inpos = ZSTD_findFrameCompressedSize(in, inlen);
+		if (ZSTD_isError(inpos)) {
+			warn0("error in ZSTD_findFrameCompressedSize: %s",
+			    ZSTD_getErrorName(inpos));
+			goto err0;
+		}
+		declen = ZSTD_decompress(out, outlen, in, inpos);
+		if (ZSTD_isError(declen)) {
+			warn0("error in ZSTD_decompress: %s",
+			    ZSTD_getErrorName(declen));
+			goto err0;
+		}
+		break;
+#endif
+#ifdef HAVE_BROTLI
+	case CODEC_BROTLI:
+		declen = outlen;
+		if ((bret = BrotliDecoderDecompress(inlen, in, &declen,
+		    out)) != BROTLI_DECODER_RESULT_SUCCESS) {
+			warn0("error in BrotliDecoderDecompress: %d", bret);
+			goto err0;
+		}
+		break;
+#endif
+	default:
+		warn0("Compression codec not supported: %d", codec);
+		goto err0;
+	}
+
+	/* Make sure we got the right amount of data. */
+	if (declen != outlen) {
+		warn0("decompressed data is wrong size (%zu, expected %zu)",
+		    declen, outlen);
+		goto err0;
+	}
+
+	/* Success! */
+	return (0);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
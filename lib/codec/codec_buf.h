@@ -0,0 +1,83 @@
+/*-
+ * Copyright (c) 2012 Colin Percival
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _CODEC_BUF_H_
+#define _CODEC_BUF_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Compression codecs.  These values are stored in patch files. */
+#define CODEC_BZIP2	0	/* bzip2, level 9. */
+#define CODEC_XZ	1	/* xz, preset 6; needs -DHAVE_LZMA. */
+#define CODEC_ZSTD	2	/* zstd, level 3; needs -DHAVE_ZSTD. */
+#define CODEC_BROTLI	3	/* brotli, quality 11; needs -DHAVE_BROTLI. */
+#define CODEC_MAX	CODEC_BROTLI
+
+/**
+ * codec_lookup(name):
+ * Return the codec with the specified name ("bzip2", "xz", "zstd", or
+ * "brotli"), or -1 if there is no such codec or support for it was not
+ * compiled in.
+ */
+int codec_lookup(const char *);
+
+/**
+ * codec_supported(codec):
+ * Return non-zero if the specified codec is known and was compiled in.
+ */
+int codec_supported(int);
+
+/**
+ * codec_bound(codec, len):
+ * Return the maximum length of the result of compressing len bytes.
+ */
+size_t codec_bound(int, size_t);
+
+/**
+ * codec_compress(codec, in, inlen, out, outlen):
+ * Compress in[0 .. inlen - 1] into out[], which must be at least
+ * codec_bound(codec, inlen) bytes long, and set ${outlen} to the length of
+ * the compressed data.
+ */
+int codec_compress(int, const uint8_t *, size_t, uint8_t *, size_t *);
+
+/**
+ * codec_compress_memusage(codec, len):
+ * Return an estimate of the memory which codec_compress uses to compress len
+ * bytes, not counting its input and output buffers.
+ */
+size_t codec_compress_memusage(int, size_t);
+
+/**
+ * codec_decompress(codec, in, inlen, out, outlen):
+ * Decompress in[0 .. inlen - 1] into out[0 .. outlen - 1].  Fail if the data
+ * is corrupt or does not decompress to exactly outlen bytes.  Any data after
+ * the end of the compressed stream is ignored.
+ */
+int codec_decompress(int, const uint8_t *, size_t, uint8_t *, size_t);
+
+#endif /* !_CODEC_BUF_H_ */
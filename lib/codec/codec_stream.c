@@ -0,0 +1,705 @@
+/*-
+ * Copyright (c) 2012 Colin Percival
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+
+#include <assert.h>
+#include <bzlib.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_LZMA
+#include <lzma.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_BROTLI
+#include <brotli/decode.h>
+#endif
+
+#include "warnp.h"
+
+#include "codec_buf.h"
+
+#include "codec_stream.h"
+
+/* Decompression state. */
+struct codec_stream {
+	int codec;
+
+	/* Compressed data not yet read from the source. */
+	ssize_t (* readfunc)(void *, uint8_t *, size_t);
+	void * cookie;
+	off_t left;		/* Or -1 if we read to EOF. */
+	int eof;
+
+	/* Compressed data read but not yet decompressed. */
+	uint8_t inbuf[65536];
+	const uint8_t * in;
+	size_t inlen;
+
+	/* Decompressor state. */
+	int started;		/* Non-zero if we are inside a stream. */
+	bz_stream bz;
+#ifdef HAVE_LZMA
+	lzma_stream lz;
+#endif
+#ifdef HAVE_ZSTD
+	ZSTD_DStream * zs;
+#endif
+#ifdef HAVE_BROTLI
+	BrotliDecoderState * br;
+#endif
+
+	/*
+	 * Readahead state; see codec_stream_readahead.  Bytes [rpos, wpos) of
+	 * the decompressed data are in ring[], at offsets modulo ringlen.
+	 */
+	uint8_t * ring;		/* NULL if we're not reading ahead. */
+	size_t ringlen;
+	uint64_t rpos;
+	uint64_t wpos;
+	int done;		/* Producer has stopped with status err. */
+	int err;
+	int stop;		/* Producer should stop. */
+	pthread_t thr;
+	pthread_mutex_t mtx;
+	pthread_cond_t nonempty;
+	pthread_cond_t nonfull;
+};
+
+/* Why decompression stopped; see decompress. */
+#define DEC_OK		0
+#define DEC_ERR		1	/* Error has already been reported. */
+#define DEC_TRUNCATED	2
+#define DEC_CORRUPT	3
+
+/* Refill the input buffer if it is empty and there's more data. */
+static int
+refill(struct codec_stream * S)
+{
+	size_t len;
+	ssize_t readlen;
+
+	/* Do we need (and have) more data? */
+	if ((S->inlen > 0) || S->eof)
+		return (0);
+
+	/* Read as much as we can, but don't go past the end of our data. */
+	len = sizeof(S->inbuf);
+	if ((S->left != -1) && ((off_t)len > S->left))
+		len = S->left;
+	if ((readlen = (S->readfunc)(S->cookie, S->inbuf, len)) == -1)
+		return (-1);
+	if ((len = readlen) == 0)
+		S->eof = 1;
+	if (S->left != -1) {
+		S->left -= len;
+		if (S->left == 0)
+			S->eof = 1;
+	}
+	S->in = S->inbuf;
+	S->inlen = len;
+
+	/* Success! */
+	return (0);
+}
+
+/* Finish the current stream, if any. */
+static void
+endstream(struct codec_stream * S)
+{
+
+	/* Nothing to do if there's no stream. */
+	if (!S->started)
+		return;
+
+	switch (S->codec) {
+	case CODEC_BZIP2:
+		BZ2_bzDecompressEnd(&S->bz);
+		break;
+#ifdef HAVE_BROTLI
+	case CODEC_BROTLI:
+		BrotliDecoderDestroyInstance(S->br);
+		break;
+#endif
+	}
+	S->started = 0;
+}
+
+/* Start a new stream. */
+static int
+startstream(struct codec_stream * S)
+{
+	int bz2err;
+
+	switch (S->codec) {
+	case CODEC_BZIP2:
+		S->bz.bzalloc = NULL;
+		S->bz.bzfree = NULL;
+		S->bz.opaque = NULL;
+		if ((bz2err = BZ2_bzDecompressInit(&S->bz, 0, 0)) != BZ_OK) {
+			warn0("BZ2_bzDecompressInit error: %d", bz2err);
+			goto err0;
+		}
+		break;
+#ifdef HAVE_BROTLI
+	case CODEC_BROTLI:
+		if ((S->br = BrotliDecoderCreateInstance(NULL, NULL,
+		    NULL)) == NULL)
+			goto err0;
+		break;
+#endif
+	}
+	S->started = 1;
+
+	/* Success! */
+	return (0);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/**
+ * codec_stream_open(codec, readfunc, cookie, len):
+ * Prepare to decompress len bytes of data (or data up to EOF if len is -1)
+ * obtained by calling readfunc(cookie, buf, buflen), which should read up to
+ * buflen bytes into buf and return the number of bytes read, 0 at EOF, or -1
+ * on error.  The data may consist of several concatenated streams.
+ */
+struct codec_stream *
+codec_stream_open(int codec, ssize_t (* readfunc)(void *, uint8_t *, size_t),
+    void * cookie, off_t len)
+{
+	struct codec_stream * S;
+#ifdef HAVE_LZMA
+	lzma_stream lzinit = LZMA_STREAM_INIT;
+	lzma_ret lzret;
+#endif
+
+	/* Make sure we know how to decompress this. */
+	if (!codec_supported(codec)) {
+		warn0("Compression codec not supported: %d", codec);
+		goto err0;
+	}
+
+	/* Allocate and initialize a structure. */
+	if ((S = malloc(sizeof(struct codec_stream))) == NULL)
+		goto err0;
+	S->codec = codec;
+	S->readfunc = readfunc;
+	S->cookie = cookie;
+	S->left = len;
+	S->eof = (len == 0);
+	S->in = S->inbuf;
+	S->inlen = 0;
+	S->started = 0;
+	S->ring = NULL;
+
+	/*
+	 * xz and zstd handle concatenated streams themselves, so we set up
+	 * their decoders once; bzip2 and brotli decoders are set up for each
+	 * stream when we find it.
+	 */
+	switch (codec) {
+#ifdef HAVE_LZMA
+	case CODEC_XZ:
+		S->lz = lzinit;
+		if ((lzret = lzma_stream_decoder(&S->lz, UINT64_MAX,
+		    LZMA_CONCATENATED)) != LZMA_OK) {
+			warn0("lzma_stream_decoder error: %d", lzret);
+			goto err1;
+		}
+		break;
+#endif
+#ifdef HAVE_ZSTD
+	case CODEC_ZSTD:
+		if ((S->zs = ZSTD_createDStream()) == NULL) {
+			warn0("ZSTD_createDStream failed");
+			goto err1;
+		}
+		ZSTD_initDStream(S->zs);
+		break;
+#endif
+	}
+
+	/* Success! */
+	return (S);
+
+#if defined(HAVE_LZMA) || defined(HAVE_ZSTD)
+err1:
+	free(S);
+#endif
+err0:
+	/* Failure! */
+	return (NULL);
+}
+
+/*
+ * Decompress up to len bytes into buf, and set *declen to the number of bytes
+ * produced.  Return DEC_OK if we produced all len bytes; otherwise, return
+ * the reason we stopped without reporting it (unless it is DEC_ERR), since
+ * if we're reading ahead the reader might not need the data we failed to
+ * produce.
+ */
+static int
+decompress(struct codec_stream * S, uint8_t * buf, size_t len,
+    size_t * declen)
+{
+	size_t outlen;
+	int bz2err;
+#ifdef HAVE_LZMA
+	lzma_ret lzret;
+#endif
+#ifdef HAVE_ZSTD
+	ZSTD_inBuffer zin;
+	ZSTD_outBuffer zout;
+	size_t zret;
+#endif
+#ifdef HAVE_BROTLI
+	BrotliDecoderResult bret;
+	uint8_t * next_out;
+	size_t avail_out;
+#endif
+
+	/* Keep going until we've produced all the data we need. */
+	*declen = 0;
+	while (len > 0) {
+		/* Make sure we have some input if there's any left. */
+		if (refill(S))
+			goto err0;
+
+		/* Start a new stream if necessary. */
+		if (!S->started) {
+			if (S->inlen == 0)
+				goto truncated;
+			if (startstream(S))
+				goto err0;
+		}
+
+		/* Decompress as much as we can. */
+		switch (S->codec) {
+		case CODEC_BZIP2:
+			S->bz.next_in = (char *)(uintptr_t)(S->in);
+			S->bz.avail_in = S->inlen;
+			S->bz.next_out = (char *)buf;
+			S->bz.avail_out = (len > UINT_MAX) ? UINT_MAX : len;
+			outlen = S->bz.avail_out;
+			bz2err = BZ2_bzDecompress(&S->bz);
+			if ((bz2err != BZ_OK) && (bz2err != BZ_STREAM_END))
+				goto corrupt;
+			S->in = (const uint8_t *)S->bz.next_in;
+			S->inlen = S->bz.avail_in;
+			outlen -= S->bz.avail_out;
+			if (bz2err == BZ_STREAM_END)
+				endstream(S);
+			else if ((outlen == 0) && (S->inlen == 0) && S->eof)
+				goto truncated;
+			break;
+#ifdef HAVE_LZMA
+		case CODEC_XZ:
+			S->lz.next_in = S->in;
+			S->lz.avail_in = S->inlen;
+			S->lz.next_out = buf;
+			S->lz.avail_out = len;
+			lzret = lzma_code(&S->lz,
+			    (S->inlen == 0) ? LZMA_FINISH : LZMA_RUN);
+			if ((lzret != LZMA_OK) && (lzret != LZMA_STREAM_END))
+				goto corrupt;
+			S->in = S->lz.next_in;
+			S->inlen = S->lz.avail_in;
+			outlen = len - S->lz.avail_out;
+			if ((outlen == 0) && (lzret == LZMA_STREAM_END))
+				goto truncated;
+			break;
+#endif
+#ifdef HAVE_ZSTD
+		case CODEC_ZSTD:
+			zin.src = S->in;
+			zin.size = S->inlen;
+			zin.pos = 0;
+			zout.dst = buf;
+			zout.size = len;
+			zout.pos = 0;
+			zret = ZSTD_decompressStream(S->zs, &zout, &zin);
+			if (ZSTD_isError(zret))
+				goto corrupt;
+			S->in += zin.pos;
+			S->inlen -= zin.pos;
+			outlen = zout.pos;
+			if ((outlen == 0) && (S->inlen == 0) && S->eof)
+				goto truncated;
+			break;
+#endif
+#ifdef HAVE_BROTLI
+		case CODEC_BROTLI:
+			next_out = buf;
+			avail_out = len;
+			bret = BrotliDecoderDecompressStream(S->br, &S->inlen,
+			    &S->in, &avail_out, &next_out, NULL);
+			outlen = len - avail_out;
+			if (bret == BROTLI_DECODER_RESULT_ERROR)
+				goto corrupt;
+			if (bret == BROTLI_DECODER_RESULT_SUCCESS)
+				endstream(S);
+			else if ((outlen == 0) && (S->inlen == 0) && S->eof)
+				goto truncated;
+			break;
+#endif
+		default:
+			goto corrupt;
+		}
+
+		/* Move past the data we've produced. */
+		buf += outlen;
+		len -= outlen;
+		*declen += outlen;
+	}
+
+	/* Success! */
+	return (DEC_OK);
+
+truncated:
+	return (DEC_TRUNCATED);
+corrupt:
+	return (DEC_CORRUPT);
+err0:
+	/* Failure! */
+	return (DEC_ERR);
+}
+
+/* Report why decompression stopped, if we haven't already. */
+static void
+report(int err)
+{
+
+	switch (err) {
+	case DEC_TRUNCATED:
+		warn0("Compressed data is truncated");
+		break;
+	case DEC_CORRUPT:
+		warn0("Compressed data is corrupt");
+		break;
+	}
+}
+
+/* Decompress data into the ring buffer until told to stop. */
+static void *
+producer(void * cookie)
+{
+	struct codec_stream * S = cookie;
+	size_t off, len, declen;
+	int err;
+
+	/* Pick up the lock. */
+	if ((errno = pthread_mutex_lock(&S->mtx)) != 0) {
+		warnp("pthread_mutex_lock");
+		goto err0;
+	}
+
+	/* Keep the ring buffer full until we stop producing data. */
+	do {
+		/* Wait until there's free space or we're told to stop. */
+		while ((S->wpos - S->rpos == S->ringlen) && !S->stop) {
+			if ((errno = pthread_cond_wait(&S->nonfull,
+			    &S->mtx)) != 0) {
+				warnp("pthread_cond_wait");
+				goto err1;
+			}
+		}
+		if (S->stop) {
+			err = DEC_OK;
+			break;
+		}
+
+		/* Fill as much free space as we can without wrapping. */
+		off = S->wpos % S->ringlen;
+		len = S->ringlen - (S->wpos - S->rpos);
+		if (len > S->ringlen - off)
+			len = S->ringlen - off;
+
+		/* The reader doesn't touch free space, so drop the lock. */
+		if ((errno = pthread_mutex_unlock(&S->mtx)) != 0) {
+			warnp("pthread_mutex_unlock");
+			goto err0;
+		}
+
+		/* Decompress some data. */
+		err = decompress(S, &S->ring[off], len, &declen);
+
+		/* Pick up the lock again. */
+		if ((errno = pthread_mutex_lock(&S->mtx)) != 0) {
+			warnp("pthread_mutex_lock");
+			goto err0;
+		}
+
+		/* Tell the reader about the new data. */
+		S->wpos += declen;
+		if ((errno = pthread_cond_signal(&S->nonempty)) != 0) {
+			warnp("pthread_cond_signal");
+			goto err1;
+		}
+	} while (err == DEC_OK);
+
+	/* Tell the reader why we stopped. */
+	S->err = err;
+	S->done = 1;
+	if ((errno = pthread_cond_signal(&S->nonempty)) != 0) {
+		warnp("pthread_cond_signal");
+		goto err1;
+	}
+
+	/* Release the lock. */
+	if ((errno = pthread_mutex_unlock(&S->mtx)) != 0) {
+		warnp("pthread_mutex_unlock");
+		goto err0;
+	}
+
+	/* Success! */
+	return (S);
+
+err1:
+	pthread_mutex_unlock(&S->mtx);
+err0:
+	/* Failure! */
+	return (NULL);
+}
+
+/* Copy len bytes out of the ring buffer into buf. */
+static int
+readring(struct codec_stream * S, uint8_t * buf, size_t len)
+{
+	size_t off, n;
+
+	/* Pick up the lock. */
+	if ((errno = pthread_mutex_lock(&S->mtx)) != 0) {
+		warnp("pthread_mutex_lock");
+		goto err0;
+	}
+
+	/* Keep going until we've copied everything. */
+	while (len > 0) {
+		/* Wait until there's data or the producer has stopped. */
+		while ((S->wpos == S->rpos) && !S->done) {
+			if ((errno = pthread_cond_wait(&S->nonempty,
+			    &S->mtx)) != 0) {
+				warnp("pthread_cond_wait");
+				goto err1;
+			}
+		}
+
+		/* If there's no data left, report why. */
+		if (S->wpos == S->rpos) {
+			report(S->err);
+			goto err1;
+		}
+
+		/* Copy as much as we can without wrapping. */
+		off = S->rpos % S->ringlen;
+		n = S->wpos - S->rpos;
+		if (n > S->ringlen - off)
+			n = S->ringlen - off;
+		if (n > len)
+			n = len;
+
+		/* The producer doesn't touch this data, so drop the lock. */
+		if ((errno = pthread_mutex_unlock(&S->mtx)) != 0) {
+			warnp("pthread_mutex_unlock");
+			goto err0;
+		}
+
+		/* Copy the data out. */
+		memcpy(buf, &S->ring[off], n);
+		buf += n;
+		len -= n;
+
+		/* Pick up the lock again. */
+		if ((errno = pthread_mutex_lock(&S->mtx)) != 0) {
+			warnp("pthread_mutex_lock");
+			goto err0;
+		}
+
+		/* Hand the space back to the producer. */
+		S->rpos += n;
+		if ((errno = pthread_cond_signal(&S->nonfull)) != 0) {
+			warnp("pthread_cond_signal");
+			goto err1;
+		}
+	}
+
+	/* Release the lock. */
+	if ((errno = pthread_mutex_unlock(&S->mtx)) != 0) {
+		warnp("pthread_mutex_unlock");
+		goto err0;
+	}
+
+	/* Success! */
+	return (0);
+
+err1:
+	pthread_mutex_unlock(&S->mtx);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/**
+ * codec_stream_readahead(S, buflen):
+ * Start a thread which decompresses data ahead of codec_stream_read into a
+ * buflen-byte buffer, so that several streams can be decompressed in
+ * parallel with each other and with the caller's use of the data.  Once this
+ * has been called, readfunc is called from that thread until
+ * codec_stream_close.
+ */
+int
+codec_stream_readahead(struct codec_stream * S, size_t buflen)
+{
+
+	/* Sanity-check. */
+	assert(S->ring == NULL);
+	assert(buflen > 0);
+
+	/* Allocate the ring buffer. */
+	if ((S->ring = malloc(buflen)) == NULL)
+		goto err0;
+	S->ringlen = buflen;
+	S->rpos = S->wpos = 0;
+	S->done = S->stop = 0;
+	S->err = DEC_OK;
+
+	/* Set up synchronization. */
+	if ((errno = pthread_mutex_init(&S->mtx, NULL)) != 0) {
+		warnp("pthread_mutex_init");
+		goto err1;
+	}
+	if ((errno = pthread_cond_init(&S->nonempty, NULL)) != 0) {
+		warnp("pthread_cond_init");
+		goto err2;
+	}
+	if ((errno = pthread_cond_init(&S->nonfull, NULL)) != 0) {
+		warnp("pthread_cond_init");
+		goto err3;
+	}
+
+	/* Start decompressing. */
+	if ((errno = pthread_create(&S->thr, NULL, producer, S)) != 0) {
+		warnp("pthread_create");
+		goto err4;
+	}
+
+	/* Success! */
+	return (0);
+
+err4:
+	pthread_cond_destroy(&S->nonfull);
+err3:
+	pthread_cond_destroy(&S->nonempty);
+err2:
+	pthread_mutex_destroy(&S->mtx);
+err1:
+	free(S->ring);
+	S->ring = NULL;
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/**
+ * codec_stream_read(S, buf, len):
+ * Decompress exactly len bytes into buf.  Fail if the compressed data is
+ * corrupt or ends too soon.
+ */
+int
+codec_stream_read(struct codec_stream * S, uint8_t * buf, size_t len)
+{
+	size_t declen;
+	int err;
+
+	/* If we're reading ahead, the data is in the ring buffer. */
+	if (S->ring != NULL)
+		return (readring(S, buf, len));
+
+	/* Otherwise, decompress it now. */
+	if ((err = decompress(S, buf, len, &declen)) != DEC_OK) {
+		report(err);
+		return (-1);
+	}
+
+	/* Success! */
+	return (0);
+}
+
+/**
+ * codec_stream_close(S):
+ * Free the decompression state.
+ */
+void
+codec_stream_close(struct codec_stream * S)
+{
+
+	/* Stop reading ahead. */
+	if (S->ring != NULL) {
+		if ((errno = pthread_mutex_lock(&S->mtx)) != 0)
+			warnp("pthread_mutex_lock");
+		S->stop = 1;
+		if ((errno = pthread_cond_signal(&S->nonfull)) != 0)
+			warnp("pthread_cond_signal");
+		if ((errno = pthread_mutex_unlock(&S->mtx)) != 0)
+			warnp("pthread_mutex_unlock");
+		if ((errno = pthread_join(S->thr, NULL)) != 0)
+			warnp("pthread_join");
+		pthread_cond_destroy(&S->nonfull);
+		pthread_cond_destroy(&S->nonempty);
+		pthread_mutex_destroy(&S->mtx);
+		free(S->ring);
+	}
+
+	/* Finish any stream we're in the middle of. */
+	endstream(S);
+
+	/* Free codec-specific state. */
+	switch (S->codec) {
+#ifdef HAVE_LZMA
+	case CODEC_XZ:
+		lzma_end(&S->lz);
+		break;
+#endif
+#ifdef HAVE_ZSTD
+	case CODEC_ZSTD:
+		ZSTD_freeDStream(S->zs);
+		break;
+#endif
+	}
+
+	/* Free the structure. */
+	free(S);
+}
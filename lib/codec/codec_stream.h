@@ -0,0 +1,70 @@
+/*-
+ * Copyright (c) 2012 Colin Percival
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _CODEC_STREAM_H_
+#define _CODEC_STREAM_H_
+
+#include <sys/types.h>
+
+#include <stdint.h>
+
+/* Opaque type. */
+struct codec_stream;
+
+/**
+ * codec_stream_open(codec, readfunc, cookie, len):
+ * Prepare to decompress len bytes of data (or data up to EOF if len is -1)
+ * obtained by calling readfunc(cookie, buf, buflen), which should read up to
+ * buflen bytes into buf and return the number of bytes read, 0 at EOF, or -1
+ * on error.  The data may consist of several concatenated streams.
+ */
+struct codec_stream * codec_stream_open(int,
+    ssize_t (*)(void *, uint8_t *, size_t), void *, off_t);
+
+/**
+ * codec_stream_readahead(S, buflen):
+ * Start a thread which decompresses data ahead of codec_stream_read into a
+ * buflen-byte buffer, so that several streams can be decompressed in
+ * parallel with each other and with the caller's use of the data.  Once this
+ * has been called, readfunc is called from that thread until
+ * codec_stream_close.
+ */
+int codec_stream_readahead(struct codec_stream *, size_t);
+
+/**
+ * codec_stream_read(S, buf, len):
+ * Decompress exactly len bytes into buf.  Fail if the compressed data is
+ * corrupt or ends too soon.
+ */
+int codec_stream_read(struct codec_stream *, uint8_t *, size_t);
+
+/**
+ * codec_stream_close(S):
+ * Free the decompression state.
+ */
+void codec_stream_close(struct codec_stream *);
+
+#endif /* !_CODEC_STREAM_H_ */
@@ -0,0 +1,442 @@
+/*-
+ * Copyright (c) 2012 Colin Percival
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <bzlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "parallel_pool.h"
+#include "warnp.h"
+
+#include "codec_buf.h"
+
+#include "codec_write.h"
+
+/*
+ * Compress bzip2 data in chunks of the bzip2 block size at level 9, so that
+ * splitting the data up doesn't cost us anything in compression ratio.  Other
+ * codecs can look further back, so give them larger chunks.
+ */
+#define CHUNKLEN_BZIP2	900000
+#define CHUNKLEN	4194304
+
+/* Number of chunks per pool thread to hand to the pool at once. */
+#define BATCHCHUNKS	2
+
+/* A chunk of data to compress. */
+struct chunk {
+	uint8_t * in;
+	size_t inlen;
+	uint8_t * out;
+	size_t outlen;
+};
+
+/* A batch of chunks compressed by one pool job. */
+struct batch {
+	struct chunk * chunks;
+	size_t nchunks;
+	struct parallel_pool_job * job;
+	int codec;
+};
+
+/* Compression state. */
+struct codec_write {
+	int codec;
+	FILE * f;
+	struct parallel_pool * pool;
+
+	/* Used if we're writing a single bzip2 stream. */
+	BZFILE * fbz2;
+
+	/*
+	 * Used if we're writing chunks: one batch of chunks being filled, and
+	 * one which may be in the pool being compressed.  Without a pool, each
+	 * batch is a single chunk which we compress ourselves.
+	 */
+	struct batch batches[2];
+	size_t cur;
+	size_t maxchunks;
+	size_t chunklen;
+
+	/* Number of chunks which have been sent to be compressed. */
+	uint64_t nsent;
+};
+
+/* Compress one chunk of a batch.  Callback from parallel_pool. */
+static int
+dochunk(void * cookie, size_t i)
+{
+	struct batch * batch = cookie;
+	struct chunk * C = &batch->chunks[i];
+
+	/* Compress the chunk into its output buffer. */
+	return (codec_compress(batch->codec, C->in, C->inlen, C->out,
+	    &C->outlen));
+}
+
+/* Wait for the batch to be compressed (if necessary) and write it out. */
+static int
+finishbatch(struct codec_write * W, struct batch * batch)
+{
+	struct chunk * C;
+	size_t i;
+	int rc;
+
+	/* Wait for the pool to finish with this batch. */
+	if (batch->job != NULL) {
+		rc = parallel_pool_wait(batch->job);
+		batch->job = NULL;
+		if (rc)
+			goto err0;
+	}
+
+	/* Write out the compressed chunks in order. */
+	for (i = 0; i < batch->nchunks; i++) {
+		C = &batch->chunks[i];
+		if (fwrite(C->out, C->outlen, 1, W->f) != 1) {
+			warnp("fwrite");
+			goto err0;
+		}
+		C->inlen = 0;
+	}
+	batch->nchunks = 0;
+
+	/* Success! */
+	return (0);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/*
+ * Send the current batch to be compressed, after writing out the previous
+ * batch if it's still in the pool.
+ */
+static int
+sendbatch(struct codec_write * W)
+{
+	struct batch * batch = &W->batches[W->cur];
+	struct batch * prev = &W->batches[1 - W->cur];
+
+	/* Without a pool, compress and write the chunk right away. */
+	if (W->pool == NULL) {
+		W->nsent += batch->nchunks;
+		if (dochunk(batch, 0) || finishbatch(W, batch))
+			goto err0;
+		goto done;
+	}
+
+	/* Write out the previous batch. */
+	if ((prev->job != NULL) && finishbatch(W, prev))
+		goto err0;
+
+	/* Start compressing this batch. */
+	if ((batch->job = parallel_pool_submit(W->pool, batch->nchunks,
+	    dochunk, batch)) == NULL) {
+		warnp("parallel_pool_submit");
+		goto err0;
+	}
+	W->nsent += batch->nchunks;
+
+	/* Start filling the other batch. */
+	W->cur = 1 - W->cur;
+
+done:
+	/* Success! */
+	return (0);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/* Free the chunk buffers of a batch. */
+static void
+freebatch(struct codec_write * W, struct batch * batch)
+{
+	size_t i;
+
+	/* Free the buffers we allocated. */
+	for (i = 0; i < W->maxchunks; i++) {
+		free(batch->chunks[i].in);
+		free(batch->chunks[i].out);
+	}
+	free(batch->chunks);
+}
+
+/* Allocate chunk buffers for a batch. */
+static int
+allocbatch(struct codec_write * W, struct batch * batch)
+{
+	struct chunk * C;
+	size_t i;
+
+	/* Allocate chunk structures. */
+	if ((batch->chunks = malloc(W->maxchunks * sizeof(struct chunk))) ==
+	    NULL)
+		goto err0;
+	for (i = 0; i < W->maxchunks; i++) {
+		batch->chunks[i].in = NULL;
+		batch->chunks[i].out = NULL;
+		batch->chunks[i].inlen = 0;
+	}
+	batch->nchunks = 0;
+	batch->job = NULL;
+	batch->codec = W->codec;
+
+	/* Allocate buffers. */
+	for (i = 0; i < W->maxchunks; i++) {
+		C = &batch->chunks[i];
+		if ((C->in = malloc(W->chunklen)) == NULL)
+			goto err1;
+		if ((C->out = malloc(codec_bound(W->codec, W->chunklen))) ==
+		    NULL)
+			goto err1;
+	}
+
+	/* Success! */
+	return (0);
+
+err1:
+	freebatch(W, batch);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/**
+ * codec_write_open(codec, f, pool):
+ * Start writing data compressed with the specified codec to the file f.  The
+ * data is split into chunks which are compressed separately (by the threads
+ * in the pool, if it is not NULL) and written out in order as a series of
+ * concatenated streams; except that if the codec is bzip2 and pool is NULL,
+ * a single bzip2 stream is written.
+ */
+struct codec_write *
+codec_write_open(int codec, FILE * f, struct parallel_pool * pool)
+{
+	struct codec_write * W;
+	int bz2err;
+
+	/* Make sure we can compress with this codec. */
+	if (!codec_supported(codec)) {
+		warn0("Compression codec not supported: %d", codec);
+		goto err0;
+	}
+
+	/* Allocate a structure. */
+	if ((W = malloc(sizeof(struct codec_write))) == NULL)
+		goto err0;
+	W->codec = codec;
+	W->f = f;
+	W->pool = pool;
+	W->fbz2 = NULL;
+	W->cur = 0;
+	W->nsent = 0;
+
+	/* Without threads, bzip2 data can be written as a single stream. */
+	if ((codec == CODEC_BZIP2) && (pool == NULL)) {
+		if ((W->fbz2 = BZ2_bzWriteOpen(&bz2err, f, 9, 0, 0)) == NULL) {
+			warn0("BZ2_bzWriteOpen failed: %d", bz2err);
+			goto err1;
+		}
+		goto done;
+	}
+
+	/* Figure out how large our chunks and batches are. */
+	W->chunklen = (codec == CODEC_BZIP2) ? CHUNKLEN_BZIP2 : CHUNKLEN;
+	if (pool != NULL)
+		W->maxchunks = BATCHCHUNKS * parallel_pool_nthreads(pool);
+	else
+		W->maxchunks = 1;
+
+	/* Allocate buffers for two batches of chunks. */
+	if (allocbatch(W, &W->batches[0]))
+		goto err1;
+	if (allocbatch(W, &W->batches[1]))
+		goto err2;
+
+done:
+	/* Success! */
+	return (W);
+
+err2:
+	freebatch(W, &W->batches[0]);
+err1:
+	free(W);
+err0:
+	/* Failure! */
+	return (NULL);
+}
+
+/**
+ * codec_write_memusage(codec, nthreads, nstreams):
+ * Return an estimate of the memory used by nstreams codec_write states open
+ * at once for the specified codec, sharing a pool of nthreads threads (or
+ * opened with a NULL pool if nthreads is zero): their chunk buffers, and the
+ * state of each compressor which can be running at once.
+ */
+size_t
+codec_write_memusage(int codec, size_t nthreads, size_t nstreams)
+{
+	size_t chunklen, maxchunks, ncompressors;
+
+	/* Without threads, each bzip2 stream has its own compressor. */
+	if ((codec == CODEC_BZIP2) && (nthreads == 0))
+		return (nstreams * codec_compress_memusage(codec,
+		    CHUNKLEN_BZIP2));
+
+	/* Each stream has two batches of chunks, as in codec_write_open. */
+	chunklen = (codec == CODEC_BZIP2) ? CHUNKLEN_BZIP2 : CHUNKLEN;
+	maxchunks = (nthreads > 0) ? BATCHCHUNKS * nthreads : 1;
+
+	/* Each pool thread, or else the calling thread, compresses a chunk. */
+	ncompressors = (nthreads > 0) ? nthreads : 1;
+
+	return (nstreams * 2 * maxchunks *
+	    (chunklen + codec_bound(codec, chunklen)) +
+	    ncompressors * codec_compress_memusage(codec, chunklen));
+}
+
+/**
+ * codec_write_write(W, buf, len):
+ * Compress buf[0 .. len - 1] and write it out.
+ */
+int
+codec_write_write(struct codec_write * W, const uint8_t * buf, size_t len)
+{
+	struct batch * batch;
+	struct chunk * C;
+	size_t clen;
+	int bz2err;
+
+	/* If we're writing a single stream, hand the data to libbz2. */
+	if (W->fbz2 != NULL) {
+		/*
+		 * The bz2 library API is broken, in that it takes a write
+		 * buffer as a "void *" instead of a "const void *".  Since
+		 * we're writing const buffers, we need to "de-const-ify" the
+		 * pointer.
+		 */
+		BZ2_bzWrite(&bz2err, W->fbz2, (void *)(uintptr_t)(buf), len);
+		if (bz2err != BZ_OK) {
+			warn0("BZ2_bzWrite failed: %d", bz2err);
+			goto err0;
+		}
+		goto done;
+	}
+
+	/* Copy data into chunks, sending batches off as they fill up. */
+	while (len > 0) {
+		batch = &W->batches[W->cur];
+		C = &batch->chunks[batch->nchunks];
+
+		/* Copy as much as fits into this chunk. */
+		clen = W->chunklen - C->inlen;
+		if (clen > len)
+			clen = len;
+		memcpy(&C->in[C->inlen], buf, clen);
+		C->inlen += clen;
+		buf += clen;
+		len -= clen;
+
+		/* Move on to the next chunk if this one is full. */
+		if (C->inlen == W->chunklen) {
+			batch->nchunks++;
+			if ((batch->nchunks == W->maxchunks) && sendbatch(W))
+				goto err0;
+		}
+	}
+
+done:
+	/* Success! */
+	return (0);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/**
+ * codec_write_close(W, abandon):
+ * Finish writing compressed data and free the state.  If abandon is
+ * non-zero, don't bother writing out any data which is still buffered.
+ */
+int
+codec_write_close(struct codec_write * W, int abandon)
+{
+	struct batch * batch;
+	int bz2err;
+	int rc = 0;
+
+	/* If we're writing a single stream, finish it. */
+	if (W->fbz2 != NULL) {
+		BZ2_bzWriteClose(&bz2err, W->fbz2, abandon, NULL, NULL);
+		if (!abandon && (bz2err != BZ_OK)) {
+			warn0("BZ2_bzWriteClose failed: %d", bz2err);
+			rc = -1;
+		}
+		goto done;
+	}
+
+	/*
+	 * Send off the final partial chunk.  If we haven't sent anything
+	 * yet, send it even if it's empty, since we need to write out at
+	 * least one stream.
+	 */
+	batch = &W->batches[W->cur];
+	if (!abandon && (batch->nchunks < W->maxchunks) &&
+	    ((batch->chunks[batch->nchunks].inlen > 0) ||
+	    (W->nsent + batch->nchunks == 0)))
+		batch->nchunks++;
+	if (!abandon && (batch->nchunks > 0) && sendbatch(W)) {
+		abandon = 1;
+		rc = -1;
+	}
+
+	/* Wait for the last batch, and write it out if we're not giving up. */
+	batch = &W->batches[1 - W->cur];
+	if (batch->job != NULL) {
+		if (abandon)
+			parallel_pool_wait(batch->job);
+		else if (finishbatch(W, batch))
+			rc = -1;
+	}
+
+	/* Free the batches. */
+	freebatch(W, &W->batches[0]);
+	freebatch(W, &W->batches[1]);
+
+done:
+	/* Free the structure. */
+	free(W);
+
+	/* Return status. */
+	return (rc);
+}
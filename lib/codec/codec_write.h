@@ -0,0 +1,69 @@
+/*-
+ * Copyright (c) 2012 Colin Percival
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _CODEC_WRITE_H_
+#define _CODEC_WRITE_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* Opaque types. */
+struct codec_write;
+struct parallel_pool;
+
+/**
+ * codec_write_open(codec, f, pool):
+ * Start writing data compressed with the specified codec to the file f.  The
+ * data is split into chunks which are compressed separately (by the threads
+ * in the pool, if it is not NULL) and written out in order as a series of
+ * concatenated streams; except that if the codec is bzip2 and pool is NULL,
+ * a single bzip2 stream is written.
+ */
+struct codec_write * codec_write_open(int, FILE *, struct parallel_pool *);
+
+/**
+ * codec_write_memusage(codec, nthreads, nstreams):
+ * Return an estimate of the memory used by nstreams codec_write states open
+ * at once for the specified codec, sharing a pool of nthreads threads (or
+ * opened with a NULL pool if nthreads is zero): their chunk buffers, and the
+ * state of each compressor which can be running at once.
+ */
+size_t codec_write_memusage(int, size_t, size_t);
+
+/**
+ * codec_write_write(W, buf, len):
+ * Compress buf[0 .. len - 1] and write it out.
+ */
+int codec_write_write(struct codec_write *, const uint8_t *, size_t);
+
+/**
+ * codec_write_close(W, abandon):
+ * Finish writing compressed data and free the state.  If abandon is
+ * non-zero, don't bother writing out any data which is still buffered.
+ */
+int codec_write_close(struct codec_write *, int);
+
+#endif /* !_CODEC_WRITE_H_ */
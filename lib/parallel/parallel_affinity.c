@@ -0,0 +1,217 @@
+/*-
+ * Copyright (c) 2012 Colin Percival
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <sys/types.h>
+#ifdef __FreeBSD__
+#include <sys/param.h>
+#include <sys/cpuset.h>
+#endif
+
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#ifdef __FreeBSD__
+#include <pthread_np.h>
+#endif
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "warnp.h"
+
+#include "parallel_affinity.h"
+
+#if defined(__linux__)
+typedef cpu_set_t cpumask_t;
+#define NCPUS_MAX CPU_SETSIZE
+#elif defined(__FreeBSD__)
+typedef cpuset_t cpumask_t;
+#define NCPUS_MAX CPU_SETSIZE
+#endif
+
+#ifdef NCPUS_MAX
+/*
+ * Return the NUMA node which the specified CPU belongs to, as numbered by
+ * the operating system; or zero if we can't tell.
+ */
+static int
+cpunode(int cpu)
+{
+#ifdef __linux__
+	char path[64];
+	DIR * dir;
+	struct dirent * dp;
+	int node = 0;
+
+	/* Linux puts a "nodeN" link into the sysfs directory for each CPU. */
+	snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+	if ((dir = opendir(path)) == NULL)
+		return (0);
+	while ((dp = readdir(dir)) != NULL) {
+		if (sscanf(dp->d_name, "node%d", &node) == 1)
+			break;
+	}
+	closedir(dir);
+
+	/* Return the node we found, if any. */
+	return (node);
+#else
+	(void)cpu; /* UNUSED */
+
+	/* We don't know how to find NUMA nodes on this platform. */
+	return (0);
+#endif
+}
+
+/* Comparison function for sorting CPUs by (node, cpu). */
+static int
+cpucmp(const void * _a, const void * _b)
+{
+	const struct parallel_affinity_cpu * a = _a;
+	const struct parallel_affinity_cpu * b = _b;
+
+	if (a->node != b->node)
+		return ((a->node < b->node) ? -1 : 1);
+	return ((a->cpu > b->cpu) - (a->cpu < b->cpu));
+}
+#endif
+
+/**
+ * parallel_affinity_cpus(cpus, ncpus, nnodes):
+ * Set ${cpus} to a malloced array listing the ${ncpus} CPUs on which this
+ * process may run, sorted by NUMA node, and set ${nnodes} to the number of
+ * NUMA nodes they belong to.  If CPU affinity is not supported on this
+ * platform, set ${ncpus} to zero.
+ */
+int
+parallel_affinity_cpus(struct parallel_affinity_cpu ** cpus, size_t * ncpus,
+    size_t * nnodes)
+{
+#ifdef NCPUS_MAX
+	struct parallel_affinity_cpu * C;
+	cpumask_t mask;
+	size_t n, i;
+	size_t node, osnode = 0;
+	int cpu;
+
+	/* Find out which CPUs we're allowed to run on. */
+	CPU_ZERO(&mask);
+#if defined(__linux__)
+	if (sched_getaffinity(0, sizeof(mask), &mask)) {
+		warnp("sched_getaffinity");
+		goto err0;
+	}
+#else
+	if (cpuset_getaffinity(CPU_LEVEL_WHICH, CPU_WHICH_PID, -1,
+	    sizeof(mask), &mask)) {
+		warnp("cpuset_getaffinity");
+		goto err0;
+	}
+#endif
+
+	/* Allocate an array. */
+	if ((C = malloc(NCPUS_MAX * sizeof(struct parallel_affinity_cpu)))
+	    == NULL)
+		goto err0;
+
+	/* Record each CPU and the NUMA node it is attached to. */
+	for (n = 0, cpu = 0; cpu < NCPUS_MAX; cpu++) {
+		if (!CPU_ISSET(cpu, &mask))
+			continue;
+		C[n].cpu = cpu;
+		C[n].node = cpunode(cpu);
+		n++;
+	}
+
+	/* Sort by node, then renumber the nodes to remove any gaps. */
+	qsort(C, n, sizeof(struct parallel_affinity_cpu), cpucmp);
+	for (node = 0, i = 0; i < n; i++) {
+		if ((i > 0) && (C[i].node != osnode))
+			node++;
+		osnode = C[i].node;
+		C[i].node = node;
+	}
+
+	/* Return the list. */
+	*cpus = C;
+	*ncpus = n;
+	*nnodes = (n > 0) ? node + 1 : 0;
+
+	/* Success! */
+	return (0);
+
+err0:
+	/* Failure! */
+	return (-1);
+#else
+	/* We don't know how to set CPU affinity on this platform. */
+	*cpus = NULL;
+	*ncpus = 0;
+	*nnodes = 0;
+	return (0);
+#endif
+}
+
+/**
+ * parallel_affinity_pin(cpu):
+ * Restrict the calling thread to running on the specified CPU.
+ */
+int
+parallel_affinity_pin(int cpu)
+{
+#ifdef NCPUS_MAX
+	cpumask_t mask;
+
+	/* Construct a mask containing just the one CPU. */
+	CPU_ZERO(&mask);
+	CPU_SET(cpu, &mask);
+
+	/* Apply it to this thread. */
+	if ((errno = pthread_setaffinity_np(pthread_self(), sizeof(mask),
+	    &mask)) != 0) {
+		warnp("pthread_setaffinity_np");
+		goto err0;
+	}
+
+	/* Success! */
+	return (0);
+
+err0:
+	/* Failure! */
+	return (-1);
+#else
+	(void)cpu; /* UNUSED */
+
+	/* We don't know how to set CPU affinity on this platform. */
+	errno = ENOTSUP;
+	return (-1);
+#endif
+}
@@ -24,18 +24,31 @@
  * SUCH DAMAGE.
  */
 
-#ifndef _PARALLEL_ITER_H_
-#define _PARALLEL_ITER_H_
+#ifndef _PARALLEL_AFFINITY_H_
+#define _PARALLEL_AFFINITY_H_
 
 #include <stddef.h>
 
+/* A CPU on which we can run. */
+struct parallel_affinity_cpu {
+	int cpu;	/* CPU number. */
+	size_t node;	/* NUMA node, numbered from 0 with no gaps. */
+};
+
+/**
+ * parallel_affinity_cpus(cpus, ncpus, nnodes):
+ * Set ${cpus} to a malloced array listing the ${ncpus} CPUs on which this
+ * process may run, sorted by NUMA node, and set ${nnodes} to the number of
+ * NUMA nodes they belong to.  If CPU affinity is not supported on this
+ * platform, set ${ncpus} to zero.
+ */
+int parallel_affinity_cpus(struct parallel_affinity_cpu **, size_t *,
+    size_t *);
+
 /**
- * parallel_iter(P, N, func, cookie):
- * Using P threads, invoke func(cookie, i) for each i in [0, N).  Return -1 on
- * internal error; zero if all the function calls return zero; or one of the
- * non-zero values returned by func.  On internal error there may still be
- * threads running and invoking func().
+ * parallel_affinity_pin(cpu):
+ * Restrict the calling thread to running on the specified CPU.
  */
-int parallel_iter(size_t, size_t, int (*)(void *, size_t), void *);
+int parallel_affinity_pin(int);
 
-#endif /* !_PARALLEL_ITER_H_ */
+#endif /* !_PARALLEL_AFFINITY_H_ */
@@ -0,0 +1,917 @@
+/*-
+ * Copyright (c) 2012 Colin Percival
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "warnp.h"
+
+#include "parallel_affinity.h"
+
+#include "parallel_pool.h"
+
+/*
+ * A range [lo, hi) of calls which have not been claimed yet, packed into a
+ * single 64-bit word so that it can be updated with compare-and-swap.
+ */
+#define RANGE(lo, hi)	(((uint64_t)(hi) << 32) | (uint64_t)(lo))
+#define RANGE_LO(r)	((size_t)((r) & 0xffffffff))
+#define RANGE_HI(r)	((size_t)((r) >> 32))
+
+/*
+ * The range of calls belonging to one worker thread.  Padded to a cache line
+ * so that worker threads claiming calls from their own ranges don't fight
+ * over cache lines.
+ */
+struct range {
+	_Atomic uint64_t r;
+	uint8_t pad[64 - sizeof(uint64_t)];
+};
+
+/* A job: a set of function calls to make. */
+struct parallel_pool_job {
+	/* Parameters: Initialized and never modified. */
+	struct parallel_pool * pool;
+	size_t N;
+	int (*func)(void *, size_t);
+	void * cookie;
+
+	/*
+	 * Calls which have not been claimed yet.  Each worker thread claims
+	 * calls from the front of its own range; when that runs out, it steals
+	 * the back half of the largest range belonging to another thread.
+	 * These are accessed without holding any locks.
+	 */
+	struct range * ranges;
+	atomic_size_t nleft;
+
+	/* Non-zero if a call has failed and the rest should be skipped. */
+	atomic_int cancelled;
+
+	/* The rest of the structure is protected by the pool mutex. */
+
+	/* Number of calls to func which have returned or been skipped. */
+	size_t ndone;
+
+	/* Number of worker threads holding a pointer to this job. */
+	size_t nworkers;
+
+	/* A function return code, if non-zero. */
+	int rc;
+
+	/* Non-zero if a worker thread hit an internal error. */
+	int failed;
+
+	/* Statistics. */
+	double tbusy;		/* Time spent in func. */
+	size_t nsteals;		/* Number of ranges stolen. */
+
+	/* Next job in the queue of jobs with work left to hand out. */
+	struct parallel_pool_job * next;
+};
+
+/* A worker thread. */
+struct worker {
+	struct parallel_pool * pool;
+	size_t id;
+	pthread_t thr;
+	int cpu;		/* CPU to pin to, or -1. */
+	size_t node;		/* NUMA node of that CPU. */
+};
+
+/* Thread pool. */
+struct parallel_pool {
+	/* Worker threads. */
+	size_t P;
+	struct worker * workers;
+
+	/* Number of NUMA nodes the worker threads are spread across. */
+	size_t nnodes;
+
+	/* Protects the rest of the structure and all queued jobs. */
+	pthread_mutex_t mtx;
+
+	/* Signalled when work is queued or the pool is shutting down. */
+	pthread_cond_t workcond;
+
+	/* Signalled when a job completes. */
+	pthread_cond_t donecond;
+
+	/* Queue of jobs which have calls left to hand out. */
+	struct parallel_pool_job * head;
+	struct parallel_pool_job ** tailp;
+
+	/* Non-zero if the worker threads should exit. */
+	int shutdown;
+
+	/* Number of jobs which have been submitted but not completed. */
+	size_t njobs;
+
+	/* Statistics accumulated from completed jobs. */
+	double tbusy;
+	size_t nsteals;
+
+	/*
+	 * Total length of the periods during which jobs were outstanding, and
+	 * when the current period started (if njobs > 0).  Jobs may overlap,
+	 * so we measure idleness over these periods rather than per job.
+	 */
+	double twall;
+	double tstart;
+};
+
+/* Return the current time in seconds. */
+static double
+now(void)
+{
+	struct timespec tp;
+
+	/* This can't fail with a valid clock ID and pointer. */
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return (tp.tv_sec + tp.tv_nsec * 0.000000001);
+}
+
+/*
+ * Claim a range [*start, *end) of calls from the front of worker thread w's
+ * range, or return zero if it is empty.  We take a fraction of what's left
+ * ("guided" scheduling) so that calls are claimed in large chunks at first,
+ * keeping the number of atomic operations low when calls are cheap; and one
+ * at a time at the end, so that the tail of the range can still be stolen.
+ */
+static int
+claim(struct parallel_pool_job * job, size_t w, size_t * start, size_t * end)
+{
+	uint64_t r;
+	size_t lo, hi, n;
+
+	/* Try to advance the start of the range until we succeed. */
+	r = atomic_load(&job->ranges[w].r);
+	do {
+		lo = RANGE_LO(r);
+		hi = RANGE_HI(r);
+
+		/* Is there anything left? */
+		if (lo >= hi)
+			return (0);
+
+		/* Take 1 / (2P) of what's left, or at least one call. */
+		n = (hi - lo) / (2 * job->pool->P);
+		if (n == 0)
+			n = 1;
+	} while (!atomic_compare_exchange_weak(&job->ranges[w].r, &r,
+	    RANGE(lo + n, hi)));
+
+	/* We've got some work. */
+	*start = lo;
+	*end = lo + n;
+	return (1);
+}
+
+/*
+ * Steal the back half of the largest range belonging to another thread and
+ * make it worker thread w's range, which must be empty.  Return zero if there
+ * is nothing left to steal.
+ */
+static int
+steal(struct parallel_pool_job * job, size_t w)
+{
+	uint64_t r, rbest;
+	size_t v, vbest;
+	size_t lo, hi, mid;
+
+	do {
+		/* Find the thread with the most calls left. */
+		rbest = RANGE(0, 0);
+		vbest = w;
+		for (v = 0; v < job->pool->P; v++) {
+			r = atomic_load(&job->ranges[v].r);
+			if (RANGE_HI(r) - RANGE_LO(r) >
+			    RANGE_HI(rbest) - RANGE_LO(rbest)) {
+				rbest = r;
+				vbest = v;
+			}
+		}
+
+		/* If every range is empty, there's nothing to steal. */
+		if (vbest == w)
+			return (0);
+
+		/* Try to take [mid, hi), leaving [lo, mid) for the owner. */
+		lo = RANGE_LO(rbest);
+		hi = RANGE_HI(rbest);
+		mid = lo + (hi - lo) / 2;
+	} while (!atomic_compare_exchange_strong(&job->ranges[vbest].r,
+	    &rbest, RANGE(lo, mid)));
+
+	/*
+	 * Make what we took into our range.  Nobody else stores into our
+	 * range, and our range is empty so nobody can steal from it; so we
+	 * can simply overwrite it.
+	 */
+	atomic_store(&job->ranges[w].r, RANGE(mid, hi));
+
+	/* Success! */
+	return (1);
+}
+
+/*
+ * Remove the job from the queue.  This is called by the thread which claims
+ * the last call in the job; the job must be at the head of the queue, since
+ * jobs are only ever removed by that thread and it took the job from the
+ * head.
+ */
+static int
+dequeue(struct parallel_pool_job * job)
+{
+	struct parallel_pool * pool = job->pool;
+
+	if ((errno = pthread_mutex_lock(&pool->mtx)) != 0) {
+		warnp("pthread_mutex_lock");
+		goto err0;
+	}
+	assert(pool->head == job);
+	if ((pool->head = job->next) == NULL)
+		pool->tailp = &pool->head;
+	if ((errno = pthread_mutex_unlock(&pool->mtx)) != 0) {
+		warnp("pthread_mutex_unlock");
+		goto err0;
+	}
+
+	/* Success! */
+	return (0);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/*
+ * Note that n calls have been claimed from the job, and dequeue the job if
+ * those were the last ones.
+ */
+static int
+claimed(struct parallel_pool_job * job, size_t n)
+{
+
+	if (atomic_fetch_sub(&job->nleft, n) == n)
+		return (dequeue(job));
+	else
+		return (0);
+}
+
+/*
+ * Mark the job as cancelled and claim every call which is left in any of the
+ * worker threads' ranges, adding the number of calls claimed to *ndone.  A
+ * thread which is part-way through stealing will still put the calls it
+ * stole into its range; but it will skip them when it sees that the job has
+ * been cancelled.
+ */
+static int
+cancel(struct parallel_pool_job * job, size_t * ndone)
+{
+	uint64_t r;
+	size_t v;
+
+	/* Stop threads from starting any more calls. */
+	atomic_store(&job->cancelled, 1);
+
+	/* Empty the ranges. */
+	for (v = 0; v < job->pool->P; v++) {
+		r = atomic_exchange(&job->ranges[v].r, RANGE(0, 0));
+		if (RANGE_LO(r) >= RANGE_HI(r))
+			continue;
+		*ndone += RANGE_HI(r) - RANGE_LO(r);
+		if (claimed(job, RANGE_HI(r) - RANGE_LO(r)))
+			goto err0;
+	}
+
+	/* Success! */
+	return (0);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/*
+ * Make as many calls from the job as worker thread w can, adding the number
+ * of calls made or skipped to *ndone, the time spent making them to *tbusy,
+ * and the number of ranges stolen to *nsteals; and recording any non-zero
+ * return code in *rcp.  Return -1 on internal error.
+ */
+static int
+runjob(struct parallel_pool_job * job, size_t w, size_t * ndone,
+    double * tbusy, size_t * nsteals, int * rcp)
+{
+	size_t start, end;
+	double t0;
+	size_t i;
+	int rc;
+
+	/* Keep claiming chunks of work until there's none left. */
+	do {
+		/* Grab some work from our range, or steal some. */
+		if (!claim(job, w, &start, &end)) {
+			if (!steal(job, w))
+				break;
+			*nsteals += 1;
+			continue;
+		}
+		if (claimed(job, end - start))
+			goto err0;
+
+		/*
+		 * Call the function until we run out of work or the job is
+		 * cancelled.  If a call fails, record the status and cancel
+		 * the job.
+		 */
+		t0 = now();
+		for (i = start; i < end; i++) {
+			if (atomic_load_explicit(&job->cancelled,
+			    memory_order_relaxed))
+				break;
+			if ((rc = (job->func)(job->cookie, i)) != 0) {
+				*rcp = rc;
+				if (cancel(job, ndone))
+					goto err0;
+			}
+		}
+		*tbusy += now() - t0;
+		*ndone += end - start;
+	} while (1);
+
+	/* Success! */
+	return (0);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/* Thread entry point. */
+static void *
+workthread(void * cookie)
+{
+	struct worker * worker = cookie;
+	struct parallel_pool * pool = worker->pool;
+	struct parallel_pool_job * job;
+	size_t ndone, nsteals;
+	double tbusy;
+	int rc;
+	int failed;
+
+	/* Pin ourselves to a CPU if requested; carry on if we can't. */
+	if (worker->cpu != -1)
+		parallel_affinity_pin(worker->cpu);
+
+	/* Pick up the lock. */
+	if ((errno = pthread_mutex_lock(&pool->mtx)) != 0) {
+		warnp("pthread_mutex_lock");
+		goto err0;
+	}
+
+	/* Loop until we're told to shut down. */
+	do {
+		/* Wait until there's a job or we're told to shut down. */
+		while ((pool->head == NULL) && !pool->shutdown) {
+			if ((errno = pthread_cond_wait(&pool->workcond,
+			    &pool->mtx)) != 0) {
+				warnp("pthread_cond_wait");
+				goto err1;
+			}
+		}
+
+		/* If there's no work left, we're shutting down. */
+		if ((job = pool->head) == NULL)
+			break;
+
+		/* Make sure the job sticks around while we're using it. */
+		job->nworkers++;
+
+		/* Drop the lock while we work. */
+		if ((errno = pthread_mutex_unlock(&pool->mtx)) != 0) {
+			warnp("pthread_mutex_unlock");
+			goto err0;
+		}
+
+		/* Do as much of the job as we can. */
+		ndone = nsteals = 0;
+		tbusy = 0;
+		rc = 0;
+		failed = 0;
+		if (runjob(job, worker->id, &ndone, &tbusy, &nsteals, &rc)) {
+			/*
+			 * Some calls may never be counted as done, so stop
+			 * the other threads from starting any more, and tell
+			 * the waiter below that the job has failed.
+			 */
+			cancel(job, &ndone);
+			failed = 1;
+		}
+
+		/* Pick up the lock again. */
+		if ((errno = pthread_mutex_lock(&pool->mtx)) != 0) {
+			warnp("pthread_mutex_lock");
+			goto err0;
+		}
+
+		/* Record what we did. */
+		job->ndone += ndone;
+		job->tbusy += tbusy;
+		job->nsteals += nsteals;
+		if (rc)
+			job->rc = rc;
+		if (failed)
+			job->failed = 1;
+
+		/* Is the job finished (or will it never finish)? */
+		if ((--job->nworkers == 0) &&
+		    ((job->ndone == job->N) || job->failed)) {
+			/* Record statistics. */
+			pool->tbusy += job->tbusy;
+			pool->nsteals += job->nsteals;
+			if (--pool->njobs == 0)
+				pool->twall += now() - pool->tstart;
+
+			/* Wake up anyone waiting for it. */
+			if ((errno =
+			    pthread_cond_broadcast(&pool->donecond)) != 0) {
+				warnp("pthread_cond_broadcast");
+				goto err1;
+			}
+		}
+
+		/* Give up if we failed. */
+		if (failed)
+			goto err1;
+	} while (1);
+
+	/* We're shutting down.  Release the lock. */
+	if ((errno = pthread_mutex_unlock(&pool->mtx)) != 0) {
+		warnp("pthread_mutex_unlock");
+		goto err0;
+	}
+
+	/* Success! */
+	return (pool);
+
+err1:
+	pthread_mutex_unlock(&pool->mtx);
+err0:
+	/* Failure! */
+	return (NULL);
+}
+
+/* Tell the first n worker threads to exit, and wait for them. */
+static int
+stopthreads(struct parallel_pool * pool, size_t n)
+{
+	void * value_ptr;
+	size_t i;
+	int rc = 0;
+
+	/* Tell the worker threads to shut down. */
+	if ((errno = pthread_mutex_lock(&pool->mtx)) != 0) {
+		warnp("pthread_mutex_lock");
+		goto err0;
+	}
+	pool->shutdown = 1;
+	if ((errno = pthread_cond_broadcast(&pool->workcond)) != 0) {
+		warnp("pthread_cond_broadcast");
+		pthread_mutex_unlock(&pool->mtx);
+		goto err0;
+	}
+	if ((errno = pthread_mutex_unlock(&pool->mtx)) != 0) {
+		warnp("pthread_mutex_unlock");
+		goto err0;
+	}
+
+	/* Wait for the threads to exit. */
+	for (i = 0; i < n; i++) {
+		if ((errno = pthread_join(pool->workers[i].thr,
+		    &value_ptr)) != 0) {
+			warnp("pthread_join");
+			goto err0;
+		}
+
+		/* The thread returns NULL on internal error. */
+		if (value_ptr == NULL)
+			rc = -1;
+	}
+
+	/* Return status from the threads. */
+	return (rc);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/* Decide which CPU each worker thread should be pinned to. */
+static int
+assigncpus(struct parallel_pool * pool)
+{
+	struct parallel_affinity_cpu * cpus;
+	size_t ncpus, nnodes;
+	size_t i, j;
+
+	/* Get a list of CPUs, grouped by NUMA node. */
+	if (parallel_affinity_cpus(&cpus, &ncpus, &nnodes))
+		goto err0;
+
+	/* If we can't pin threads on this platform, don't. */
+	if (ncpus == 0) {
+		warn0("CPU affinity is not supported on this platform");
+		return (0);
+	}
+
+	/*
+	 * Spread the threads evenly across the list, so that threads with
+	 * consecutive IDs -- which start with adjacent ranges of work -- are
+	 * on the same NUMA node, and all the nodes get used even if we have
+	 * fewer threads than CPUs.
+	 */
+	for (i = 0; i < pool->P; i++) {
+		if (pool->P <= ncpus)
+			j = i * ncpus / pool->P;
+		else
+			j = i % ncpus;
+		pool->workers[i].cpu = cpus[j].cpu;
+		pool->workers[i].node = cpus[j].node;
+	}
+
+	/* The last thread is on the highest-numbered node we're using. */
+	pool->nnodes = pool->workers[pool->P - 1].node + 1;
+	if (pool->P > ncpus)
+		pool->nnodes = nnodes;
+
+	/* Free the list. */
+	free(cpus);
+
+	/* Success! */
+	return (0);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/**
+ * parallel_pool_create(P, flags):
+ * Launch P worker threads and return a pool which can be used to run jobs
+ * submitted via parallel_pool_submit.  If ${flags} includes PARALLEL_POOL_PIN,
+ * pin each thread to a CPU, placing threads with adjacent work on the same
+ * NUMA node.
+ */
+struct parallel_pool *
+parallel_pool_create(size_t P, int flags)
+{
+	struct parallel_pool * pool;
+	size_t i;
+
+	/* Sanity-check. */
+	assert(P > 0);
+
+	/* Allocate a pool structure. */
+	if ((pool = malloc(sizeof(struct parallel_pool))) == NULL)
+		goto err0;
+	pool->P = P;
+	pool->nnodes = 1;
+	pool->head = NULL;
+	pool->tailp = &pool->head;
+	pool->shutdown = 0;
+	pool->njobs = 0;
+	pool->tbusy = 0;
+	pool->nsteals = 0;
+	pool->twall = pool->tstart = 0;
+
+	/* Allocate space for worker thread structures. */
+	if ((pool->workers = malloc(P * sizeof(struct worker))) == NULL)
+		goto err1;
+	for (i = 0; i < P; i++) {
+		pool->workers[i].pool = pool;
+		pool->workers[i].id = i;
+		pool->workers[i].cpu = -1;
+		pool->workers[i].node = 0;
+	}
+
+	/* Figure out where to run the threads, if we've been asked to. */
+	if ((flags & PARALLEL_POOL_PIN) && assigncpus(pool))
+		goto err2;
+
+	/* Create the mutex and condition variables. */
+	if ((errno = pthread_mutex_init(&pool->mtx, NULL)) != 0) {
+		warnp("pthread_mutex_init");
+		goto err2;
+	}
+	if ((errno = pthread_cond_init(&pool->workcond, NULL)) != 0) {
+		warnp("pthread_cond_init");
+		goto err3;
+	}
+	if ((errno = pthread_cond_init(&pool->donecond, NULL)) != 0) {
+		warnp("pthread_cond_init");
+		goto err4;
+	}
+
+	/* Launch P threads. */
+	for (i = 0; i < P; i++) {
+		if ((errno = pthread_create(&pool->workers[i].thr, NULL,
+		    workthread, &pool->workers[i])) != 0) {
+			warnp("pthread_create");
+			goto err6;
+		}
+	}
+
+	/* Success! */
+	return (pool);
+
+err6:
+	stopthreads(pool, i);
+	pthread_cond_destroy(&pool->donecond);
+err4:
+	pthread_cond_destroy(&pool->workcond);
+err3:
+	pthread_mutex_destroy(&pool->mtx);
+err2:
+	free(pool->workers);
+err1:
+	free(pool);
+err0:
+	/* Failure! */
+	return (NULL);
+}
+
+/**
+ * parallel_pool_nthreads(pool):
+ * Return the number of worker threads in the pool.
+ */
+size_t
+parallel_pool_nthreads(const struct parallel_pool * pool)
+{
+
+	return (pool->P);
+}
+
+/**
+ * parallel_pool_nnodes(pool):
+ * Return the number of NUMA nodes which the worker threads are pinned to, or
+ * one if the threads are not pinned to CPUs.
+ */
+size_t
+parallel_pool_nnodes(const struct parallel_pool * pool)
+{
+
+	return (pool->nnodes);
+}
+
+/**
+ * parallel_pool_node(pool):
+ * If called from one of the pool's worker threads, return the NUMA node (in
+ * the range [0, parallel_pool_nnodes(pool))) which it is pinned to; otherwise,
+ * return zero.
+ */
+size_t
+parallel_pool_node(const struct parallel_pool * pool)
+{
+	pthread_t self = pthread_self();
+	size_t i;
+
+	/* Look for the calling thread. */
+	for (i = 0; i < pool->P; i++) {
+		if (pthread_equal(pool->workers[i].thr, self))
+			return (pool->workers[i].node);
+	}
+
+	/* Not one of our threads. */
+	return (0);
+}
+
+/**
+ * parallel_pool_submit(pool, N, func, cookie):
+ * Queue a job which invokes func(cookie, i) for each i in [0, N) using the
+ * worker threads in the pool.  Return a handle which must be passed to
+ * parallel_pool_wait, or NULL on error.  The calls are initially divided
+ * evenly between the threads in order (so thread #0 starts at i = 0, thread
+ * #1 starts at i = N / P, etc.), and threads steal work from each other as
+ * needed.
+ * Jobs are started in the order they are submitted; func must not wait for a
+ * job submitted to the same pool.  N must be less than 2^32.
+ */
+struct parallel_pool_job *
+parallel_pool_submit(struct parallel_pool * pool, size_t N,
+    int (* func)(void *, size_t), void * cookie)
+{
+	struct parallel_pool_job * job;
+	size_t w;
+
+	/* We pack ranges of calls into 64-bit words. */
+	if (N > UINT32_MAX) {
+		errno = EINVAL;
+		goto err0;
+	}
+
+	/* Allocate and initialize a job structure. */
+	if ((job = malloc(sizeof(struct parallel_pool_job))) == NULL)
+		goto err0;
+	job->pool = pool;
+	job->N = N;
+	job->func = func;
+	job->cookie = cookie;
+	atomic_init(&job->nleft, N);
+	atomic_init(&job->cancelled, 0);
+	job->ndone = 0;
+	job->nworkers = 0;
+	job->rc = 0;
+	job->failed = 0;
+	job->tbusy = 0;
+	job->nsteals = 0;
+	job->next = NULL;
+
+	/* Split the calls evenly between the worker threads. */
+	if ((job->ranges = malloc(pool->P * sizeof(struct range))) == NULL)
+		goto err1;
+	for (w = 0; w < pool->P; w++)
+		atomic_init(&job->ranges[w].r,
+		    RANGE(N * w / pool->P, N * (w + 1) / pool->P));
+
+	/* If there's nothing to do, there's no need to queue the job. */
+	if (N == 0)
+		goto done;
+
+	/* Add the job to the end of the queue and wake up the workers. */
+	if ((errno = pthread_mutex_lock(&pool->mtx)) != 0) {
+		warnp("pthread_mutex_lock");
+		goto err2;
+	}
+	*pool->tailp = job;
+	pool->tailp = &job->next;
+	if (pool->njobs++ == 0)
+		pool->tstart = now();
+	if ((errno = pthread_cond_broadcast(&pool->workcond)) != 0) {
+		warnp("pthread_cond_broadcast");
+		goto err3;
+	}
+	if ((errno = pthread_mutex_unlock(&pool->mtx)) != 0) {
+		warnp("pthread_mutex_unlock");
+		goto err0;
+	}
+
+done:
+	/* Success! */
+	return (job);
+
+err3:
+	/*
+	 * The worker threads might have started on this job already, so we
+	 * can't take it back out of the queue; but we can't report failure
+	 * without freeing it, either.  Bail out.
+	 */
+	pthread_mutex_unlock(&pool->mtx);
+	goto err0;
+err2:
+	free(job->ranges);
+err1:
+	free(job);
+err0:
+	/* Failure! */
+	return (NULL);
+}
+
+/**
+ * parallel_pool_wait(job):
+ * Wait for all the function calls in the job to complete and free the job.
+ * Return -1 on internal error; zero if all the function calls returned zero;
+ * or one of the non-zero values returned by func.  Once any call returns a
+ * non-zero value, calls which have not yet started are skipped.
+ */
+int
+parallel_pool_wait(struct parallel_pool_job * job)
+{
+	struct parallel_pool * pool = job->pool;
+	int failed;
+	int rc;
+
+	/*
+	 * Wait until all the calls have returned, or a worker thread has
+	 * failed and the rest have let go of the job.
+	 */
+	if ((errno = pthread_mutex_lock(&pool->mtx)) != 0) {
+		warnp("pthread_mutex_lock");
+		goto err0;
+	}
+	while (((job->ndone < job->N) && !job->failed) ||
+	    (job->nworkers > 0)) {
+		if ((errno = pthread_cond_wait(&pool->donecond,
+		    &pool->mtx)) != 0) {
+			warnp("pthread_cond_wait");
+			pthread_mutex_unlock(&pool->mtx);
+			goto err0;
+		}
+	}
+	failed = job->failed;
+	if ((errno = pthread_mutex_unlock(&pool->mtx)) != 0) {
+		warnp("pthread_mutex_unlock");
+		goto err0;
+	}
+
+	/*
+	 * If a worker thread failed, the job might still be in the queue, so
+	 * we can't free it.  Bail out.
+	 */
+	if (failed)
+		goto err0;
+
+	/* Grab the return code from the job structure. */
+	rc = job->rc;
+
+	/* Nobody is holding a pointer to the job any more. */
+	free(job->ranges);
+	free(job);
+
+	/* Return the non-zero status code from a function call, if any. */
+	return (rc);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/**
+ * parallel_pool_stats(pool, tbusy, tidle, nsteals):
+ * Return statistics accumulated from the jobs completed by the pool: the
+ * total time (in seconds) worker threads spent making function calls; the
+ * total time they spent idle while jobs were outstanding (i.e., waiting for
+ * other threads to finish their parts of a job); and the number of times a
+ * thread stole work from another thread.
+ */
+void
+parallel_pool_stats(struct parallel_pool * pool, double * tbusy,
+    double * tidle, size_t * nsteals)
+{
+	double twall;
+
+	/* Read the statistics while holding the lock. */
+	if ((errno = pthread_mutex_lock(&pool->mtx)) != 0)
+		warnp("pthread_mutex_lock");
+	twall = pool->twall;
+	if (pool->njobs > 0)
+		twall += now() - pool->tstart;
+	*tbusy = pool->tbusy;
+	*tidle = twall * pool->P - pool->tbusy;
+	*nsteals = pool->nsteals;
+	if ((errno = pthread_mutex_unlock(&pool->mtx)) != 0)
+		warnp("pthread_mutex_unlock");
+}
+
+/**
+ * parallel_pool_destroy(pool):
+ * Stop the worker threads and free the pool.  All jobs submitted to the pool
+ * must have been passed to parallel_pool_wait.
+ */
+void
+parallel_pool_destroy(struct parallel_pool * pool)
+{
+
+	/* Sanity-check. */
+	assert(pool->head == NULL);
+
+	/* Stop the worker threads. */
+	stopthreads(pool, pool->P);
+
+	/* Free synchronization primitives. */
+	pthread_cond_destroy(&pool->donecond);
+	pthread_cond_destroy(&pool->workcond);
+	pthread_mutex_destroy(&pool->mtx);
+
+	/* Free the worker thread structures and the pool structure. */
+	free(pool->workers);
+	free(pool);
+}
@@ -0,0 +1,110 @@
+/*-
+ * Copyright (c) 2012 Colin Percival
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _PARALLEL_POOL_H_
+#define _PARALLEL_POOL_H_
+
+#include <stddef.h>
+
+/* Opaque types. */
+struct parallel_pool;
+struct parallel_pool_job;
+
+/* Flags for parallel_pool_create. */
+#define PARALLEL_POOL_PIN	0x1	/* Pin threads to CPUs. */
+
+/**
+ * parallel_pool_create(P, flags):
+ * Launch P worker threads and return a pool which can be used to run jobs
+ * submitted via parallel_pool_submit.  If ${flags} includes PARALLEL_POOL_PIN,
+ * pin each thread to a CPU, placing threads with adjacent work on the same
+ * NUMA node.
+ */
+struct parallel_pool * parallel_pool_create(size_t, int);
+
+/**
+ * parallel_pool_nthreads(pool):
+ * Return the number of worker threads in the pool.
+ */
+size_t parallel_pool_nthreads(const struct parallel_pool *);
+
+/**
+ * parallel_pool_nnodes(pool):
+ * Return the number of NUMA nodes which the worker threads are pinned to, or
+ * one if the threads are not pinned to CPUs.
+ */
+size_t parallel_pool_nnodes(const struct parallel_pool *);
+
+/**
+ * parallel_pool_node(pool):
+ * If called from one of the pool's worker threads, return the NUMA node (in
+ * the range [0, parallel_pool_nnodes(pool))) which it is pinned to; otherwise,
+ * return zero.
+ */
+size_t parallel_pool_node(const struct parallel_pool *);
+
+/**
+ * parallel_pool_submit(pool, N, func, cookie):
+ * Queue a job which invokes func(cookie, i) for each i in [0, N) using the
+ * worker threads in the pool.  Return a handle which must be passed to
+ * parallel_pool_wait, or NULL on error.  The calls are initially divided
+ * evenly between the threads in order (so thread #0 starts at i = 0, thread
+ * #1 starts at i = N / P, etc.), and threads steal work from each other as
+ * needed.
+ * Jobs are started in the order they are submitted; func must not wait for a
+ * job submitted to the same pool.  N must be less than 2^32.
+ */
+struct parallel_pool_job * parallel_pool_submit(struct parallel_pool *,
+    size_t, int (*)(void *, size_t), void *);
+
+/**
+ * parallel_pool_wait(job):
+ * Wait for all the function calls in the job to complete and free the job.
+ * Return -1 on internal error; zero if all the function calls returned zero;
+ * or one of the non-zero values returned by func.  Once any call returns a
+ * non-zero value, calls which have not yet started are skipped.
+ */
+int parallel_pool_wait(struct parallel_pool_job *);
+
+/**
+ * parallel_pool_stats(pool, tbusy, tidle, nsteals):
+ * Return statistics accumulated from the jobs completed by the pool: the
+ * total time (in seconds) worker threads spent making function calls; the
+ * total time they spent idle while jobs were outstanding (i.e., waiting for
+ * other threads to finish their parts of a job); and the number of times a
+ * thread stole work from another thread.
+ */
+void parallel_pool_stats(struct parallel_pool *, double *, double *,
+    size_t *);
+
+/**
+ * parallel_pool_destroy(pool):
+ * Stop the worker threads and free the pool.  All jobs submitted to the pool
+ * must have been passed to parallel_pool_wait.
+ */
+void parallel_pool_destroy(struct parallel_pool *);
+
+#endif /* !_PARALLEL_POOL_H_ */
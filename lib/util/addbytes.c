@@ -0,0 +1,130 @@
+/*-
+ * Copyright 2012 Colin Percival
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions 
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define ADDBYTES_X86
+#include <immintrin.h>
+#endif
+
+#include "addbytes.h"
+
+/* Add one byte at a time. */
+static void
+add_scalar(uint8_t * dst, const uint8_t * a, const uint8_t * b, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		dst[i] = a[i] + b[i];
+}
+
+#ifdef ADDBYTES_X86
+/* Add 16 bytes at a time using SSE2, which every x86-64 CPU has. */
+static void
+add_sse2(uint8_t * dst, const uint8_t * a, const uint8_t * b, size_t len)
+{
+	__m128i x, y;
+	size_t i;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		x = _mm_loadu_si128((const __m128i *)&a[i]);
+		y = _mm_loadu_si128((const __m128i *)&b[i]);
+		_mm_storeu_si128((__m128i *)&dst[i], _mm_add_epi8(x, y));
+	}
+	add_scalar(&dst[i], &a[i], &b[i], len - i);
+}
+
+/* Add 32 bytes at a time using AVX2. */
+__attribute__((target("avx2")))
+static void
+add_avx2(uint8_t * dst, const uint8_t * a, const uint8_t * b, size_t len)
+{
+	__m256i x, y;
+	size_t i;
+
+	for (i = 0; i + 32 <= len; i += 32) {
+		x = _mm256_loadu_si256((const __m256i *)&a[i]);
+		y = _mm256_loadu_si256((const __m256i *)&b[i]);
+		_mm256_storeu_si256((__m256i *)&dst[i], _mm256_add_epi8(x, y));
+	}
+	add_sse2(&dst[i], &a[i], &b[i], len - i);
+}
+
+/*
+ * Add 64 bytes at a time using AVX-512, and handle the last few bytes with
+ * masked loads and stores.
+ */
+__attribute__((target("avx512bw")))
+static void
+add_avx512(uint8_t * dst, const uint8_t * a, const uint8_t * b, size_t len)
+{
+	__m512i x, y;
+	__mmask64 m;
+	size_t i;
+
+	for (i = 0; i + 64 <= len; i += 64) {
+		x = _mm512_loadu_si512((const void *)&a[i]);
+		y = _mm512_loadu_si512((const void *)&b[i]);
+		_mm512_storeu_si512((void *)&dst[i], _mm512_add_epi8(x, y));
+	}
+	if (i < len) {
+		m = _cvtu64_mask64(((uint64_t)1 << (len - i)) - 1);
+		x = _mm512_maskz_loadu_epi8(m, &a[i]);
+		y = _mm512_maskz_loadu_epi8(m, &b[i]);
+		_mm512_mask_storeu_epi8(&dst[i], m, _mm512_add_epi8(x, y));
+	}
+}
+#endif
+
+/**
+ * addbytes(dst, a, b, len):
+ * Set dst[i] = a[i] + b[i] (modulo 256) for each i in [0, len).  The buffer
+ * ${dst} may be the same as ${a} or ${b}, but must not otherwise overlap
+ * them.  Vector instructions are used if the CPU supports them.
+ */
+void
+addbytes(uint8_t * dst, const uint8_t * a, const uint8_t * b, size_t len)
+{
+
+#ifdef ADDBYTES_X86
+	/* Use the widest vectors we can, unless there's hardly any work. */
+	if (len >= 16) {
+		if (__builtin_cpu_supports("avx512bw"))
+			add_avx512(dst, a, b, len);
+		else if (__builtin_cpu_supports("avx2"))
+			add_avx2(dst, a, b, len);
+		else
+			add_sse2(dst, a, b, len);
+		return;
+	}
+#endif
+
+	/* Do it the slow way. */
+	add_scalar(dst, a, b, len);
+}
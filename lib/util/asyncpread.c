@@ -0,0 +1,656 @@
+/*-
+ * Copyright 2012 Colin Percival
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions 
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "parallel_pool.h"
+#include "warnp.h"
+
+#include "asyncpread.h"
+
+/* Use io_uring if we're on Linux and have the kernel headers for it. */
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include <linux/io_uring.h>
+#include <stdatomic.h>
+
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#define USE_IO_URING
+#endif
+#endif
+#endif
+
+/* A read. */
+struct req {
+	int fd;
+	uint8_t * buf;
+	size_t len;
+	off_t offset;
+	void * cookie;
+	size_t done;		/* Bytes read so far. */
+	ssize_t res;		/* Result, once the read has completed. */
+	int err;		/* Error, if res is -1. */
+	struct iovec iov;	/* Part of buf which we're reading into. */
+	struct parallel_pool_job * job;	/* Pool job performing the read. */
+	struct asyncpread * A;
+	struct req * next;
+};
+
+/* A list of reads. */
+struct reqlist {
+	struct req * head;
+	struct req * tail;
+};
+
+#ifdef USE_IO_URING
+/* An io_uring instance and its mapped rings. */
+struct uring {
+	int fd;
+	void * sqmap;
+	size_t sqmaplen;
+	void * cqmap;
+	size_t cqmaplen;
+	struct io_uring_sqe * sqes;
+	size_t sqeslen;
+	unsigned * sqhead, * sqtail, * sqmask, * sqarray;
+	unsigned * cqhead, * cqtail, * cqmask;
+	struct io_uring_cqe * cqes;
+	unsigned tosubmit;	/* Queued SQEs not yet passed to the kernel. */
+};
+#endif
+
+/* Asynchronous read state. */
+struct asyncpread {
+	size_t depth;		/* Maximum reads in progress. */
+	size_t inflight;	/* Reads in progress or completed. */
+	struct reqlist queue;	/* Reads waiting for a slot. */
+	struct parallel_pool * pool;
+#ifdef USE_IO_URING
+	struct uring * U;	/* NULL if io_uring is not available. */
+#endif
+	pthread_mutex_t mtx;	/* Lock for done list. */
+	pthread_cond_t cv;	/* Signalled when a read completes. */
+	struct reqlist done;	/* Completed reads. */
+};
+
+/* Add a read to the end of a list. */
+static void
+reqlist_push(struct reqlist * L, struct req * R)
+{
+
+	R->next = NULL;
+	if (L->tail != NULL)
+		L->tail->next = R;
+	else
+		L->head = R;
+	L->tail = R;
+}
+
+/* Remove and return the read at the start of a list, or NULL. */
+static struct req *
+reqlist_pop(struct reqlist * L)
+{
+	struct req * R;
+
+	if ((R = L->head) != NULL) {
+		if ((L->head = R->next) == NULL)
+			L->tail = NULL;
+	}
+	return (R);
+}
+
+/* Record that a read has completed. */
+static int
+complete(struct asyncpread * A, struct req * R)
+{
+
+	/* Lock the done list. */
+	if ((errno = pthread_mutex_lock(&A->mtx)) != 0) {
+		warnp("pthread_mutex_lock");
+		goto err0;
+	}
+
+	/* Add the read, and wake up anyone waiting for it. */
+	reqlist_push(&A->done, R);
+	if ((errno = pthread_cond_signal(&A->cv)) != 0) {
+		warnp("pthread_cond_signal");
+		goto err1;
+	}
+
+	/* Unlock the done list. */
+	if ((errno = pthread_mutex_unlock(&A->mtx)) != 0) {
+		warnp("pthread_mutex_unlock");
+		goto err0;
+	}
+
+	/* Success! */
+	return (0);
+
+err1:
+	pthread_mutex_unlock(&A->mtx);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/* Perform a read synchronously. */
+static void
+readsync(struct req * R)
+{
+	ssize_t lenread;
+
+	/* Read until we have everything or reach EOF. */
+	while (R->done < R->len) {
+		if ((lenread = pread(R->fd, &R->buf[R->done], R->len - R->done,
+		    R->offset + R->done)) == -1) {
+			if (errno == EINTR)
+				continue;
+			R->res = -1;
+			R->err = errno;
+			return;
+		}
+		if (lenread == 0)
+			break;
+		R->done += lenread;
+	}
+
+	/* Record how much we read. */
+	R->res = R->done;
+}
+
+/* Perform a read.  Callback from parallel_pool. */
+static int
+doread(void * cookie, size_t i)
+{
+	struct req * R = cookie;
+
+	(void)i; /* UNUSED */
+
+	/* Do the read, then hand it back. */
+	readsync(R);
+	return (complete(R->A, R));
+}
+
+#ifdef USE_IO_URING
+/* Set up an io_uring instance with room for depth reads, or return NULL. */
+static struct uring *
+uring_init(size_t depth)
+{
+	struct io_uring_params p;
+	struct uring * U;
+	uint8_t * sq, * cq;
+
+	/* Allocate a structure. */
+	if ((U = malloc(sizeof(struct uring))) == NULL)
+		goto err0;
+	U->tosubmit = 0;
+
+	/*
+	 * Create the io_uring.  This fails on kernels older than 5.1 and in
+	 * sandboxes which forbid io_uring, in which case we quietly fall back
+	 * to performing reads with threads.
+	 */
+	memset(&p, 0, sizeof(struct io_uring_params));
+	if ((U->fd = syscall(__NR_io_uring_setup, (unsigned)depth, &p)) == -1)
+		goto err1;
+
+	/* Map the submission and completion rings. */
+	U->sqmaplen = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	U->cqmaplen = p.cq_off.cqes +
+	    p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (U->cqmaplen > U->sqmaplen)
+			U->sqmaplen = U->cqmaplen;
+		U->cqmaplen = 0;
+	}
+	if ((U->sqmap = mmap(NULL, U->sqmaplen, PROT_READ | PROT_WRITE,
+	    MAP_SHARED, U->fd, IORING_OFF_SQ_RING)) ==
+	    MAP_FAILED) {
+		warnp("mmap");
+		goto err2;
+	}
+	if (U->cqmaplen == 0) {
+		U->cqmap = U->sqmap;
+	} else if ((U->cqmap = mmap(NULL, U->cqmaplen,
+	    PROT_READ | PROT_WRITE, MAP_SHARED, U->fd,
+	    IORING_OFF_CQ_RING)) == MAP_FAILED) {
+		warnp("mmap");
+		goto err3;
+	}
+
+	/* Map the submission queue entries. */
+	U->sqeslen = p.sq_entries * sizeof(struct io_uring_sqe);
+	if ((U->sqes = mmap(NULL, U->sqeslen, PROT_READ | PROT_WRITE,
+	    MAP_SHARED, U->fd, IORING_OFF_SQES)) ==
+	    MAP_FAILED) {
+		warnp("mmap");
+		goto err4;
+	}
+
+	/* Find the ring fields. */
+	sq = U->sqmap;
+	U->sqhead = (unsigned *)(sq + p.sq_off.head);
+	U->sqtail = (unsigned *)(sq + p.sq_off.tail);
+	U->sqmask = (unsigned *)(sq + p.sq_off.ring_mask);
+	U->sqarray = (unsigned *)(sq + p.sq_off.array);
+	cq = U->cqmap;
+	U->cqhead = (unsigned *)(cq + p.cq_off.head);
+	U->cqtail = (unsigned *)(cq + p.cq_off.tail);
+	U->cqmask = (unsigned *)(cq + p.cq_off.ring_mask);
+	U->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+	/* Success! */
+	return (U);
+
+err4:
+	if (U->cqmap != U->sqmap)
+		munmap(U->cqmap, U->cqmaplen);
+err3:
+	munmap(U->sqmap, U->sqmaplen);
+err2:
+	close(U->fd);
+err1:
+	free(U);
+err0:
+	/* Failure! */
+	return (NULL);
+}
+
+/* Queue an SQE which reads the rest of R. */
+static void
+uring_read(struct uring * U, struct req * R)
+{
+	struct io_uring_sqe * sqe;
+	unsigned tail, idx;
+
+	/* Point the iovec at the part of the buffer we haven't filled. */
+	R->iov.iov_base = &R->buf[R->done];
+	R->iov.iov_len = R->len - R->done;
+
+	/* Fill in the next SQE. */
+	tail = *U->sqtail;
+	idx = tail & *U->sqmask;
+	sqe = &U->sqes[idx];
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	sqe->opcode = IORING_OP_READV;
+	sqe->fd = R->fd;
+	sqe->addr = (uintptr_t)&R->iov;
+	sqe->len = 1;
+	sqe->off = R->offset + R->done;
+	sqe->user_data = (uintptr_t)R;
+
+	/* Publish it to the kernel. */
+	U->sqarray[idx] = idx;
+	atomic_store_explicit((_Atomic unsigned *)U->sqtail, tail + 1,
+	    memory_order_release);
+	U->tosubmit++;
+}
+
+/*
+ * Pass queued SQEs to the kernel and, if wait is non-zero, wait for at least
+ * one completion.
+ */
+static int
+uring_enter(struct uring * U, int wait)
+{
+	int ret;
+
+	/* Nothing to do? */
+	if ((U->tosubmit == 0) && !wait)
+		return (0);
+
+	/* Enter the kernel, retrying if we're interrupted. */
+	do {
+		ret = syscall(__NR_io_uring_enter, U->fd, U->tosubmit,
+		    wait ? 1 : 0, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	} while ((ret == -1) && (errno == EINTR));
+	if (ret == -1) {
+		warnp("io_uring_enter");
+		goto err0;
+	}
+
+	/* The kernel might not have taken all the SQEs. */
+	U->tosubmit -= ret;
+
+	/* Success! */
+	return (0);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/*
+ * Process entries in the completion ring, resubmitting short reads and
+ * moving completed reads to the done list.
+ */
+static int
+uring_reap(struct asyncpread * A)
+{
+	struct uring * U = A->U;
+	struct io_uring_cqe * cqe;
+	struct req * R;
+	unsigned head;
+	int res;
+
+	for (head = *U->cqhead; head != atomic_load_explicit(
+	    (_Atomic unsigned *)U->cqtail, memory_order_acquire); head++) {
+		/* Grab the completion and give its slot back to the kernel. */
+		cqe = &U->cqes[head & *U->cqmask];
+		R = (struct req *)(uintptr_t)cqe->user_data;
+		res = cqe->res;
+		atomic_store_explicit((_Atomic unsigned *)U->cqhead, head + 1,
+		    memory_order_release);
+
+		/* Try again if necessary; otherwise record the result. */
+		if ((res == -EINTR) || (res == -EAGAIN)) {
+			uring_read(U, R);
+			continue;
+		} else if (res < 0) {
+			R->res = -1;
+			R->err = -res;
+		} else if ((res > 0) && (R->done + res < R->len)) {
+			R->done += res;
+			uring_read(U, R);
+			continue;
+		} else {
+			R->done += res;
+			R->res = R->done;
+		}
+		if (complete(A, R))
+			goto err0;
+	}
+
+	/* Submit any reads which we need to retry. */
+	if (uring_enter(U, 0))
+		goto err0;
+
+	/* Success! */
+	return (0);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/* Tear down an io_uring instance. */
+static void
+uring_free(struct uring * U)
+{
+
+	munmap(U->sqes, U->sqeslen);
+	if (U->cqmap != U->sqmap)
+		munmap(U->cqmap, U->cqmaplen);
+	munmap(U->sqmap, U->sqmaplen);
+	close(U->fd);
+	free(U);
+}
+#endif
+
+/* Start as many queued reads as we have room for. */
+static int
+dispatch(struct asyncpread * A)
+{
+	struct req * R;
+
+	while ((A->inflight < A->depth) &&
+	    ((R = reqlist_pop(&A->queue)) != NULL)) {
+		A->inflight++;
+#ifdef USE_IO_URING
+		if (A->U != NULL) {
+			uring_read(A->U, R);
+			continue;
+		}
+#endif
+		if (A->pool != NULL) {
+			if ((R->job = parallel_pool_submit(A->pool, 1,
+			    doread, R)) == NULL) {
+				warnp("parallel_pool_submit");
+				R->res = -1;
+				R->err = errno;
+				if (complete(A, R))
+					goto err0;
+			}
+		} else {
+			readsync(R);
+			if (complete(A, R))
+				goto err0;
+		}
+	}
+
+#ifdef USE_IO_URING
+	/* Hand any new reads to the kernel. */
+	if ((A->U != NULL) && uring_enter(A->U, 0))
+		goto err0;
+#endif
+
+	/* Success! */
+	return (0);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/**
+ * asyncpread_init(depth, pool):
+ * Prepare to perform up to ${depth} preads at once.  On Linux, the reads are
+ * issued via io_uring if the kernel supports it; otherwise, each read is
+ * performed by one of the worker threads in ${pool}, or if ${pool} is NULL,
+ * synchronously by asyncpread_submit.  The pool must not be destroyed until
+ * the returned structure has been freed.
+ */
+struct asyncpread *
+asyncpread_init(size_t depth, struct parallel_pool * pool)
+{
+	struct asyncpread * A;
+
+	/* Allocate a structure. */
+	if ((A = malloc(sizeof(struct asyncpread))) == NULL)
+		goto err0;
+	A->depth = (depth > 0) ? depth : 1;
+	A->inflight = 0;
+	A->queue.head = A->queue.tail = NULL;
+	A->done.head = A->done.tail = NULL;
+	A->pool = pool;
+
+	/* Initialize the lock and condition variable for the done list. */
+	if ((errno = pthread_mutex_init(&A->mtx, NULL)) != 0) {
+		warnp("pthread_mutex_init");
+		goto err1;
+	}
+	if ((errno = pthread_cond_init(&A->cv, NULL)) != 0) {
+		warnp("pthread_cond_init");
+		goto err2;
+	}
+
+#ifdef USE_IO_URING
+	/* Use io_uring if we can. */
+	A->U = uring_init(A->depth);
+#endif
+
+	/* Success! */
+	return (A);
+
+err2:
+	pthread_mutex_destroy(&A->mtx);
+err1:
+	free(A);
+err0:
+	/* Failure! */
+	return (NULL);
+}
+
+/**
+ * asyncpread_submit(A, fd, buf, len, offset, cookie):
+ * Start reading ${len} bytes from ${fd} at ${offset} into ${buf}.  Once the
+ * read has completed, asyncpread_reap will return ${cookie}.  Reads beyond
+ * the depth passed to asyncpread_init are queued until earlier reads have
+ * been reaped.
+ */
+int
+asyncpread_submit(struct asyncpread * A, int fd, void * buf, size_t len,
+    off_t offset, void * cookie)
+{
+	struct req * R;
+
+	/* Record the read. */
+	if ((R = malloc(sizeof(struct req))) == NULL)
+		goto err0;
+	R->fd = fd;
+	R->buf = buf;
+	R->len = len;
+	R->offset = offset;
+	R->cookie = cookie;
+	R->done = 0;
+	R->err = 0;
+	R->job = NULL;
+	R->A = A;
+
+	/* Queue it, and start it if there's room. */
+	reqlist_push(&A->queue, R);
+	if (dispatch(A))
+		goto err0;
+
+	/* Success! */
+	return (0);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/**
+ * asyncpread_reap(A, cookie, res):
+ * Wait for one of the submitted reads to complete, and set ${cookie} to the
+ * cookie it was submitted with and ${res} to the number of bytes read (which
+ * is less than requested only if EOF was reached) or to -1 with errno set if
+ * the read failed.  Reads are not necessarily reaped in the order in which
+ * they were submitted.  This must not be called unless a submitted read has
+ * not yet been reaped.
+ */
+int
+asyncpread_reap(struct asyncpread * A, void ** cookie, ssize_t * res)
+{
+	struct req * R;
+	int err;
+
+	/* Lock the done list. */
+	if ((errno = pthread_mutex_lock(&A->mtx)) != 0) {
+		warnp("pthread_mutex_lock");
+		goto err0;
+	}
+
+	/* Wait until a read has completed. */
+	while ((R = reqlist_pop(&A->done)) == NULL) {
+#ifdef USE_IO_URING
+		if (A->U != NULL) {
+			/* Nobody else touches the done list in this mode. */
+			pthread_mutex_unlock(&A->mtx);
+			if (uring_enter(A->U, 1) || uring_reap(A))
+				goto err0;
+			if ((errno = pthread_mutex_lock(&A->mtx)) != 0) {
+				warnp("pthread_mutex_lock");
+				goto err0;
+			}
+			continue;
+		}
+#endif
+		if ((errno = pthread_cond_wait(&A->cv, &A->mtx)) != 0) {
+			warnp("pthread_cond_wait");
+			goto err1;
+		}
+	}
+
+	/* Unlock the done list. */
+	pthread_mutex_unlock(&A->mtx);
+
+	/*
+	 * Clean up the pool job, if any.  The result of the read is in R, so
+	 * we don't care what the job returned.
+	 */
+	if (R->job != NULL)
+		(void)parallel_pool_wait(R->job);
+	A->inflight--;
+
+	/* Return the read's cookie and result. */
+	*cookie = R->cookie;
+	*res = R->res;
+	err = R->err;
+	free(R);
+
+	/* Start any reads which were waiting for room. */
+	if (dispatch(A))
+		goto err0;
+
+	/* Set errno for a failed read. */
+	if (*res == -1)
+		errno = err;
+
+	/* Success! */
+	return (0);
+
+err1:
+	pthread_mutex_unlock(&A->mtx);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/**
+ * asyncpread_free(A):
+ * Free the structure.  All submitted reads must have been reaped.
+ */
+void
+asyncpread_free(struct asyncpread * A)
+{
+
+#ifdef USE_IO_URING
+	/* Tear down the io_uring. */
+	if (A->U != NULL)
+		uring_free(A->U);
+#endif
+
+	/* Free the lock, condition variable, and structure. */
+	pthread_cond_destroy(&A->cv);
+	pthread_mutex_destroy(&A->mtx);
+	free(A);
+}
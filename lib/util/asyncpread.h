@@ -0,0 +1,75 @@
+/*-
+ * Copyright 2012 Colin Percival
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions 
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _ASYNCPREAD_H_
+#define _ASYNCPREAD_H_
+
+#include <sys/types.h>
+
+#include <stddef.h>
+
+/* Opaque types. */
+struct asyncpread;
+struct parallel_pool;
+
+/**
+ * asyncpread_init(depth, pool):
+ * Prepare to perform up to ${depth} preads at once.  On Linux, the reads are
+ * issued via io_uring if the kernel supports it; otherwise, each read is
+ * performed by one of the worker threads in ${pool}, or if ${pool} is NULL,
+ * synchronously by asyncpread_submit.  The pool must not be destroyed until
+ * the returned structure has been freed.
+ */
+struct asyncpread * asyncpread_init(size_t, struct parallel_pool *);
+
+/**
+ * asyncpread_submit(A, fd, buf, len, offset, cookie):
+ * Start reading ${len} bytes from ${fd} at ${offset} into ${buf}.  Once the
+ * read has completed, asyncpread_reap will return ${cookie}.  Reads beyond
+ * the depth passed to asyncpread_init are queued until earlier reads have
+ * been reaped.
+ */
+int asyncpread_submit(struct asyncpread *, int, void *, size_t, off_t,
+    void *);
+
+/**
+ * asyncpread_reap(A, cookie, res):
+ * Wait for one of the submitted reads to complete, and set ${cookie} to the
+ * cookie it was submitted with and ${res} to the number of bytes read (which
+ * is less than requested only if EOF was reached) or to -1 with errno set if
+ * the read failed.  Reads are not necessarily reaped in the order in which
+ * they were submitted.  This must not be called unless a submitted read has
+ * not yet been reaped.
+ */
+int asyncpread_reap(struct asyncpread *, void **, ssize_t *);
+
+/**
+ * asyncpread_free(A):
+ * Free the structure.  All submitted reads must have been reaped.
+ */
+void asyncpread_free(struct asyncpread *);
+
+#endif /* !_ASYNCPREAD_H_ */
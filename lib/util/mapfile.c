@@ -35,6 +35,9 @@
 
 #include "mapfile.h"
 
+/* Where empty files are "mapped". */
+static uint8_t empty;
+
 /**
  * mapfile(name, fd, len):
  * Open the file ${name} and map it into memory.  Set ${fd} to the file
@@ -61,8 +64,13 @@ mapfile(const char * name, int * fd, size_t * len)
 		goto err1;
 	}
 
-	/* Map the file into memory. */
-	if ((ptr = mmap(NULL, sb.st_size, PROT_READ,
+	/*
+	 * Map the file into memory.  Some systems refuse to map zero bytes, so
+	 * for an empty file we return a pointer to nothing instead.
+	 */
+	if (sb.st_size == 0)
+		ptr = &empty;
+	else if ((ptr = mmap(NULL, sb.st_size, PROT_READ,
 #ifdef MAP_NOCORE
 	    MAP_PRIVATE | MAP_NOCORE,
 #else
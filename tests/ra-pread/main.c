@@ -0,0 +1,367 @@
+/*-
+ * Copyright 2012 Colin Percival
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions 
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Stress test for concurrent reads from a random-access patch: several
+ * threads make random and sequential bsdiff_ra_read_pread calls while
+ * changing the cache size and readahead depth, and another thread keeps
+ * asynchronous reads in flight; every read is checked against the new file.
+ * This is meant to be run under ThreadSanitizer or AddressSanitizer.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bsdiff_ra_read.h"
+#include "mapfile.h"
+#include "parallel_pool.h"
+#include "warnp.h"
+
+/* Longest random read, and longest read which continues the previous one. */
+#define READMAX		200000
+#define SEQREADMAX	20000
+
+/* Number of asynchronous reads kept in flight. */
+#define ASYNCDEPTH	6
+
+/* State shared by the reading threads. */
+struct test {
+	struct bsdiff_ra_read_file * F;
+	const uint8_t * new;
+	size_t newsize;
+	size_t nreads;
+};
+
+/* One reading thread. */
+struct reader {
+	struct test * T;
+	unsigned int seed;
+	pthread_t thr;
+	int failed;
+};
+
+static void usage(void)
+{
+
+	(void)fprintf(stderr, "usage: test_ra_pread [-m] [-n nreads] "
+	    "[-P ncores] [-T nthreads]\n"
+	    "    oldfile patchfile newfile\n");
+	exit(1);
+}
+
+/* Check that a read of len bytes at off returned the right data. */
+static int
+check(struct test * T, const uint8_t * buf, size_t off, size_t len,
+    ssize_t r)
+{
+	size_t explen;
+
+	/* Reads stop at the end of the new file. */
+	explen = (off + len > T->newsize) ? T->newsize - off : len;
+	if ((r != (ssize_t)explen) || memcmp(buf, &T->new[off], explen)) {
+		warn0("Wrong data read: %zu bytes at offset %zu", len, off);
+		return (-1);
+	}
+
+	/* Success! */
+	return (0);
+}
+
+/* Make random and sequential synchronous reads. */
+static void *
+readsync(void * cookie)
+{
+	struct reader * R = cookie;
+	struct test * T = R->T;
+	uint8_t * buf;
+	size_t off, len, next = 0;
+	size_t k;
+	ssize_t r;
+
+	/* Allocate a buffer. */
+	if ((buf = malloc(READMAX)) == NULL) {
+		warnp("malloc");
+		goto err0;
+	}
+
+	for (k = 0; k < T->nreads; k++) {
+		/* Odd seeds read sequentially; even seeds read anywhere. */
+		if (R->seed & 1) {
+			off = next;
+			len = rand_r(&R->seed) % SEQREADMAX;
+		} else {
+			off = rand_r(&R->seed) % T->newsize;
+			len = rand_r(&R->seed) % READMAX;
+		}
+		if (off >= T->newsize)
+			off = 0;
+		next = off + len;
+
+		/* Read and check the data. */
+		if ((r = bsdiff_ra_read_pread(T->F, buf, len, off)) == -1) {
+			warnp("bsdiff_ra_read_pread");
+			goto err1;
+		}
+		if (check(T, buf, off, len, r))
+			goto err1;
+
+		/* Change the settings under the other threads' feet. */
+		if ((k % 50) == 0)
+			bsdiff_ra_read_setcache(T->F,
+			    (rand_r(&R->seed) % 4) * 300000);
+		if ((k % 70) == 0)
+			bsdiff_ra_read_setreadahead(T->F,
+			    rand_r(&R->seed) % 8);
+	}
+
+	/* Free the buffer. */
+	free(buf);
+
+	/* Success! */
+	return (NULL);
+
+err1:
+	free(buf);
+err0:
+	/* Failure! */
+	R->failed = 1;
+	return (NULL);
+}
+
+/* Keep several asynchronous reads in flight. */
+static void *
+readasync(void * cookie)
+{
+	struct reader * R = cookie;
+	struct test * T = R->T;
+	uint8_t * buf[ASYNCDEPTH];
+	size_t off[ASYNCDEPTH], len[ASYNCDEPTH];
+	int busy[ASYNCDEPTH];
+	size_t k, npending;
+	void * c;
+	ssize_t r;
+	size_t j;
+
+	/* Allocate buffers. */
+	for (j = 0; j < ASYNCDEPTH; j++) {
+		busy[j] = 0;
+		if ((buf[j] = malloc(READMAX)) == NULL) {
+			warnp("malloc");
+			goto err1;
+		}
+	}
+
+	for (k = npending = 0; (k < T->nreads) || (npending > 0); ) {
+		/* Submit another read if we have a free buffer. */
+		for (j = 0; (j < ASYNCDEPTH) && busy[j]; j++)
+			continue;
+		if ((k < T->nreads) && (j < ASYNCDEPTH)) {
+			off[j] = rand_r(&R->seed) % T->newsize;
+			len[j] = rand_r(&R->seed) % READMAX;
+			if (bsdiff_ra_read_submit(T->F, buf[j], len[j], off[j],
+			    &busy[j])) {
+				warnp("bsdiff_ra_read_submit");
+				goto err2;
+			}
+			busy[j] = 1;
+			npending++;
+			k++;
+			continue;
+		}
+
+		/* Otherwise, wait for one to finish and check it. */
+		if (bsdiff_ra_read_reap(T->F, &c, &r)) {
+			warnp("bsdiff_ra_read_reap");
+			goto err2;
+		}
+		npending--;
+		j = (size_t)((int *)c - busy);
+		busy[j] = 0;
+		if (check(T, buf[j], off[j], len[j], r))
+			goto err2;
+	}
+
+	/* Free buffers. */
+	for (j = 0; j < ASYNCDEPTH; j++)
+		free(buf[j]);
+
+	/* Success! */
+	return (NULL);
+
+err2:
+	/* Reap anything still in flight before the buffers go away. */
+	while (npending-- > 0)
+		bsdiff_ra_read_reap(T->F, &c, &r);
+	j = ASYNCDEPTH;
+err1:
+	while (j-- > 0)
+		free(buf[j]);
+
+	/* Failure! */
+	R->failed = 1;
+	return (NULL);
+}
+
+#define OPT_EPARSE(ch, optarg) do {				\
+	warnp("Error parsing argument: -%c %s", ch, optarg);	\
+	exit(1);						\
+} while (0)
+
+int
+main(int argc, char * argv[])
+{
+	struct test T;
+	struct reader * R;
+	struct parallel_pool * pool = NULL;
+	char * eptr;
+	intmax_t optparse;
+	size_t nthreads, P, i;
+	uint64_t hits, misses;
+	size_t cached;
+	int newfd;
+	int flags;
+	int failed;
+	int ch;
+
+	WARNP_INIT;
+
+	/* Set default values. */
+	T.nreads = 300;
+	nthreads = 8;
+	P = 0;
+	flags = 0;
+
+	/* Process command line. */
+	while ((ch = getopt(argc, argv, "mn:P:T:")) != -1) {
+		switch ((char)ch) {
+		case 'm':
+			flags |= BSDIFF_RA_READ_MMAP;
+			break;
+		case 'n':
+			optparse = strtoimax(optarg, &eptr, 0);
+			if ((*eptr != '\0') || (optparse < 1))
+				OPT_EPARSE(ch, optarg);
+			T.nreads = optparse;
+			break;
+		case 'P':
+			optparse = strtoimax(optarg, &eptr, 0);
+			if ((*eptr != '\0') || (optparse < 0) ||
+			    (optparse > 64))
+				OPT_EPARSE(ch, optarg);
+			P = optparse;
+			break;
+		case 'T':
+			optparse = strtoimax(optarg, &eptr, 0);
+			if ((*eptr != '\0') || (optparse < 1) ||
+			    (optparse > 64))
+				OPT_EPARSE(ch, optarg);
+			nthreads = optparse;
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	/* We should have three arguments left. */
+	if (argc != 3)
+		usage();
+
+	/* Map the new file, to check against. */
+	if ((T.new = mapfile(argv[2], &newfd, &T.newsize)) == NULL) {
+		warnp("Cannot map file: %s", argv[2]);
+		exit(1);
+	}
+	if (T.newsize == 0) {
+		warn0("New file is empty: %s", argv[2]);
+		exit(1);
+	}
+
+	/* Open the patch. */
+	if ((T.F = bsdiff_ra_read_open(argv[1], argv[0], flags)) == NULL) {
+		warnp("Cannot open patch: %s", argv[1]);
+		exit(1);
+	}
+
+	/* Patch and read ahead in a pool if asked to. */
+	if (P > 0) {
+		if ((pool = parallel_pool_create(P, 0)) == NULL) {
+			warnp("parallel_pool_create");
+			exit(1);
+		}
+		bsdiff_ra_read_setpool(T.F, pool);
+	}
+
+	/* Start the synchronous readers and one asynchronous reader. */
+	if ((R = malloc((nthreads + 1) * sizeof(struct reader))) == NULL) {
+		warnp("malloc");
+		exit(1);
+	}
+	for (i = 0; i <= nthreads; i++) {
+		R[i].T = &T;
+		R[i].seed = i + 1;
+		R[i].failed = 0;
+		if ((errno = pthread_create(&R[i].thr, NULL,
+		    (i < nthreads) ? readsync : readasync, &R[i])) != 0) {
+			warnp("pthread_create");
+			exit(1);
+		}
+	}
+
+	/* Wait for them to finish. */
+	failed = 0;
+	for (i = 0; i <= nthreads; i++) {
+		if ((errno = pthread_join(R[i].thr, NULL)) != 0) {
+			warnp("pthread_join");
+			exit(1);
+		}
+		failed |= R[i].failed;
+	}
+	free(R);
+
+	/* Report how the cache did. */
+	bsdiff_ra_read_stats(T.F, &hits, &misses, &cached);
+	printf("%" PRIu64 " cache hits, %" PRIu64 " misses, %zu bytes cached\n",
+	    hits, misses, cached);
+
+	/* Clean up. */
+	bsdiff_ra_read_close(T.F);
+	if (pool != NULL)
+		parallel_pool_destroy(pool);
+	unmapfile((void *)(uintptr_t)T.new, newfd, T.newsize);
+
+	/* Did everything match? */
+	if (failed)
+		exit(1);
+	printf("OK\n");
+	return (0);
+}